@@ -27,8 +27,51 @@
  */
 #ifndef KZR_ACCESS_PERMISSIONS_H__
 #define KZR_ACCESS_PERMISSIONS_H__
+#include <cstdint>
 
 namespace kzr {
+/**
+ * The bits of the mode field of a Stat and the permissions of a create
+ * request. The low nine bits are the usual owner/group/other permissions.
+ */
+enum class FileMode : uint32_t {
+    Directory = 0x80000000,
+    AppendOnly = 0x40000000,
+    Exclusive = 0x20000000,
+    Mount = 0x10000000,
+    Authentication = 0x08000000,
+    Temporary = 0x04000000,
+    PermissionMask = 0777,
+};
+constexpr bool hasMode(uint32_t mode, FileMode bit) noexcept {
+    return (mode & uint32_t(bit)) != 0;
+}
+/**
+ * The mode field of open and create requests
+ */
+enum class OpenMode : uint8_t {
+    Read = 0,
+    Write = 1,
+    ReadWrite = 2,
+    Execute = 3,
+    Truncate = 0x10,
+    RemoveOnClose = 0x40,
+};
+constexpr OpenMode getAccessMode(uint8_t mode) noexcept {
+    return static_cast<OpenMode>(mode & 3);
+}
+constexpr bool hasMode(uint8_t mode, OpenMode bit) noexcept {
+    return (mode & uint8_t(bit)) != 0;
+}
+constexpr bool allowsReading(uint8_t mode) noexcept {
+    auto access = getAccessMode(mode);
+    return access == OpenMode::Read || access == OpenMode::ReadWrite || access == OpenMode::Execute;
+}
+constexpr bool allowsWriting(uint8_t mode) noexcept {
+    auto access = getAccessMode(mode);
+    return access == OpenMode::Write || access == OpenMode::ReadWrite;
+}
+
 /**
  * Taken from intro(5) in the plan9 man pages.
  *
@@ -0,0 +1,170 @@
+/**
+ * @file
+ * Interface file servers implement to be hosted by a Server
+ * @copyright
+ * libkzr
+ * Copyright (c) 2019, Joshua Scoggins 
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR 
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef KZR_BACKEND_H__
+#define KZR_BACKEND_H__
+#include <functional>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include "Message.h"
+#include "Interaction.h"
+#include "Exception.h"
+
+namespace kzr {
+
+/**
+ * Where the payload of a read lives when it can be sent straight from a file
+ * descriptor or memory instead of being copied into a ReadResponse.
+ */
+struct ReadRegion {
+    /**
+     * Keeps the descriptor or memory alive until the response has been sent
+     */
+    std::shared_ptr<const void> owner;
+    /**
+     * When set the payload is taken from here, otherwise from the descriptor
+     */
+    const uint8_t* view = nullptr;
+    int descriptor = -1;
+    uint64_t offset = 0;
+    /**
+     * The exact number of bytes to send, already clamped to the end of the
+     * file and the count of the request
+     */
+    size_t count = 0;
+};
+
+/**
+ * The operations which make up a 9p2000 file server. A backend owns the fid
+ * table of a single connection (the Server creates one per connection) and
+ * reports failures by throwing an Exception, the message of which is sent
+ * back to the client as an Rerror. Version negotiation and tags are taken
+ * care of by the Server.
+ */
+class Backend {
+    public:
+        /**
+         * Sends the response of a request which was taken by submit, may be
+         * called from any thread. The tag is filled in by the server.
+         */
+        class Responder {
+            public:
+                using Plain = std::function<void(Response)>;
+                using Encoded = std::function<void(const EncodedResponse&)>;
+            public:
+                Responder() = default;
+                Responder(Plain plain, Encoded encoded = nullptr) : _plain(std::move(plain)), _encoded(std::move(encoded)) { }
+                template<typename T, typename = std::enable_if_t<std::is_convertible_v<T, Plain> && !std::is_same_v<std::decay_t<T>, Responder>>>
+                Responder(T&& plain) : _plain(std::forward<T>(plain)) { }
+                void operator()(Response response) const { _plain(std::move(response)); }
+                /**
+                 * Send a response which was encoded ahead of time (and which
+                 * may be shared with other responders) without encoding it
+                 * again
+                 */
+                void operator()(const EncodedResponse& response) const {
+                    if (_encoded) {
+                        _encoded(response);
+                    } else {
+                        _plain(response.decode());
+                    }
+                }
+                explicit operator bool() const noexcept { return bool(_plain); }
+            private:
+                Plain _plain;
+                Encoded _encoded;
+        };
+    public:
+        virtual ~Backend() = default;
+        /**
+         * Offered every request before it is dispatched normally. A backend
+         * which wants to answer it later (because it has to wait on storage
+         * or for an event) takes it by returning true and calls the
+         * responder exactly once when it is done; it may move out of the
+         * request in that case. Errors found right away can be thrown as
+         * usual.
+         * @return false to have the request dispatched normally
+         */
+        virtual bool submit(Request&, Responder) { return false; }
+        /**
+         * The client flushed a submitted request which has not been answered
+         * yet. A backend which parks requests indefinitely should answer it
+         * now, the Rflush is sent once it has been.
+         */
+        virtual void flush(uint16_t /* tag */) { }
+        virtual AuthenticationResponse auth(const AuthenticationRequest&) {
+            throw Exception("authentication not required");
+        }
+        virtual AttachResponse attach(const AttachRequest&) = 0;
+        virtual WalkResponse walk(const WalkRequest&) = 0;
+        virtual OpenResponse open(const OpenRequest&) = 0;
+        virtual CreateResponse create(const CreateRequest&) = 0;
+        virtual ReadResponse read(const ReadRequest&) = 0;
+        virtual WriteResponse write(const WriteRequest&) = 0;
+        /**
+         * Describe where the data of a read can be taken from without
+         * copying, errors are thrown as with read.
+         * @return false to have read called instead
+         */
+        virtual bool readRegion(const ReadRequest&, ReadRegion&) { return false; }
+        /**
+         * Report the current qid of the file an fid is open for reading when
+         * what a read of it returns depends on nothing but the qid, offset
+         * and count, so that the result can be shared with reads of other
+         * fids (and other connections).
+         * @return false if reads of the fid must not be shared
+         */
+        virtual bool identify(uint32_t /* fid */, Qid&) { return false; }
+        /**
+         * Report the current qid of the file behind an fid when its stat
+         * only ever changes along with the qid version, so that the encoded
+         * stat can be kept around until the version moves.
+         * @return false if stats of the fid must not be cached
+         */
+        virtual bool describe(uint32_t /* fid */, Qid&) { return false; }
+        /**
+         * Whether requests on different fids may be carried out at the same
+         * time on different threads. Requests on the same fid never overlap
+         * and flush may be called at any time.
+         */
+        virtual bool isConcurrent() const noexcept { return false; }
+        virtual ClunkResponse clunk(const ClunkRequest&) = 0;
+        virtual RemoveResponse remove(const RemoveRequest&) = 0;
+        virtual StatResponse stat(const StatRequest&) = 0;
+        virtual WStatResponse wstat(const WStatRequest&) = 0;
+        /**
+         * Called when the client renegotiates the version or hangs up, every
+         * fid has to be forgotten.
+         */
+        virtual void reset() { }
+};
+
+} // end namespace kzr
+
+#endif // end KZR_BACKEND_H__
@@ -0,0 +1,942 @@
+/**
+ * @file
+ * Synchronous 9p2000 client implementation
+ * @copyright
+ * libkzr
+ * Copyright (c) 2019, Joshua Scoggins 
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR 
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "Client.h"
+#include "Exception.h"
+#include <algorithm>
+#include <optional>
+
+namespace kzr {
+
+Client::Client(Connection& connection) : _connection(connection) { }
+
+uint16_t
+Client::allocateTag() {
+    for (uint32_t attempts = 0; attempts < notag; ++attempts) {
+        auto tag = _nextTag++;
+        if (tag == notag) {
+            continue;
+        }
+        if (_outstanding.count(tag) == 0 && _arrived.count(tag) == 0) {
+            return tag;
+        }
+    }
+    throw Exception("No free tags available!");
+}
+
+uint16_t
+Client::post(Request& request) {
+    auto tag = allocateTag();
+    std::visit([tag](auto&& value) { value.setTag(tag); }, request);
+    // version requests always use notag so ask the message what it ended up with
+    auto actual = std::visit([](auto&& value) { return value.getTag(); }, request);
+    MessageStream msg;
+    msg << request;
+    _connection << msg;
+    _outstanding.emplace(actual);
+    return actual;
+}
+
+Response
+Client::receive() {
+    MessageStream msg;
+    _connection >> msg;
+    Response response;
+    msg >> response;
+    return response;
+}
+
+Response
+Client::await(uint16_t tag) {
+    if (auto it = _arrived.find(tag); it != _arrived.end()) {
+        auto response = std::move(it->second);
+        _arrived.erase(it);
+        return response;
+    } else if (_outstanding.count(tag) == 0) {
+        throw Exception("Tag ", tag, " is not outstanding!");
+    }
+    while (true) {
+        auto response = receive();
+        auto current = std::visit([](auto&& value) { return value.getTag(); }, response);
+        if (_outstanding.erase(current) == 0) {
+            // not something we asked for, drop it
+            continue;
+        }
+        if (current == tag) {
+            return response;
+        } else {
+            _arrived.emplace(current, std::move(response));
+        }
+    }
+}
+
+uint32_t
+Client::allocateFid() {
+    if (!_freeFids.empty()) {
+        auto fid = _freeFids.back();
+        _freeFids.pop_back();
+        return fid;
+    } else if (_nextFid == nofid) {
+        throw Exception("No free fids available!");
+    } else {
+        return _nextFid++;
+    }
+}
+
+void
+Client::releaseFid(uint32_t fid) {
+    _fids.erase(fid);
+    _walkOrigins.erase(fid);
+    _freeFids.emplace_back(fid);
+}
+
+uint32_t
+Client::getIounit(uint32_t fid) const noexcept {
+    if (auto state = getFidState(fid); state && state->iounit != 0) {
+        return state->iounit;
+    } else {
+        return _msize - ioHeaderSize;
+    }
+}
+
+const Client::FidState*
+Client::getFidState(uint32_t fid) const noexcept {
+    if (auto it = _fids.find(fid); it != _fids.end()) {
+        return &it->second;
+    } else {
+        return nullptr;
+    }
+}
+
+void
+Client::noteQid(uint32_t fid, const Qid& qid) {
+    auto& state = _fids[fid];
+    state.qid = qid;
+    state.iounit = 0;
+    state.open = false;
+}
+
+void
+Client::setWalkCache(WalkCache* cache) {
+    if (_walkCache && _walkCache != cache) {
+        _walkCache->clear();
+        flushReleasedFids();
+    }
+    _walkOrigins.clear();
+    _walkCache = cache;
+}
+
+void
+Client::flushReleasedFids() {
+    if (!_walkCache) {
+        return;
+    }
+    auto fids = _walkCache->takeReleasedFids();
+    if (fids.empty()) {
+        return;
+    }
+    std::vector<uint16_t> tags;
+    for (auto fid : fids) {
+        ClunkRequest clunk;
+        clunk.setFid(fid);
+        Request req(std::in_place_type<ClunkRequest>, clunk);
+        tags.emplace_back(post(req));
+    }
+    for (auto tag : tags) {
+        // the fid is gone regardless of what the server says
+        await(tag);
+    }
+    for (auto fid : fids) {
+        releaseFid(fid);
+    }
+}
+
+void
+Client::validateOrigin(uint32_t fid, const Qid& observed) {
+    if (!_walkCache) {
+        return;
+    }
+    if (auto it = _walkOrigins.find(fid); it != _walkOrigins.end()) {
+        _walkCache->validate(it->second.first, it->second.second, observed);
+        flushReleasedFids();
+    }
+}
+
+void
+Client::forgetFid(uint32_t fid) {
+    if (_walkCache) {
+        _walkCache->invalidateRoot(fid);
+    }
+    releaseFid(fid);
+    flushReleasedFids();
+}
+
+std::string
+Client::version(uint32_t msize, const std::string& ver) {
+    VersionRequest req;
+    req.setMsize(msize);
+    req.setVersion(ver);
+    auto response = call<ConceptualOperation::Version>(req);
+    if (response.getVersion() == "unknown") {
+        throw Exception("Server does not understand version ", ver);
+    }
+    _msize = std::min(msize, response.getMsize());
+    if (_msize <= ioHeaderSize) {
+        throw Exception("Negotiated msize of ", _msize, " is too small!");
+    }
+    return response.getVersion();
+}
+
+Qid
+Client::attach(uint32_t fid, const std::string& uname, const std::string& aname, uint32_t afid) {
+    AttachRequest req;
+    req.setFid(fid);
+    req.setAuthenticationHandle(afid);
+    req.setUserName(uname);
+    req.setAttachName(aname);
+    auto response = call<ConceptualOperation::Attach>(req);
+    noteQid(fid, response.getQid());
+    return response.getQid();
+}
+
+std::vector<Qid>
+Client::walk(uint32_t fid, uint32_t newfid, const std::vector<std::string>& names) {
+    if (names.size() > maximumWalkElements) {
+        throw Exception("Attempted to walk ", names.size(), " elements when ", maximumWalkElements, " is the maximum allowed!");
+    }
+    if (_walkCache && newfid != fid && !names.empty()) {
+        return cachedWalk(fid, newfid, names);
+    } else {
+        return uncachedWalk(fid, newfid, names);
+    }
+}
+
+std::vector<Qid>
+Client::uncachedWalk(uint32_t fid, uint32_t newfid, const std::vector<std::string>& names) {
+    WalkRequest req;
+    req.setFid(fid);
+    req.setNewFid(newfid);
+    req.getWname() = names;
+    auto qids = call<ConceptualOperation::Walk>(req).getWqid();
+    if (names.empty()) {
+        // fid clone, newfid refers to the same file but is not open
+        if (auto state = getFidState(fid); state) {
+            noteQid(newfid, state->qid);
+        }
+    } else if (qids.size() == names.size()) {
+        noteQid(newfid, qids.back());
+    }
+    return qids;
+}
+
+std::vector<Qid>
+Client::cachedWalk(uint32_t fid, uint32_t newfid, const std::vector<std::string>& names) {
+    if (auto entry = _walkCache->find(fid, names); entry) {
+        if (entry->negative) {
+            if (!entry->error.empty()) {
+                throw Exception(entry->error);
+            }
+            return entry->qids;
+        }
+        auto qids = entry->qids;
+        auto cachedFid = entry->fid;
+        try {
+            uncachedWalk(cachedFid, newfid, {});
+            noteQid(newfid, qids.back());
+            _walkOrigins[newfid] = std::make_pair(fid, names);
+            return qids;
+        } catch (Exception&) {
+            // the cached fid has gone bad, forget about it and walk for real
+            _walkCache->invalidate(fid, names);
+            flushReleasedFids();
+        }
+    }
+    // pipeline the walk the caller asked for with a second one which leaves
+    // a fid behind for the cache, this keeps a miss at one round trip
+    auto cacheFid = allocateFid();
+    WalkRequest forCaller;
+    forCaller.setFid(fid);
+    forCaller.setNewFid(newfid);
+    forCaller.getWname() = names;
+    WalkRequest forCache(forCaller);
+    forCache.setNewFid(cacheFid);
+    Request callerReq(std::in_place_type<WalkRequest>, forCaller);
+    Request cacheReq(std::in_place_type<WalkRequest>, forCache);
+    auto callerTag = post(callerReq);
+    auto cacheTag = post(cacheReq);
+    auto callerResponse = await(callerTag);
+    auto cacheResponse = await(cacheTag);
+    if (auto walked = std::get_if<WalkResponse>(&cacheResponse); walked && walked->getWqid().size() == names.size()) {
+        noteQid(cacheFid, walked->getWqid().back());
+        _walkCache->insert(fid, names, walked->getWqid(), cacheFid);
+    } else {
+        // nothing was created on the server side
+        releaseFid(cacheFid);
+    }
+    std::optional<uint64_t> start;
+    if (auto state = getFidState(fid); state) {
+        start = state->qid.getPath();
+    }
+    if (auto err = std::get_if<ErrorResponse>(&callerResponse); err) {
+        _walkCache->insertNegative(fid, names, {}, err->getErrorName(), start);
+        flushReleasedFids();
+        throw Exception(err->getErrorName());
+    }
+    auto qids = unpack<ConceptualOperation::Walk>(std::move(callerResponse)).getWqid();
+    if (qids.size() == names.size()) {
+        noteQid(newfid, qids.back());
+        _walkOrigins[newfid] = std::make_pair(fid, names);
+    } else {
+        _walkCache->insertNegative(fid, names, qids, "", start);
+    }
+    flushReleasedFids();
+    return qids;
+}
+
+OpenResponse
+Client::open(uint32_t fid, uint8_t mode) {
+    OpenRequest req;
+    req.setFid(fid);
+    req.setMode(mode);
+    auto response = call<ConceptualOperation::Open>(req);
+    auto& state = _fids[fid];
+    state.qid = response.getQid();
+    state.iounit = response.getIounit();
+    state.open = true;
+    state.written = false;
+    observeQid(response.getQid());
+    validateOrigin(fid, response.getQid());
+    return response;
+}
+
+CreateResponse
+Client::create(uint32_t fid, const std::string& name, uint32_t perm, uint8_t mode) {
+    CreateRequest req;
+    req.setFid(fid);
+    req.setName(name);
+    req.setPermissions(perm);
+    req.setMode(mode);
+    auto response = call<ConceptualOperation::Create>(req);
+    std::optional<uint64_t> directory;
+    if (auto state = getFidState(fid); state) {
+        directory = state->qid.getPath();
+        if (_statCache) {
+            // the directory gained an entry
+            _statCache->invalidate(state->qid.getPath());
+        }
+    }
+    // the fid now refers to the new file so anything cached from it is stale
+    if (_walkCache) {
+        _walkCache->invalidateRoot(fid);
+        // and walks from other fids which missed the name are wrong now
+        _walkCache->invalidateName(name, directory);
+        flushReleasedFids();
+    }
+    _walkOrigins.erase(fid);
+    auto& state = _fids[fid];
+    state.qid = response.getQid();
+    state.iounit = response.getIounit();
+    state.open = true;
+    state.written = false;
+    observeQid(response.getQid());
+    return response;
+}
+
+std::vector<uint8_t>
+Client::read(uint32_t fid, uint64_t offset, uint32_t count) {
+    // reads have to observe the writes which came before them
+    flush(fid);
+    std::vector<uint8_t> result;
+    auto state = getFidState(fid);
+    if (state && _pageCache && isPageCacheable(*state)) {
+        result = cachedRead(fid, *state, offset, count);
+    } else if (_readAheadPolicy.enabled && !(state && state->qid.isDirectory())) {
+        // directory offsets only mean something to the server, reading
+        // ahead of them gets records the caller never asked for
+        result = readAheadRead(fid, offset, count);
+    } else {
+        result = uncachedRead(fid, offset, count);
+    }
+    if (state = getFidState(fid); state && _statCache && state->qid.isDirectory()) {
+        // a directory read is a run of stat records, keep them around
+        _statCache->prefill(result);
+    }
+    return result;
+}
+
+std::vector<uint8_t>
+Client::uncachedRead(uint32_t fid, uint64_t offset, uint32_t count) {
+    ReadRequest req;
+    req.setFid(fid);
+    req.setOffset(offset);
+    req.setCount(count);
+    auto response = call<ConceptualOperation::Read>(req);
+    return std::move(response.getData());
+}
+
+uint32_t
+Client::write(uint32_t fid, uint64_t offset, const std::vector<uint8_t>& data) {
+    // anything prefetched is about to be stale
+    cancelReadAhead(fid);
+    if (_writeBehindPolicy.enabled) {
+        return bufferedWrite(fid, offset, data);
+    }
+    WriteRequest req;
+    req.setFid(fid);
+    req.setOffset(offset);
+    req.getData() = data;
+    auto response = call<ConceptualOperation::Write>(req);
+    invalidateContents(fid);
+    return response.getCount();
+}
+
+void
+Client::clunk(uint32_t fid) {
+    cancelReadAhead(fid);
+    // buffered writes have to land before the fid goes away, a failure is
+    // reported only after the fid has been clunked so it does not leak
+    std::optional<Exception> failure;
+    try {
+        flush(fid);
+    } catch (Exception& e) {
+        failure.emplace(e.message());
+    }
+    ClunkRequest req;
+    req.setFid(fid);
+    Request wrapped(std::in_place_type<ClunkRequest>, req);
+    auto response = transact(wrapped);
+    // a clunk always gets rid of the fid even when the server complains
+    forgetFid(fid);
+    if (failure) {
+        throw *failure;
+    }
+    unpack<ConceptualOperation::Clunk>(std::move(response));
+}
+
+void
+Client::remove(uint32_t fid) {
+    cancelReadAhead(fid);
+    // the file is going away so buffered data does not matter
+    discardWrites(fid);
+    RemoveRequest req;
+    req.setFid(fid);
+    Request wrapped(std::in_place_type<RemoveRequest>, req);
+    auto response = transact(wrapped);
+    invalidateContents(fid);
+    if (auto state = getFidState(fid); state && _walkCache) {
+        _walkCache->invalidateQid(state->qid.getPath());
+    }
+    // like clunk, the fid is gone even if the remove failed
+    forgetFid(fid);
+    unpack<ConceptualOperation::Remove>(std::move(response));
+}
+
+Stat
+Client::stat(uint32_t fid) {
+    // the length and version should reflect everything written so far
+    flush(fid);
+    if (auto state = getFidState(fid); state && _statCache) {
+        if (auto hit = _statCache->find(state->qid.getPath()); hit) {
+            _fids[fid].qid = hit->getQid();
+            return *hit;
+        }
+    }
+    StatRequest req;
+    req.setFid(fid);
+    auto response = call<ConceptualOperation::Stat>(req);
+    MessageStream msg;
+    msg.str(response.getData());
+    Stat result;
+    msg >> result;
+    if (_statCache) {
+        _statCache->insert(result);
+    }
+    if (auto it = _fids.find(fid); it != _fids.end()) {
+        it->second.qid = result.getQid();
+        it->second.written = false;
+    }
+    observeQid(result.getQid());
+    validateOrigin(fid, result.getQid());
+    return result;
+}
+
+void
+Client::wstat(uint32_t fid, const Stat& value) {
+    WStatRequest req;
+    req.setFid(fid);
+    req.setStat(value);
+    cancelReadAhead(fid);
+    flush(fid);
+    call<ConceptualOperation::WStat>(req);
+    // could have been a truncate
+    invalidateContents(fid);
+    if (auto state = getFidState(fid); state && _walkCache) {
+        // could have been a rename, anything walking through this file is suspect
+        _walkCache->invalidateQid(state->qid.getPath());
+        flushReleasedFids();
+    }
+    if (_walkCache && !value.getName().empty()) {
+        // which directory the file is in isn't known here, so every miss of
+        // the new name goes
+        _walkCache->invalidateName(value.getName());
+    }
+}
+
+bool
+Client::isPageCacheable(const FidState& state) const noexcept {
+    // directories, append only and exclusive use files do not behave like
+    // plain byte arrays so leave them alone
+    const auto& qid = state.qid;
+    return state.open &&
+           !state.written &&
+           !qid.isDirectory() &&
+           !qid.hasType(QidType::AppendOnly) &&
+           !qid.hasType(QidType::Exclusive) &&
+           (_cacheUnversioned || qid.getVersion() != 0);
+}
+
+void
+Client::observeQid(const Qid& qid) {
+    if (_pageCache) {
+        _pageCache->observe(qid.getPath(), qid.getVersion());
+    }
+}
+
+void
+Client::invalidateContents(uint32_t fid) {
+    if (auto it = _fids.find(fid); it != _fids.end()) {
+        it->second.written = true;
+        if (_pageCache) {
+            _pageCache->invalidate(it->second.qid.getPath());
+        }
+        if (_statCache) {
+            _statCache->invalidate(it->second.qid.getPath());
+        }
+    }
+}
+
+std::vector<uint8_t>
+Client::cachedRead(uint32_t fid, const FidState& state, uint64_t offset, uint32_t count) {
+    auto pageSize = _pageCache->getPageSize();
+    if (count == 0) {
+        return std::vector<uint8_t>();
+    } else if (pageSize > getIounit(fid)) {
+        // a page has to come back in a single Rread
+        return uncachedRead(fid, offset, count);
+    }
+    auto path = state.qid.getPath();
+    auto version = state.qid.getVersion();
+    auto first = offset / pageSize;
+    auto last = (offset + count - 1) / pageSize;
+    std::vector<std::vector<uint8_t>> pages(last - first + 1);
+    std::vector<std::pair<uint64_t, uint16_t>> misses;
+    // post every missing page before waiting on any of them so a read which
+    // misses several pages still costs one round trip
+    for (auto page = first; page <= last; ++page) {
+        if (auto hit = _pageCache->find(path, version, page); hit) {
+            pages[page - first] = *hit;
+        } else {
+            ReadRequest req;
+            req.setFid(fid);
+            req.setOffset(page * pageSize);
+            req.setCount(pageSize);
+            Request wrapped(std::in_place_type<ReadRequest>, req);
+            misses.emplace_back(page, post(wrapped));
+        }
+    }
+    std::vector<Response> responses;
+    for (const auto& miss : misses) {
+        responses.emplace_back(await(miss.second));
+    }
+    for (size_t i = 0; i < misses.size(); ++i) {
+        auto data = std::move(unpack<ConceptualOperation::Read>(std::move(responses[i])).getData());
+        pages[misses[i].first - first] = data;
+        _pageCache->insert(path, version, misses[i].first, std::move(data));
+    }
+    std::vector<uint8_t> result;
+    result.reserve(count);
+    for (size_t i = 0; i < pages.size() && result.size() < count; ++i) {
+        const auto& page = pages[i];
+        size_t start = (i == 0) ? (offset % pageSize) : 0;
+        if (start < page.size()) {
+            auto amount = std::min<size_t>(page.size() - start, count - result.size());
+            result.insert(result.end(), page.begin() + start, page.begin() + start + amount);
+        }
+        if (page.size() < pageSize) {
+            // short page, end of file
+            break;
+        }
+    }
+    return result;
+}
+
+void
+Client::setReadAheadPolicy(const ReadAheadPolicy& policy) {
+    if (!policy.enabled) {
+        std::vector<uint32_t> fids;
+        for (const auto& entry : _readAhead) {
+            fids.emplace_back(entry.first);
+        }
+        for (auto fid : fids) {
+            cancelReadAhead(fid);
+        }
+    }
+    _readAheadPolicy = policy;
+}
+
+void
+Client::completePrefetch(Prefetch& prefetch) {
+    if (!prefetch.ready) {
+        prefetch.ready = true;
+        prefetch.data = std::move(unpack<ConceptualOperation::Read>(await(prefetch.tag)).getData());
+    }
+}
+
+void
+Client::discardPrefetches(ReadAheadState& state) {
+    // there is no way to take a Tread back without a Tflush round trip so
+    // just collect the responses and throw them away
+    for (auto& prefetch : state.pending) {
+        if (!prefetch.ready) {
+            await(prefetch.tag);
+        }
+        _readAheadBytes -= prefetch.requested;
+    }
+    state.pending.clear();
+}
+
+void
+Client::cancelReadAhead(uint32_t fid) {
+    if (auto it = _readAhead.find(fid); it != _readAhead.end()) {
+        auto state = std::move(it->second);
+        _readAhead.erase(it);
+        discardPrefetches(state);
+    }
+}
+
+Client::Prefetch
+Client::postPrefetch(uint32_t fid, uint64_t offset, uint32_t count) {
+    ReadRequest req;
+    req.setFid(fid);
+    req.setOffset(offset);
+    req.setCount(count);
+    Request wrapped(std::in_place_type<ReadRequest>, req);
+    Prefetch prefetch;
+    prefetch.offset = offset;
+    prefetch.requested = count;
+    prefetch.tag = post(wrapped);
+    _readAheadBytes += count;
+    return prefetch;
+}
+
+void
+Client::fillWindow(uint32_t fid, ReadAheadState& state) {
+    auto chunk = getIounit(fid);
+    while (!state.hitEnd &&
+           state.pending.size() < state.window &&
+           _readAheadBytes + chunk <= _readAheadPolicy.memoryBudget) {
+        state.pending.emplace_back(postPrefetch(fid, state.postOffset, chunk));
+        state.postOffset += chunk;
+    }
+}
+
+std::vector<uint8_t>
+Client::readAheadRead(uint32_t fid, uint64_t offset, uint32_t count) {
+    auto& state = _readAhead[fid];
+    if (offset != state.nextOffset) {
+        // random access, stop prefetching until a new run shows up
+        discardPrefetches(state);
+        state.streak = 0;
+        state.window = 2;
+        state.hitEnd = false;
+    } else {
+        ++state.streak;
+    }
+    if (state.streak < _readAheadPolicy.trigger && state.pending.empty()) {
+        auto data = uncachedRead(fid, offset, count);
+        state.nextOffset = offset + data.size();
+        return data;
+    }
+    if (state.pending.empty()) {
+        state.postOffset = offset;
+        state.hitEnd = false;
+    } else if (state.window < _readAheadPolicy.maximumWindow) {
+        state.window = std::min(state.window * 2, _readAheadPolicy.maximumWindow);
+    }
+    fillWindow(fid, state);
+    std::vector<uint8_t> result;
+    result.reserve(count);
+    auto current = offset;
+    try {
+        while (result.size() < count && !state.pending.empty()) {
+            auto& front = state.pending.front();
+            if (current < front.offset || current >= front.offset + front.requested) {
+                break;
+            }
+            completePrefetch(front);
+            auto start = current - front.offset;
+            if (start < front.data.size()) {
+                auto amount = std::min<size_t>(front.data.size() - start, count - result.size());
+                result.insert(result.end(), front.data.begin() + start, front.data.begin() + start + amount);
+                current += amount;
+            }
+            bool shortRead = front.data.size() < front.requested;
+            if (shortRead && current >= front.offset + front.data.size()) {
+                if (front.data.empty()) {
+                    // end of file, everything after this chunk is past the end
+                    state.hitEnd = true;
+                    discardPrefetches(state);
+                    break;
+                }
+                // a short read is not the end of the file until an empty one
+                // says so, ask for the rest of the chunk in its place
+                auto gap = front.offset + front.data.size();
+                auto missing = uint32_t(front.requested - front.data.size());
+                _readAheadBytes -= front.requested;
+                front = postPrefetch(fid, gap, missing);
+                continue;
+            }
+            if (current >= front.offset + front.requested) {
+                _readAheadBytes -= front.requested;
+                state.pending.pop_front();
+                fillWindow(fid, state);
+            }
+        }
+    } catch (Exception&) {
+        cancelReadAhead(fid);
+        throw;
+    }
+    if (result.size() < count && !state.hitEnd) {
+        // the memory budget kept us from prefetching everything
+        auto rest = uncachedRead(fid, current, count - result.size());
+        result.insert(result.end(), rest.begin(), rest.end());
+        current += rest.size();
+        state.postOffset = std::max(state.postOffset, current);
+    }
+    state.nextOffset = current;
+    return result;
+}
+
+std::vector<uint8_t>
+Client::readRange(uint32_t fid, uint64_t offset, uint64_t length, size_t maximumOutstanding) {
+    // like read, the writes which came before have to land first
+    flush(fid);
+    auto chunk = getIounit(fid);
+    if (maximumOutstanding == 0) {
+        maximumOutstanding = std::max<size_t>(1, _readAheadPolicy.memoryBudget / chunk);
+    }
+    std::vector<uint8_t> result;
+    std::deque<std::pair<uint32_t, uint16_t>> inFlight;
+    uint64_t posted = 0;
+    bool hitEnd = false;
+    auto postAt = [&](uint64_t at, uint32_t amount) {
+        ReadRequest req;
+        req.setFid(fid);
+        req.setOffset(at);
+        req.setCount(amount);
+        Request wrapped(std::in_place_type<ReadRequest>, req);
+        return post(wrapped);
+    };
+    auto postNext = [&]() {
+        auto amount = uint32_t(std::min<uint64_t>(chunk, length - posted));
+        inFlight.emplace_back(amount, postAt(offset + posted, amount));
+        posted += amount;
+    };
+    while (posted < length && inFlight.size() < maximumOutstanding) {
+        postNext();
+    }
+    std::optional<Exception> failure;
+    while (!inFlight.empty()) {
+        auto [requested, tag] = inFlight.front();
+        inFlight.pop_front();
+        auto response = await(tag);
+        if (hitEnd || failure) {
+            // drain whatever is still outstanding before reporting back
+            continue;
+        }
+        try {
+            auto data = std::move(unpack<ConceptualOperation::Read>(std::move(response)).getData());
+            result.insert(result.end(), data.begin(), data.end());
+            if (data.empty()) {
+                hitEnd = true;
+            } else if (data.size() < requested) {
+                // only an empty read marks the end, the rest of the chunk
+                // goes ahead of everything posted after it
+                auto missing = uint32_t(requested - data.size());
+                inFlight.emplace_front(missing, postAt(offset + result.size(), missing));
+            } else if (posted < length) {
+                postNext();
+            }
+        } catch (Exception& e) {
+            failure.emplace(e.message());
+        }
+    }
+    if (failure) {
+        throw *failure;
+    }
+    return result;
+}
+
+void
+Client::setWriteBehindPolicy(const WriteBehindPolicy& policy) {
+    flushAll();
+    _writeBehindPolicy = policy;
+}
+
+uint32_t
+Client::bufferedWrite(uint32_t fid, uint64_t offset, const std::vector<uint8_t>& data) {
+    auto& state = _writeBehind[fid];
+    if (state.error) {
+        auto message = *state.error;
+        state.error.reset();
+        throw Exception(message);
+    }
+    if (!state.buffer.empty() && offset != state.bufferOffset + state.buffer.size()) {
+        // not a continuation of what we have, push the old run out first
+        submitBuffer(fid, state, true);
+    }
+    if (state.buffer.empty()) {
+        state.bufferOffset = offset;
+    }
+    state.buffer.insert(state.buffer.end(), data.begin(), data.end());
+    submitBuffer(fid, state, false);
+    return uint32_t(data.size());
+}
+
+void
+Client::submitBuffer(uint32_t fid, WriteBehindState& state, bool partial) {
+    auto chunk = getIounit(fid);
+    size_t consumed = 0;
+    while (state.buffer.size() - consumed >= chunk || (partial && consumed < state.buffer.size())) {
+        auto amount = std::min<size_t>(chunk, state.buffer.size() - consumed);
+        std::vector<uint8_t> piece(state.buffer.begin() + consumed, state.buffer.begin() + consumed + amount);
+        submitWrite(fid, state, state.bufferOffset + consumed, std::move(piece));
+        consumed += amount;
+    }
+    if (consumed > 0) {
+        state.buffer.erase(state.buffer.begin(), state.buffer.begin() + consumed);
+        state.bufferOffset += consumed;
+    }
+}
+
+void
+Client::submitWrite(uint32_t fid, WriteBehindState& state, uint64_t offset, std::vector<uint8_t>&& data) {
+    while (state.inFlight.size() >= std::max<size_t>(1, _writeBehindPolicy.window)) {
+        retireWrite(fid, state);
+    }
+    WriteRequest req;
+    req.setFid(fid);
+    req.setOffset(offset);
+    req.getData() = data;
+    Request wrapped(std::in_place_type<WriteRequest>, req);
+    PendingWrite pending { offset, std::move(data), post(wrapped) };
+    state.inFlight.emplace_back(std::move(pending));
+    invalidateContents(fid);
+}
+
+void
+Client::retireWrite(uint32_t fid, WriteBehindState& state) {
+    auto pending = std::move(state.inFlight.front());
+    state.inFlight.pop_front();
+    auto response = await(pending.tag);
+    // a short write is followed up with the rest right away, and waited on
+    // so nothing posted from here on can land ahead of it
+    while (!state.error) {
+        if (auto err = std::get_if<ErrorResponse>(&response); err) {
+            state.error = err->getErrorName();
+        } else if (auto written = std::get_if<WriteResponse>(&response); !written) {
+            state.error = "Unexpected response kind from server!";
+        } else if (auto count = written->getCount(); count == 0) {
+            state.error = "Server accepted none of a " + std::to_string(pending.data.size()) + " byte write";
+        } else if (count < pending.data.size()) {
+            pending.data.erase(pending.data.begin(), pending.data.begin() + count);
+            pending.offset += count;
+            WriteRequest req;
+            req.setFid(fid);
+            req.setOffset(pending.offset);
+            req.getData() = pending.data;
+            Request wrapped(std::in_place_type<WriteRequest>, req);
+            response = await(post(wrapped));
+            continue;
+        }
+        break;
+    }
+}
+
+void
+Client::flush(uint32_t fid) {
+    auto it = _writeBehind.find(fid);
+    if (it == _writeBehind.end()) {
+        return;
+    }
+    auto& state = it->second;
+    if (!state.error) {
+        submitBuffer(fid, state, true);
+    }
+    while (!state.inFlight.empty()) {
+        retireWrite(fid, state);
+    }
+    auto error = std::move(state.error);
+    _writeBehind.erase(it);
+    if (error) {
+        throw Exception(*error);
+    }
+}
+
+void
+Client::flushAll() {
+    std::vector<uint32_t> fids;
+    for (const auto& entry : _writeBehind) {
+        fids.emplace_back(entry.first);
+    }
+    std::optional<Exception> failure;
+    for (auto fid : fids) {
+        try {
+            flush(fid);
+        } catch (Exception& e) {
+            if (!failure) {
+                failure.emplace(e.message());
+            }
+        }
+    }
+    if (failure) {
+        throw *failure;
+    }
+}
+
+void
+Client::discardWrites(uint32_t fid) {
+    if (auto it = _writeBehind.find(fid); it != _writeBehind.end()) {
+        for (auto& pending : it->second.inFlight) {
+            await(pending.tag);
+        }
+        _writeBehind.erase(it);
+    }
+}
+
+} // end namespace kzr
@@ -0,0 +1,295 @@
+/**
+ * @file
+ * Synchronous 9p2000 client built on top of a Connection
+ * @copyright
+ * libkzr
+ * Copyright (c) 2019, Joshua Scoggins 
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR 
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef KZR_CLIENT_H__
+#define KZR_CLIENT_H__
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <deque>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <optional>
+#include "Message.h"
+#include "Interaction.h"
+#include "Connection.h"
+#include "WalkCache.h"
+#include "PageCache.h"
+#include "StatCache.h"
+
+namespace kzr {
+
+/**
+ * A client which speaks 9p2000 over a single connection. Requests can either
+ * be performed one at a time via transact or pipelined by posting several
+ * requests and then awaiting their responses by tag. The client is not thread
+ * safe.
+ *
+ * Fids handed to the client should come from allocateFid so that they do not
+ * collide with the fids the client holds on to internally (for caching).
+ */
+class Client {
+    public:
+        static constexpr uint32_t defaultMsize = 8192;
+        static constexpr uint32_t nofid = uint32_t(~0);
+        /**
+         * The maximum number of path elements allowed in a single walk
+         */
+        static constexpr size_t maximumWalkElements = 16;
+        /**
+         * The number of bytes of a Rread or Twrite which are not payload
+         */
+        static constexpr uint32_t ioHeaderSize = 24;
+        /**
+         * What the client knows about a fid it has handed out
+         */
+        struct FidState {
+            Qid qid;
+            uint32_t iounit = 0;
+            bool open = false;
+            /**
+             * Set once the client has written through the fid, the qid
+             * version is stale from then on until the next stat
+             */
+            bool written = false;
+        };
+        /**
+         * Controls how aggressively sequential readers are prefetched for
+         */
+        struct ReadAheadPolicy {
+            bool enabled = false;
+            /**
+             * The number of back to back sequential reads on a fid before
+             * prefetching starts
+             */
+            unsigned trigger = 2;
+            /**
+             * The most Treads kept in flight for a single fid, the window
+             * starts at two and doubles as the sequential run continues
+             */
+            size_t maximumWindow = 16;
+            /**
+             * Upper bound on the bytes requested but not yet consumed across
+             * every fid
+             */
+            size_t memoryBudget = 4 * 1024 * 1024;
+        };
+        /**
+         * Controls buffering of writes. With write behind enabled, write
+         * returns as soon as the data is buffered and errors are reported by
+         * the next write, flush or clunk on the fid.
+         */
+        struct WriteBehindPolicy {
+            bool enabled = false;
+            /**
+             * The most Twrites kept in flight for a single fid
+             */
+            size_t window = 8;
+        };
+    public:
+        explicit Client(Connection& connection);
+        virtual ~Client() = default;
+        /**
+         * Assign a free tag to the given request and send it off without
+         * waiting for the response.
+         * @return the tag assigned to the request
+         */
+        uint16_t post(Request& request);
+        /**
+         * Block until the response for the given tag arrives. Responses for
+         * other tags which show up in the mean time are held on to until
+         * they are awaited.
+         */
+        Response await(uint16_t tag);
+        Response transact(Request& request) { return await(post(request)); }
+        /**
+         * Perform a request and unpack the response, errors reported by the
+         * server are turned into exceptions.
+         */
+        template<ConceptualOperation op>
+        BoundResponseType<op> call(const BoundRequestType<op>& request) {
+            Request req(std::in_place_type<BoundRequestType<op>>, request);
+            return unpack<op>(transact(req));
+        }
+        template<ConceptualOperation op>
+        static BoundResponseType<op> unpack(Response&& response) {
+            if (auto err = std::get_if<ErrorResponse>(&response); err) {
+                throw Exception(err->getErrorName());
+            } else if (auto result = std::get_if<BoundResponseType<op>>(&response); result) {
+                return std::move(*result);
+            } else {
+                throw Exception("Unexpected response kind from server!");
+            }
+        }
+        uint32_t allocateFid();
+        void releaseFid(uint32_t fid);
+        constexpr auto getMsize() const noexcept { return _msize; }
+        /**
+         * The largest payload which can be moved by a single read or write on
+         * the given fid.
+         */
+        uint32_t getIounit(uint32_t fid) const noexcept;
+        const FidState* getFidState(uint32_t fid) const noexcept;
+        /**
+         * Enable walk caching, the cache must outlive the client. Pass nullptr
+         * to turn caching off again.
+         */
+        void setWalkCache(WalkCache* cache);
+        WalkCache* getWalkCache() const noexcept { return _walkCache; }
+        /**
+         * Enable caching of file contents, the cache must outlive the client
+         * and can be shared between clients talking to the same server.
+         */
+        void setPageCache(PageCache* cache) noexcept { _pageCache = cache; }
+        PageCache* getPageCache() const noexcept { return _pageCache; }
+        /**
+         * Servers which do not track versions report zero for every file,
+         * the contents of such files are only cached when asked for.
+         */
+        void setCacheUnversionedFiles(bool value) noexcept { _cacheUnversioned = value; }
+        /**
+         * Enable caching of stat results, the cache must outlive the client.
+         * Reading a directory fills the cache with the records it returns.
+         */
+        void setStatCache(StatCache* cache) noexcept { _statCache = cache; }
+        StatCache* getStatCache() const noexcept { return _statCache; }
+        void setReadAheadPolicy(const ReadAheadPolicy& policy);
+        const ReadAheadPolicy& getReadAheadPolicy() const noexcept { return _readAheadPolicy; }
+        /**
+         * Changing the policy flushes every fid with buffered writes
+         */
+        void setWriteBehindPolicy(const WriteBehindPolicy& policy);
+        const WriteBehindPolicy& getWriteBehindPolicy() const noexcept { return _writeBehindPolicy; }
+    public:
+        std::string version(uint32_t msize = defaultMsize, const std::string& version = version9p2000String);
+        Qid attach(uint32_t fid, const std::string& uname, const std::string& aname = "", uint32_t afid = nofid);
+        /**
+         * Walk from fid to newfid along the given names. Like the protocol,
+         * a walk which fails part of the way through returns fewer qids than
+         * names and does not create newfid.
+         */
+        std::vector<Qid> walk(uint32_t fid, uint32_t newfid, const std::vector<std::string>& names);
+        OpenResponse open(uint32_t fid, uint8_t mode);
+        CreateResponse create(uint32_t fid, const std::string& name, uint32_t perm, uint8_t mode);
+        std::vector<uint8_t> read(uint32_t fid, uint64_t offset, uint32_t count);
+        /**
+         * Read an arbitrarily large range by splitting it into iounit sized
+         * Treads, keeping up to maximumOutstanding of them in flight at once
+         * and reassembling the results in order. Stops early at end of file.
+         * @param maximumOutstanding zero means derive it from the read ahead
+         * memory budget
+         */
+        std::vector<uint8_t> readRange(uint32_t fid, uint64_t offset, uint64_t length, size_t maximumOutstanding = 0);
+        uint32_t write(uint32_t fid, uint64_t offset, const std::vector<uint8_t>& data);
+        /**
+         * Push out any buffered writes on the fid and wait until the server
+         * has acknowledged all of them.
+         */
+        void flush(uint32_t fid);
+        void flushAll();
+        void clunk(uint32_t fid);
+        void remove(uint32_t fid);
+        Stat stat(uint32_t fid);
+        void wstat(uint32_t fid, const Stat& stat);
+    private:
+        uint16_t allocateTag();
+        Response receive();
+        std::vector<Qid> uncachedWalk(uint32_t fid, uint32_t newfid, const std::vector<std::string>& names);
+        std::vector<Qid> cachedWalk(uint32_t fid, uint32_t newfid, const std::vector<std::string>& names);
+        void noteQid(uint32_t fid, const Qid& qid);
+        void validateOrigin(uint32_t fid, const Qid& observed);
+        void forgetFid(uint32_t fid);
+        void flushReleasedFids();
+        bool isPageCacheable(const FidState& state) const noexcept;
+        std::vector<uint8_t> uncachedRead(uint32_t fid, uint64_t offset, uint32_t count);
+        std::vector<uint8_t> cachedRead(uint32_t fid, const FidState& state, uint64_t offset, uint32_t count);
+        void observeQid(const Qid& qid);
+        void invalidateContents(uint32_t fid);
+        struct Prefetch {
+            uint64_t offset;
+            uint32_t requested;
+            uint16_t tag;
+            bool ready = false;
+            std::vector<uint8_t> data;
+        };
+        struct ReadAheadState {
+            uint64_t nextOffset = 0;
+            uint64_t postOffset = 0;
+            unsigned streak = 0;
+            size_t window = 2;
+            bool hitEnd = false;
+            std::deque<Prefetch> pending;
+        };
+        std::vector<uint8_t> readAheadRead(uint32_t fid, uint64_t offset, uint32_t count);
+        Prefetch postPrefetch(uint32_t fid, uint64_t offset, uint32_t count);
+        void fillWindow(uint32_t fid, ReadAheadState& state);
+        void completePrefetch(Prefetch& prefetch);
+        void cancelReadAhead(uint32_t fid);
+        void discardPrefetches(ReadAheadState& state);
+        struct PendingWrite {
+            uint64_t offset;
+            std::vector<uint8_t> data;
+            uint16_t tag;
+        };
+        struct WriteBehindState {
+            uint64_t bufferOffset = 0;
+            std::vector<uint8_t> buffer;
+            std::deque<PendingWrite> inFlight;
+            std::optional<std::string> error;
+        };
+        uint32_t bufferedWrite(uint32_t fid, uint64_t offset, const std::vector<uint8_t>& data);
+        void submitWrite(uint32_t fid, WriteBehindState& state, uint64_t offset, std::vector<uint8_t>&& data);
+        void retireWrite(uint32_t fid, WriteBehindState& state);
+        void submitBuffer(uint32_t fid, WriteBehindState& state, bool partial);
+        void discardWrites(uint32_t fid);
+    private:
+        Connection& _connection;
+        uint32_t _msize = defaultMsize;
+        uint16_t _nextTag = 0;
+        std::unordered_set<uint16_t> _outstanding;
+        std::unordered_map<uint16_t, Response> _arrived;
+        uint32_t _nextFid = 0;
+        std::vector<uint32_t> _freeFids;
+        std::unordered_map<uint32_t, FidState> _fids;
+        WalkCache* _walkCache = nullptr;
+        /// fids produced by a cached walk mapped to the (root, path) they came from
+        std::unordered_map<uint32_t, std::pair<uint32_t, WalkCache::Path>> _walkOrigins;
+        PageCache* _pageCache = nullptr;
+        bool _cacheUnversioned = false;
+        StatCache* _statCache = nullptr;
+        ReadAheadPolicy _readAheadPolicy;
+        std::unordered_map<uint32_t, ReadAheadState> _readAhead;
+        /// bytes requested by prefetches which have not been consumed yet
+        size_t _readAheadBytes = 0;
+        WriteBehindPolicy _writeBehindPolicy;
+        std::unordered_map<uint32_t, WriteBehindState> _writeBehind;
+};
+
+} // end namespace kzr
+
+#endif // end KZR_CLIENT_H__
@@ -0,0 +1,305 @@
+/**
+ * @file
+ * A client which spreads its requests over several connections
+ * implementation
+ * @copyright
+ * libkzr
+ * Copyright (c) 2019, Joshua Scoggins 
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR 
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "ClientPool.h"
+#include <algorithm>
+
+namespace kzr {
+
+ClientPool::ClientPool(const std::vector<std::reference_wrapper<Connection>>& connections, uint32_t msize) : _msize(msize) {
+    if (connections.empty()) {
+        throw Exception("A client pool needs at least one connection!");
+    }
+    for (auto& connection : connections) {
+        auto channel = std::make_unique<Channel>();
+        channel->client = std::make_unique<Client>(connection.get());
+        channel->client->version(msize);
+        _msize = std::min(_msize, channel->client->getMsize());
+        _channels.emplace_back(std::move(channel));
+    }
+}
+
+uint32_t
+ClientPool::allocateFid() {
+    std::lock_guard<std::mutex> guard(_lock);
+    if (!_freeFids.empty()) {
+        auto fid = _freeFids.back();
+        _freeFids.pop_back();
+        return fid;
+    } else if (_nextFid == nofid) {
+        throw Exception("No free fids available!");
+    } else {
+        return _nextFid++;
+    }
+}
+
+void
+ClientPool::releaseFid(uint32_t fid) {
+    std::lock_guard<std::mutex> guard(_lock);
+    _fids.erase(fid);
+    _freeFids.emplace_back(fid);
+}
+
+ClientPool::Bindings
+ClientPool::lookup(uint32_t fid) {
+    std::lock_guard<std::mutex> guard(_lock);
+    if (auto it = _fids.find(fid); it != _fids.end()) {
+        return it->second;
+    } else {
+        throw Exception("Unknown fid ", fid);
+    }
+}
+
+void
+ClientPool::bind(uint32_t fid, Bindings&& bindings) {
+    std::lock_guard<std::mutex> guard(_lock);
+    _fids[fid] = std::move(bindings);
+}
+
+ClientPool::Bindings
+ClientPool::unbind(uint32_t fid) {
+    std::lock_guard<std::mutex> guard(_lock);
+    if (auto it = _fids.find(fid); it != _fids.end()) {
+        auto bindings = std::move(it->second);
+        _fids.erase(it);
+        _freeFids.emplace_back(fid);
+        return bindings;
+    } else {
+        throw Exception("Unknown fid ", fid);
+    }
+}
+
+size_t
+ClientPool::choose() {
+    auto start = _cursor++;
+    size_t best = start % _channels.size();
+    for (size_t i = 1; i < _channels.size(); ++i) {
+        auto candidate = (start + i) % _channels.size();
+        if (_channels[candidate]->outstanding < _channels[best]->outstanding) {
+            best = candidate;
+        }
+    }
+    return best;
+}
+
+std::string
+ClientPool::clunkAll(const Bindings& bindings) {
+    std::string error;
+    for (const auto& binding : bindings) {
+        try {
+            with(binding.channel, [&binding](Client& client) { client.clunk(binding.fid); });
+        } catch (Exception& e) {
+            if (error.empty()) {
+                error = e.message();
+            }
+        }
+    }
+    return error;
+}
+
+ClientPool::Binding
+ClientPool::pin(uint32_t fid) {
+    auto bindings = lookup(fid);
+    if (bindings.size() == 1) {
+        return bindings.front();
+    }
+    auto chosen = bindings[choose()];
+    bind(fid, { chosen });
+    bindings.erase(std::remove_if(bindings.begin(), bindings.end(), [&chosen](const Binding& b) { return b.channel == chosen.channel; }), bindings.end());
+    // the copies are gone even if the server complains about them
+    clunkAll(bindings);
+    return chosen;
+}
+
+Qid
+ClientPool::attach(uint32_t fid, const std::string& uname, const std::string& aname) {
+    Bindings bindings;
+    Qid qid;
+    try {
+        for (size_t i = 0; i < _channels.size(); ++i) {
+            with(i, [&](Client& client) {
+                        auto remote = client.allocateFid();
+                        try {
+                            qid = client.attach(remote, uname, aname);
+                        } catch (...) {
+                            client.releaseFid(remote);
+                            throw;
+                        }
+                        bindings.emplace_back(Binding { i, remote });
+                    });
+        }
+    } catch (...) {
+        clunkAll(bindings);
+        throw;
+    }
+    bind(fid, std::move(bindings));
+    return qid;
+}
+
+std::vector<Qid>
+ClientPool::walk(uint32_t fid, uint32_t newfid, const std::vector<std::string>& names) {
+    auto from = lookup(fid);
+    if (newfid != fid) {
+        std::lock_guard<std::mutex> guard(_lock);
+        if (_fids.count(newfid) != 0) {
+            throw Exception("fid ", newfid, " is already in use");
+        }
+    }
+    if (from.size() > 1 && names.empty()) {
+        // a clone of an attached fid can still go anywhere
+        if (newfid == fid) {
+            return {};
+        }
+        Bindings copies;
+        try {
+            for (const auto& binding : from) {
+                copies.emplace_back(Binding { binding.channel, with(binding.channel, [&binding](Client& client) {
+                                auto remote = client.allocateFid();
+                                try {
+                                    client.walk(binding.fid, remote, {});
+                                } catch (...) {
+                                    client.releaseFid(remote);
+                                    throw;
+                                }
+                                return remote;
+                            }) });
+            }
+        } catch (...) {
+            clunkAll(copies);
+            throw;
+        }
+        bind(newfid, std::move(copies));
+        return {};
+    }
+    auto source = from.size() > 1 ? from[choose()] : from.front();
+    if (newfid == fid) {
+        auto qids = with(source.channel, [&](Client& client) { return client.walk(source.fid, source.fid, names); });
+        if (qids.size() == names.size() && from.size() > 1) {
+            // the fid moved on the chosen connection, its copies are stale
+            bind(fid, { source });
+            from.erase(from.begin() + source.channel);
+            clunkAll(from);
+        }
+        return qids;
+    }
+    uint32_t remote = nofid;
+    auto qids = with(source.channel, [&](Client& client) {
+                remote = client.allocateFid();
+                try {
+                    auto result = client.walk(source.fid, remote, names);
+                    if (result.size() != names.size()) {
+                        client.releaseFid(remote);
+                    }
+                    return result;
+                } catch (...) {
+                    client.releaseFid(remote);
+                    throw;
+                }
+            });
+    if (qids.size() == names.size()) {
+        bind(newfid, { Binding { source.channel, remote } });
+    }
+    return qids;
+}
+
+OpenResponse
+ClientPool::open(uint32_t fid, uint8_t mode) {
+    auto binding = pin(fid);
+    return with(binding.channel, [&](Client& client) { return client.open(binding.fid, mode); });
+}
+
+CreateResponse
+ClientPool::create(uint32_t fid, const std::string& name, uint32_t perm, uint8_t mode) {
+    auto binding = pin(fid);
+    return with(binding.channel, [&](Client& client) { return client.create(binding.fid, name, perm, mode); });
+}
+
+std::vector<uint8_t>
+ClientPool::read(uint32_t fid, uint64_t offset, uint32_t count) {
+    auto binding = pin(fid);
+    return with(binding.channel, [&](Client& client) { return client.read(binding.fid, offset, count); });
+}
+
+std::vector<uint8_t>
+ClientPool::readRange(uint32_t fid, uint64_t offset, uint64_t length, size_t maximumOutstanding) {
+    auto binding = pin(fid);
+    return with(binding.channel, [&](Client& client) { return client.readRange(binding.fid, offset, length, maximumOutstanding); });
+}
+
+uint32_t
+ClientPool::write(uint32_t fid, uint64_t offset, const std::vector<uint8_t>& data) {
+    auto binding = pin(fid);
+    return with(binding.channel, [&](Client& client) { return client.write(binding.fid, offset, data); });
+}
+
+void
+ClientPool::clunk(uint32_t fid) {
+    if (auto error = clunkAll(unbind(fid)); !error.empty()) {
+        throw Exception(error);
+    }
+}
+
+void
+ClientPool::remove(uint32_t fid) {
+    auto binding = pin(fid);
+    unbind(fid);
+    with(binding.channel, [&](Client& client) { client.remove(binding.fid); });
+}
+
+Stat
+ClientPool::stat(uint32_t fid) {
+    auto bindings = lookup(fid);
+    // every copy of an attached fid is the same file, no need to pin it
+    auto binding = bindings.size() > 1 ? bindings[choose()] : bindings.front();
+    return with(binding.channel, [&](Client& client) { return client.stat(binding.fid); });
+}
+
+void
+ClientPool::wstat(uint32_t fid, const Stat& stat) {
+    auto binding = pin(fid);
+    with(binding.channel, [&](Client& client) { client.wstat(binding.fid, stat); });
+}
+
+size_t
+ClientPool::getConnectionOf(uint32_t fid) {
+    auto bindings = lookup(fid);
+    return bindings.size() > 1 ? _channels.size() : bindings.front().channel;
+}
+
+ClientPool::Statistics
+ClientPool::getStatistics() {
+    Statistics stats;
+    for (auto& channel : _channels) {
+        std::lock_guard<std::mutex> guard(channel->lock);
+        stats.requests.emplace_back(channel->requests);
+    }
+    return stats;
+}
+
+} // end namespace kzr
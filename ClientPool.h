@@ -0,0 +1,174 @@
+/**
+ * @file
+ * A client which spreads its requests over several connections
+ * @copyright
+ * libkzr
+ * Copyright (c) 2019, Joshua Scoggins 
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR 
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef KZR_CLIENT_POOL_H__
+#define KZR_CLIENT_POOL_H__
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "Client.h"
+
+namespace kzr {
+
+/**
+ * Talks to a single server over a pool of connections, each with a Client
+ * and a session of its own, so that several threads can keep more than one
+ * socket (and more than one core on either end) busy.
+ *
+ * The fids handed out by the pool are mapped onto fids of the clients. An
+ * attached fid exists on every connection; the first walk away from it goes
+ * to the connection with the fewest requests outstanding and whatever is
+ * walked from there stays on that connection. Other operations on an
+ * attached fid pin it to a single connection first.
+ *
+ * Unlike Client, the pool can be used from any number of threads at once as
+ * long as each fid is only used by one of them at a time.
+ */
+class ClientPool {
+    public:
+        struct Statistics {
+            /**
+             * The number of operations carried out on each connection
+             */
+            std::vector<uint64_t> requests;
+        };
+    public:
+        /**
+         * Negotiate the version on every connection, the connections must
+         * outlive the pool
+         */
+        explicit ClientPool(const std::vector<std::reference_wrapper<Connection>>& connections, uint32_t msize = Client::defaultMsize);
+        ClientPool(const ClientPool&) = delete;
+        ClientPool& operator=(const ClientPool&) = delete;
+        auto getConnectionCount() const noexcept { return _channels.size(); }
+        /**
+         * The smallest msize negotiated on any connection
+         */
+        constexpr auto getMsize() const noexcept { return _msize; }
+        /**
+         * Caches and policies are set up through the clients directly, this
+         * must be done before the pool is used
+         */
+        Client& getClient(size_t index) noexcept { return *_channels[index]->client; }
+        size_t getOutstanding(size_t index) const noexcept { return _channels[index]->outstanding; }
+        uint32_t allocateFid();
+        void releaseFid(uint32_t fid);
+        Qid attach(uint32_t fid, const std::string& uname, const std::string& aname = "");
+        /**
+         * Like Client::walk, newfid is not created if the walk fails part of
+         * the way through
+         */
+        std::vector<Qid> walk(uint32_t fid, uint32_t newfid, const std::vector<std::string>& names);
+        OpenResponse open(uint32_t fid, uint8_t mode);
+        CreateResponse create(uint32_t fid, const std::string& name, uint32_t perm, uint8_t mode);
+        std::vector<uint8_t> read(uint32_t fid, uint64_t offset, uint32_t count);
+        std::vector<uint8_t> readRange(uint32_t fid, uint64_t offset, uint64_t length, size_t maximumOutstanding = 0);
+        uint32_t write(uint32_t fid, uint64_t offset, const std::vector<uint8_t>& data);
+        void clunk(uint32_t fid);
+        void remove(uint32_t fid);
+        Stat stat(uint32_t fid);
+        void wstat(uint32_t fid, const Stat& stat);
+        /**
+         * The connection an fid lives on, the number of connections for an
+         * attached fid which has not been pinned yet
+         */
+        size_t getConnectionOf(uint32_t fid);
+        Statistics getStatistics();
+    private:
+        struct Channel {
+            std::unique_ptr<Client> client;
+            /**
+             * Held for the length of every operation, the client is not
+             * thread safe
+             */
+            std::mutex lock;
+            /**
+             * Operations waiting for or holding the lock
+             */
+            std::atomic<size_t> outstanding { 0 };
+            uint64_t requests = 0;
+        };
+        struct Binding {
+            size_t channel;
+            uint32_t fid;
+        };
+        /**
+         * One binding per connection (in order) for an attached fid, a
+         * single one otherwise
+         */
+        using Bindings = std::vector<Binding>;
+        template<typename F>
+        auto with(size_t index, F&& job) {
+            auto& channel = *_channels[index];
+            ++channel.outstanding;
+            struct Leave {
+                std::atomic<size_t>& count;
+                ~Leave() { --count; }
+            } leave { channel.outstanding };
+            std::lock_guard<std::mutex> guard(channel.lock);
+            ++channel.requests;
+            return job(*channel.client);
+        }
+        Bindings lookup(uint32_t fid);
+        void bind(uint32_t fid, Bindings&& bindings);
+        /**
+         * Forget the fid, handing back what it was bound to
+         */
+        Bindings unbind(uint32_t fid);
+        /**
+         * Settle an attached fid on the least busy connection, clunking it
+         * on the others
+         */
+        Binding pin(uint32_t fid);
+        /**
+         * The connection with the fewest operations outstanding, ties are
+         * broken round robin
+         */
+        size_t choose();
+        /**
+         * Clunk every binding
+         * @return the first error reported, if any
+         */
+        std::string clunkAll(const Bindings& bindings);
+    private:
+        uint32_t _msize;
+        std::vector<std::unique_ptr<Channel>> _channels;
+        std::atomic<size_t> _cursor { 0 };
+        std::mutex _lock;
+        std::unordered_map<uint32_t, Bindings> _fids;
+        uint32_t _nextFid = 0;
+        std::vector<uint32_t> _freeFids;
+};
+
+} // end namespace kzr
+
+#endif // end KZR_CLIENT_POOL_H__
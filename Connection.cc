@@ -28,7 +28,9 @@
 
 #include "Connection.h"
 #include "Exception.h"
+#include <algorithm>
 #include <sstream>
+#include <unistd.h>
 
 
 namespace kzr {
@@ -53,11 +55,81 @@ Connection::write(const MessageStream& msg) {
         }
     }
 }
+std::string
+Connection::frame(const MessageStream& msg, size_t payload) {
+    auto contents = msg.str();
+    if (auto len = contents.length() + payload; len + 4 != (uint32_t(len + 4))) {
+        throw Exception("length of the message is too long to write out!");
+    } else {
+        auto actualLen = uint32_t(len) + 4;
+        std::string header;
+        header.reserve(contents.length() + 4);
+        header.push_back(char(uint8_t(actualLen)));
+        header.push_back(char(uint8_t(actualLen >> 8)));
+        header.push_back(char(uint8_t(actualLen >> 16)));
+        header.push_back(char(uint8_t(actualLen >> 24)));
+        header += contents;
+        return header;
+    }
+}
+
+void
+Connection::writeView(const MessageStream& msg, const uint8_t* data, size_t count) {
+    auto header = frame(msg, count);
+    if (auto bytesWritten = rawWriteVector(header, data, count); bytesWritten != header.length() + count) {
+        throw Exception("Only wrote ", bytesWritten, "bytes of a ", header.length() + count, " bytes long message!");
+    }
+}
+
+size_t
+Connection::rawWriteVector(const std::string& header, const uint8_t* data, size_t count) {
+    std::string combined(header);
+    combined.append(reinterpret_cast<const char*>(data), count);
+    return rawWrite(combined);
+}
+
+void
+Connection::writeFileRegion(const MessageStream& msg, int fd, uint64_t offset, size_t count) {
+    auto header = frame(msg, count);
+    if (auto bytesWritten = rawWrite(header); bytesWritten != header.length()) {
+        throw Exception("Only wrote ", bytesWritten, "bytes of a ", header.length() + count, " bytes long message!");
+    }
+    auto transferred = rawSendFile(fd, offset, count);
+    if (transferred < count) {
+        // the file shrank underneath us, the size was already sent so the
+        // rest has to be made up to keep the stream in sync
+        std::string padding(count - transferred, '\0');
+        if (rawWrite(padding) != padding.length()) {
+            throw Exception("Only wrote ", transferred, " bytes of a ", count, " bytes long file region!");
+        }
+    }
+}
+
+size_t
+Connection::rawSendFile(int fd, uint64_t offset, size_t count) {
+    constexpr size_t chunkSize = 64 * 1024;
+    std::string buffer;
+    size_t total = 0;
+    while (total < count) {
+        buffer.resize(std::min(chunkSize, count - total));
+        auto got = ::pread(fd, buffer.data(), buffer.size(), off_t(offset + total));
+        if (got <= 0) {
+            break;
+        }
+        buffer.resize(size_t(got));
+        if (auto put = rawWrite(buffer); put != buffer.size()) {
+            throw Exception("Only wrote ", put, " bytes of a ", buffer.size(), " bytes long file chunk!");
+        }
+        total += size_t(got);
+    }
+    return total;
+}
+
 void
 Connection::read(MessageStream& msg) {
     // need to call rawRead twice, first to get the length, then the second
     // time to actually ingest the data
-    std::string sizeAcquire(' ', 4);
+    std::string sizeAcquire(4, ' ');
     if (auto bytesRead = rawRead(sizeAcquire); bytesRead != 4) {
         throw Exception("Expected to read 4 bytes but only read ", bytesRead, "!");
     } else {
@@ -67,9 +139,9 @@ Connection::read(MessageStream& msg) {
         } else {
             auto correctedMessageSize = messageSize - 4;
             // now we reserve this storage inside our new string
-            std::string storage(' ', correctedMessageSize);
-            if (auto bytesRead2 = rawRead(storage); bytesRead2 != messageSize) {
-                throw Exception("only able to read ", bytesRead2, "/", messageSize, " bytes!");
+            std::string storage(correctedMessageSize, ' ');
+            if (auto bytesRead2 = rawRead(storage); bytesRead2 != correctedMessageSize) {
+                throw Exception("only able to read ", bytesRead2, "/", correctedMessageSize, " bytes!");
             } else {
                 if ((bytesRead2 + bytesRead) != messageSize) {
                     throw Exception("Not enough bytes read!");
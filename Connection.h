@@ -28,6 +28,7 @@
 
 #ifndef KZR_CONNECTION_H__
 #define KZR_CONNECTION_H__
+#include <cstdint>
 #include <string>
 #include "Message.h"
 namespace kzr {
@@ -40,9 +41,38 @@ class Connection {
         virtual ~Connection() = default;
         void write(const MessageStream&);
         void read(MessageStream&);
+        /**
+         * Write a message made up of the contents of the stream followed by
+         * count bytes of the file descriptor starting at offset. Used to send
+         * the payload of an Rread without first copying it into the message.
+         */
+        void writeFileRegion(const MessageStream& msg, int fd, uint64_t offset, size_t count);
+        /**
+         * Write a message made up of the contents of the stream followed by
+         * count bytes of memory which are not copied into the message.
+         */
+        void writeView(const MessageStream& msg, const uint8_t* data, size_t count);
     protected:
         [[nodiscard]] virtual size_t rawWrite(const std::string& data) = 0;
         [[nodiscard]] virtual size_t rawRead(std::string& data) = 0;
+        /**
+         * Move bytes of a file onto the connection, by default they are read
+         * into memory and written out with rawWrite.
+         * @return the number of bytes transferred
+         */
+        [[nodiscard]] virtual size_t rawSendFile(int fd, uint64_t offset, size_t count);
+        /**
+         * Write the header and then the data, by default the data is copied
+         * into a string and handed to rawWrite.
+         * @return the number of bytes written of both
+         */
+        [[nodiscard]] virtual size_t rawWriteVector(const std::string& header, const uint8_t* data, size_t count);
+    private:
+        /**
+         * Build the size field and header of a message with a payload of the
+         * given size following it
+         */
+        static std::string frame(const MessageStream& msg, size_t payload);
 };
 
 } // end namespace kzr
@@ -0,0 +1,298 @@
+/**
+ * @file
+ * Hashed container of directory entries
+ * @copyright
+ * libkzr
+ * Copyright (c) 2019, Joshua Scoggins 
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR 
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef KZR_DIRECTORY_INDEX_H__
+#define KZR_DIRECTORY_INDEX_H__
+#include <cstdint>
+#include <algorithm>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace kzr {
+
+/**
+ * The entries of a directory keyed by name. Lookup is an open addressing
+ * hash table which remembers the hash of every name so probes only compare
+ * strings when the hashes match. Entries are kept in insertion order which is
+ * the order a directory read returns them in, erasing leaves a hole that is
+ * skipped until enough of them pile up to compact the storage.
+ *
+ * Every entry also records the size of its encoded stat so the byte offset
+ * it starts at within a directory read can be found. The offsets are
+ * computed lazily from the first entry that changed, which makes a read at
+ * any offset a binary search instead of a walk from the start.
+ *
+ * Offsets move whenever an entry before them goes away or changes size, so a
+ * listing in progress should carry on by serial instead: every entry gets
+ * the next serial number when it is inserted and keeps it, a listing
+ * remembers the serial it stopped at and resumes from the first entry which
+ * has it or a later one.
+ */
+template<typename T>
+class DirectoryIndex {
+    public:
+        static constexpr size_t npos = ~size_t(0);
+        class Iterator {
+            public:
+                Iterator(const DirectoryIndex* owner, size_t position) : _owner(owner), _position(position) { }
+                std::pair<const std::string&, const T&> operator*() const {
+                    const auto& e = _owner->_entries[_position];
+                    return { e.name, e.value };
+                }
+                Iterator& operator++() {
+                    _position = _owner->advance(_position);
+                    return *this;
+                }
+                bool operator==(const Iterator& other) const noexcept { return _position == other._position; }
+                bool operator!=(const Iterator& other) const noexcept { return _position != other._position; }
+                constexpr auto getPosition() const noexcept { return _position; }
+                /**
+                 * The serial of the entry, or the next serial to be handed
+                 * out at the end
+                 */
+                uint64_t getSerial() const noexcept { return _position == npos ? _owner->_nextSerial : _owner->_entries[_position].serial; }
+            private:
+                const DirectoryIndex* _owner;
+                size_t _position;
+        };
+    public:
+        DirectoryIndex() = default;
+        auto size() const noexcept { return _live; }
+        auto empty() const noexcept { return _live == 0; }
+        size_t count(std::string_view name) const { return probe(name, hashOf(name)) != npos ? 1 : 0; }
+        T* find(std::string_view name) {
+            auto position = probe(name, hashOf(name));
+            return position == npos ? nullptr : &_entries[position].value;
+        }
+        const T* find(std::string_view name) const {
+            auto position = probe(name, hashOf(name));
+            return position == npos ? nullptr : &_entries[position].value;
+        }
+        /**
+         * Add an entry at the end of the iteration order.
+         * @return false if the name is already present
+         */
+        bool insert(const std::string& name, T value, size_t recordSize = 0) {
+            auto hash = hashOf(name);
+            if (probe(name, hash) != npos) {
+                return false;
+            }
+            if ((_used + 1) * 2 > _slots.size()) {
+                rehash(std::max<size_t>(16, _live * 4));
+            }
+            auto position = _entries.size();
+            _entries.push_back(Entry { name, std::move(value), hash, recordSize, 0, _nextSerial++, true });
+            place(hash, position);
+            ++_live;
+            return true;
+        }
+        bool erase(std::string_view name) {
+            auto hash = hashOf(name);
+            for (auto slot = hash & mask(); _slots.size() != 0 && _slots[slot] != emptySlot; slot = (slot + 1) & mask()) {
+                if (auto value = _slots[slot]; value != deletedSlot) {
+                    auto& e = _entries[value - firstEntry];
+                    if (e.hash == hash && e.name == name) {
+                        _slots[slot] = deletedSlot;
+                        e.live = false;
+                        e.name.clear();
+                        e.value = T();
+                        --_live;
+                        invalidateFrom(value - firstEntry);
+                        if (_entries.size() - _live > std::max<size_t>(64, _live)) {
+                            compact();
+                        }
+                        return true;
+                    }
+                }
+            }
+            return false;
+        }
+        /**
+         * Update the encoded size of an entry (its stat changed).
+         */
+        void resize(std::string_view name, size_t recordSize) {
+            if (auto position = probe(name, hashOf(name)); position != npos && _entries[position].recordSize != recordSize) {
+                _entries[position].recordSize = recordSize;
+                invalidateFrom(position);
+            }
+        }
+        void clear() {
+            _entries.clear();
+            _slots.clear();
+            _live = 0;
+            _used = 0;
+            _validOffsets = 0;
+        }
+        Iterator begin() const { return Iterator(this, advance(npos)); }
+        Iterator end() const { return Iterator(this, npos); }
+        /**
+         * The first entry with the given serial or a later one
+         */
+        Iterator resume(uint64_t serial) const {
+            // entries stay in the order of their serials, holes included
+            auto it = std::lower_bound(_entries.begin(), _entries.end(), serial, [](const Entry& e, uint64_t value) { return e.serial < value; });
+            auto position = size_t(it - _entries.begin());
+            if (position == _entries.size()) {
+                return end();
+            }
+            return Iterator(this, _entries[position].live ? position : advance(position));
+        }
+        /**
+         * Find the entry a directory read at the given byte offset starts
+         * with. Safe to call from several readers at once.
+         * @return false when the offset does not fall on the start of an
+         * entry, otherwise the iterator to continue from (end() once the
+         * whole directory has been read)
+         */
+        std::pair<bool, Iterator> locate(uint64_t offset) const {
+            std::lock_guard<std::mutex> guard(_offsetLock);
+            // extend the computed offsets only as far as needed
+            auto total = _validOffsets == 0 ? 0 : _entries[_validOffsets - 1].offset + recordSizeOf(_validOffsets - 1);
+            for (; _validOffsets < _entries.size() && total <= offset; ++_validOffsets) {
+                _entries[_validOffsets].offset = total;
+                total += recordSizeOf(_validOffsets);
+            }
+            if (_validOffsets == _entries.size() && offset >= total) {
+                return { offset == total, end() };
+            }
+            // first entry which starts past the offset, the one before it has
+            // to start exactly at it
+            size_t low = 0, high = _validOffsets;
+            while (low < high) {
+                auto middle = low + (high - low) / 2;
+                if (_entries[middle].offset <= offset) {
+                    low = middle + 1;
+                } else {
+                    high = middle;
+                }
+            }
+            // skip backwards over holes, they share the offset of the next entry
+            auto position = low;
+            while (position > 0 && _entries[position - 1].offset == offset) {
+                --position;
+            }
+            if (position == _validOffsets || _entries[position].offset != offset) {
+                return { false, end() };
+            }
+            auto start = _entries[position].live ? position : advance(position);
+            return { true, Iterator(this, start) };
+        }
+    private:
+        static constexpr uint32_t emptySlot = 0;
+        static constexpr uint32_t deletedSlot = 1;
+        static constexpr uint32_t firstEntry = 2;
+        struct Entry {
+            std::string name;
+            T value;
+            size_t hash;
+            size_t recordSize;
+            /// only meaningful below _validOffsets
+            mutable uint64_t offset;
+            uint64_t serial;
+            bool live;
+        };
+        static size_t hashOf(std::string_view name) noexcept { return std::hash<std::string_view>()(name); }
+        size_t mask() const noexcept { return _slots.size() - 1; }
+        size_t recordSizeOf(size_t position) const noexcept { return _entries[position].live ? _entries[position].recordSize : 0; }
+        size_t advance(size_t position) const noexcept {
+            for (auto next = position == npos ? 0 : position + 1; next < _entries.size(); ++next) {
+                if (_entries[next].live) {
+                    return next;
+                }
+            }
+            return npos;
+        }
+        size_t probe(std::string_view name, size_t hash) const noexcept {
+            if (_slots.empty()) {
+                return npos;
+            }
+            for (auto slot = hash & mask(); _slots[slot] != emptySlot; slot = (slot + 1) & mask()) {
+                if (auto value = _slots[slot]; value != deletedSlot) {
+                    const auto& e = _entries[value - firstEntry];
+                    if (e.hash == hash && e.name == name) {
+                        return value - firstEntry;
+                    }
+                }
+            }
+            return npos;
+        }
+        void place(size_t hash, size_t position) {
+            auto slot = hash & mask();
+            while (_slots[slot] != emptySlot) {
+                slot = (slot + 1) & mask();
+            }
+            _slots[slot] = uint32_t(position + firstEntry);
+            ++_used;
+        }
+        void rehash(size_t minimum) {
+            size_t capacity = 16;
+            while (capacity < minimum) {
+                capacity *= 2;
+            }
+            _slots.assign(capacity, emptySlot);
+            _used = 0;
+            for (size_t i = 0; i < _entries.size(); ++i) {
+                if (_entries[i].live) {
+                    place(_entries[i].hash, i);
+                }
+            }
+        }
+        void compact() {
+            std::vector<Entry> kept;
+            kept.reserve(_live);
+            for (auto& e : _entries) {
+                if (e.live) {
+                    kept.emplace_back(std::move(e));
+                }
+            }
+            _entries.swap(kept);
+            _validOffsets = 0;
+            rehash(std::max<size_t>(16, _live * 4));
+        }
+        void invalidateFrom(size_t position) noexcept {
+            std::lock_guard<std::mutex> guard(_offsetLock);
+            _validOffsets = std::min(_validOffsets, position);
+        }
+    private:
+        std::vector<Entry> _entries;
+        std::vector<uint32_t> _slots;
+        size_t _live = 0;
+        /// slots which are not empty, deleted markers included
+        size_t _used = 0;
+        mutable size_t _validOffsets = 0;
+        mutable std::mutex _offsetLock;
+        /// never reset so a cleared index can't hand out an old serial again
+        uint64_t _nextSerial = 0;
+};
+
+} // end namespace kzr
+
+#endif // end KZR_DIRECTORY_INDEX_H__
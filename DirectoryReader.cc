@@ -0,0 +1,144 @@
+/**
+ * @file
+ * Streaming iteration over the entries of a directory implementation
+ * @copyright
+ * libkzr
+ * Copyright (c) 2019, Joshua Scoggins 
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR 
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "DirectoryReader.h"
+
+namespace kzr {
+
+StatView::StatView(const uint8_t* data, size_t available) : _data(data) {
+    if (available < minimumSize || size() > available || size() < minimumSize) {
+        throw Exception("Malformed stat record!");
+    }
+    // find the strings once so the accessors do not have to skip over them
+    auto end = size();
+    _nameOffset = 41;
+    _uidOffset = _nameOffset + 2 + read16(_nameOffset);
+    if (_uidOffset + 2 > end) {
+        throw Exception("Malformed stat record!");
+    }
+    _gidOffset = _uidOffset + 2 + read16(_uidOffset);
+    if (_gidOffset + 2 > end) {
+        throw Exception("Malformed stat record!");
+    }
+    _muidOffset = _gidOffset + 2 + read16(_gidOffset);
+    if (_muidOffset + 2 > end || _muidOffset + 2 + read16(_muidOffset) > end) {
+        throw Exception("Malformed stat record!");
+    }
+}
+
+Stat
+StatView::toStat() const {
+    Stat result;
+    result.setType(getType());
+    result.setDevice(getDevice());
+    result.setQid(getQid());
+    result.setPermissions(getPermissions());
+    result.setLastAccessTime(getLastAccessTime());
+    result.setLastModificationTime(getLastModificationTime());
+    result.setLength(getLength());
+    result.setName(std::string(getName()));
+    result.setOwner(std::string(getOwner()));
+    result.setGroup(std::string(getGroup()));
+    result.setUserThatLastModified(std::string(getUserThatLastModified()));
+    return result;
+}
+
+DirectoryReader::DirectoryReader(Client& client, uint32_t fid, uint32_t count) :
+    _client(client),
+    _fid(fid),
+    _count(count == 0 ? client.getIounit(fid) : count) {
+    postRead();
+}
+
+DirectoryReader::~DirectoryReader() {
+    if (_pending) {
+        // the response has to be collected so the tag can be reused
+        try {
+            _client.await(_tag);
+        } catch (...) { }
+    }
+}
+
+void
+DirectoryReader::postRead() {
+    ReadRequest req;
+    req.setFid(_fid);
+    req.setOffset(_offset);
+    req.setCount(_count);
+    Request wrapped(std::in_place_type<ReadRequest>, req);
+    _tag = _client.post(wrapped);
+    _pending = true;
+}
+
+bool
+DirectoryReader::receiveChunk() {
+    if (!_pending) {
+        return false;
+    }
+    _pending = false;
+    auto data = std::move(Client::unpack<ConceptualOperation::Read>(_client.await(_tag)).getData());
+    if (data.empty()) {
+        _finished = true;
+        return false;
+    }
+    // directory offsets have to follow on from the previous read so the next
+    // request can only go out once we know how much came back
+    _offset += data.size();
+    postRead();
+    // servers are supposed to return whole records but if one was split carry
+    // the partial record over to the front of the new chunk
+    if (_position < _chunk.size()) {
+        data.insert(data.begin(), _chunk.begin() + _position, _chunk.end());
+    }
+    _chunk = std::move(data);
+    _position = 0;
+    if (auto cache = _client.getStatCache(); cache) {
+        cache->prefill(_chunk);
+    }
+    return true;
+}
+
+bool
+DirectoryReader::next(StatView& entry) {
+    while (!_finished) {
+        if (_position + 2 <= _chunk.size()) {
+            auto length = 2 + size_t(build(_chunk[_position], _chunk[_position + 1]));
+            if (_position + length <= _chunk.size()) {
+                entry = StatView(_chunk.data() + _position, length);
+                _position += length;
+                return true;
+            }
+        }
+        if (!receiveChunk()) {
+            _finished = true;
+        }
+    }
+    return false;
+}
+
+} // end namespace kzr
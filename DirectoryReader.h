@@ -0,0 +1,131 @@
+/**
+ * @file
+ * Streaming iteration over the entries of a directory
+ * @copyright
+ * libkzr
+ * Copyright (c) 2019, Joshua Scoggins 
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR 
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef KZR_DIRECTORY_READER_H__
+#define KZR_DIRECTORY_READER_H__
+#include <cstdint>
+#include <string_view>
+#include <vector>
+#include "Message.h"
+#include "Client.h"
+
+namespace kzr {
+
+/**
+ * A read only window onto an encoded Stat record. Fields are decoded from the
+ * underlying bytes when asked for so walking a directory does not have to
+ * build a full Stat (and its four strings) per entry. A view is only valid as
+ * long as the bytes it refers to.
+ */
+class StatView {
+    public:
+        /**
+         * The smallest possible record: the fixed size fields plus four
+         * empty strings, including the leading length.
+         */
+        static constexpr size_t minimumSize = 49;
+    public:
+        StatView() = default;
+        /**
+         * @param data the start of a record (its two byte length)
+         * @param available how many bytes are readable from data
+         */
+        StatView(const uint8_t* data, size_t available);
+        /**
+         * The number of bytes the record takes up, including the length
+         */
+        size_t size() const noexcept { return 2 + read16(0); }
+        uint16_t getType() const noexcept { return read16(2); }
+        uint32_t getDevice() const noexcept { return read32(4); }
+        Qid getQid() const noexcept { return Qid(_data[8], read64(13), read32(9)); }
+        uint32_t getPermissions() const noexcept { return read32(21); }
+        uint32_t getLastAccessTime() const noexcept { return read32(25); }
+        uint32_t getLastModificationTime() const noexcept { return read32(29); }
+        uint64_t getLength() const noexcept { return read64(33); }
+        std::string_view getName() const noexcept { return stringAt(_nameOffset); }
+        std::string_view getOwner() const noexcept { return stringAt(_uidOffset); }
+        std::string_view getGroup() const noexcept { return stringAt(_gidOffset); }
+        std::string_view getUserThatLastModified() const noexcept { return stringAt(_muidOffset); }
+        /**
+         * Decode the whole record into a Stat
+         */
+        Stat toStat() const;
+    private:
+        uint16_t read16(size_t at) const noexcept { return build(_data[at], _data[at + 1]); }
+        uint32_t read32(size_t at) const noexcept { return build(_data[at], _data[at + 1], _data[at + 2], _data[at + 3]); }
+        uint64_t read64(size_t at) const noexcept { return build(read32(at), read32(at + 4)); }
+        std::string_view stringAt(size_t at) const noexcept {
+            return std::string_view(reinterpret_cast<const char*>(_data + at + 2), read16(at));
+        }
+    private:
+        const uint8_t* _data = nullptr;
+        size_t _nameOffset = 0;
+        size_t _uidOffset = 0;
+        size_t _gidOffset = 0;
+        size_t _muidOffset = 0;
+};
+
+/**
+ * Walks the entries of an open directory fid. Reads are issued with the
+ * largest count the fid allows and the read for the next chunk is sent off as
+ * soon as the current one arrives so the server works on it while the
+ * caller consumes entries. At most two chunks are held at any time no matter
+ * how large the directory is.
+ */
+class DirectoryReader {
+    public:
+        /**
+         * @param count bytes to ask for per read, zero means the iounit
+         */
+        DirectoryReader(Client& client, uint32_t fid, uint32_t count = 0);
+        ~DirectoryReader();
+        DirectoryReader(const DirectoryReader&) = delete;
+        DirectoryReader& operator=(const DirectoryReader&) = delete;
+        /**
+         * Move to the next entry. The view stays valid until the following
+         * call to next.
+         * @return false once the end of the directory has been reached
+         */
+        bool next(StatView& entry);
+    private:
+        void postRead();
+        bool receiveChunk();
+    private:
+        Client& _client;
+        uint32_t _fid;
+        uint32_t _count;
+        uint64_t _offset = 0;
+        std::vector<uint8_t> _chunk;
+        size_t _position = 0;
+        uint16_t _tag = 0;
+        bool _pending = false;
+        bool _finished = false;
+};
+
+} // end namespace kzr
+
+#endif // end KZR_DIRECTORY_READER_H__
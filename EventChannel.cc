@@ -0,0 +1,215 @@
+/**
+ * @file
+ * Event files clients long-poll with reads implementation
+ * @copyright
+ * libkzr
+ * Copyright (c) 2019, Joshua Scoggins 
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR 
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "EventChannel.h"
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+namespace kzr {
+
+EventChannel::EventChannel(size_t backlog) : _backlog(std::max<size_t>(1, backlog)) { }
+
+ReadResponse
+EventChannel::makeResponse(std::string&& data) {
+    ReadResponse response;
+    response.getData().assign(data.begin(), data.end());
+    return response;
+}
+
+uint64_t
+EventChannel::subscribe() {
+    std::lock_guard<std::mutex> guard(_lock);
+    auto id = _next++;
+    _subscribers.emplace(id, Subscriber());
+    return id;
+}
+
+void
+EventChannel::unsubscribe(uint64_t subscriber) {
+    Backend::Responder responder;
+    {
+        std::lock_guard<std::mutex> guard(_lock);
+        if (auto it = _subscribers.find(subscriber); it != _subscribers.end()) {
+            if (it->second.parked) {
+                responder = std::move(it->second.responder);
+                --_parked;
+            }
+            _subscribers.erase(it);
+        }
+    }
+    if (responder) {
+        ErrorResponse error;
+        error.setErrorName("event file closed");
+        responder(error);
+    }
+}
+
+std::string
+EventChannel::take(Subscriber& subscriber, uint32_t count) {
+    std::string data;
+    // whole events while they fit, but always make progress on a large one
+    while (!subscriber.queue.empty() && data.size() < count) {
+        const auto& event = *subscriber.queue.front();
+        auto remaining = event.size() - subscriber.consumed;
+        if (data.size() + remaining > count) {
+            if (!data.empty()) {
+                break;
+            }
+            data.append(event, subscriber.consumed, count);
+            subscriber.consumed += count;
+            break;
+        }
+        data.append(event, subscriber.consumed, remaining);
+        subscriber.queue.pop_front();
+        subscriber.consumed = 0;
+        ++_stats.delivered;
+    }
+    return data;
+}
+
+void
+EventChannel::publish(const std::string& event) {
+    auto shared = std::make_shared<const std::string>(event);
+    std::vector<std::pair<Backend::Responder, std::string>> ready;
+    // readers which were idle and can take the event whole all get the same
+    // bytes, so the response is encoded once and shared between them
+    std::vector<Backend::Responder> broadcast;
+    {
+        std::lock_guard<std::mutex> guard(_lock);
+        ++_stats.published;
+        for (auto& [id, subscriber] : _subscribers) {
+            if (subscriber.parked && subscriber.queue.empty() && event.size() <= subscriber.count) {
+                subscriber.parked = false;
+                --_parked;
+                ++_stats.delivered;
+                broadcast.emplace_back(std::move(subscriber.responder));
+                continue;
+            }
+            if (subscriber.queue.size() >= _backlog) {
+                subscriber.queue.pop_front();
+                subscriber.consumed = 0;
+                ++_stats.dropped;
+            }
+            subscriber.queue.emplace_back(shared);
+            if (subscriber.parked) {
+                subscriber.parked = false;
+                --_parked;
+                ready.emplace_back(std::move(subscriber.responder), take(subscriber, subscriber.count));
+            }
+        }
+        if (!broadcast.empty()) {
+            ++_stats.broadcasts;
+        }
+    }
+    // answer outside of the lock, sending may take a while
+    if (!broadcast.empty()) {
+        auto encoded = EncodedResponse::read(event);
+        for (auto& responder : broadcast) {
+            responder(encoded);
+        }
+    }
+    for (auto& [responder, data] : ready) {
+        responder(makeResponse(std::move(data)));
+    }
+}
+
+void
+EventChannel::read(uint64_t subscriber, uint16_t tag, uint32_t count, Backend::Responder responder) {
+    std::string data;
+    {
+        std::lock_guard<std::mutex> guard(_lock);
+        auto it = _subscribers.find(subscriber);
+        if (it == _subscribers.end()) {
+            throw Exception("not subscribed");
+        }
+        auto& entry = it->second;
+        if (entry.queue.empty()) {
+            if (entry.parked) {
+                throw Exception("a read is already waiting on this fid");
+            }
+            entry.parked = true;
+            entry.tag = tag;
+            entry.count = count;
+            entry.responder = std::move(responder);
+            ++_parked;
+            return;
+        }
+        data = take(entry, count);
+    }
+    responder(makeResponse(std::move(data)));
+}
+
+std::string
+EventChannel::poll(uint64_t subscriber, uint32_t count) {
+    std::lock_guard<std::mutex> guard(_lock);
+    if (auto it = _subscribers.find(subscriber); it != _subscribers.end()) {
+        return take(it->second, count);
+    }
+    throw Exception("not subscribed");
+}
+
+bool
+EventChannel::cancel(uint64_t subscriber, uint16_t tag) {
+    Backend::Responder responder;
+    {
+        std::lock_guard<std::mutex> guard(_lock);
+        if (auto it = _subscribers.find(subscriber); it != _subscribers.end() && it->second.parked && it->second.tag == tag) {
+            it->second.parked = false;
+            responder = std::move(it->second.responder);
+            --_parked;
+        }
+    }
+    if (responder) {
+        ErrorResponse error;
+        error.setErrorName("interrupted");
+        responder(error);
+        return true;
+    }
+    return false;
+}
+
+size_t
+EventChannel::subscribers() {
+    std::lock_guard<std::mutex> guard(_lock);
+    return _subscribers.size();
+}
+
+size_t
+EventChannel::parked() {
+    std::lock_guard<std::mutex> guard(_lock);
+    return _parked;
+}
+
+EventChannel::Statistics
+EventChannel::getStatistics() {
+    std::lock_guard<std::mutex> guard(_lock);
+    return _stats;
+}
+
+} // end namespace kzr
@@ -0,0 +1,126 @@
+/**
+ * @file
+ * Event files clients long-poll with reads
+ * @copyright
+ * libkzr
+ * Copyright (c) 2019, Joshua Scoggins 
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR 
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef KZR_EVENT_CHANNEL_H__
+#define KZR_EVENT_CHANNEL_H__
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include "Backend.h"
+
+namespace kzr {
+
+/**
+ * The server side of an event file (in the style of wmii): every reader
+ * subscribes and gets its own queue of the events published after it did.
+ * A read with nothing queued is not answered until the next publish; all
+ * that is kept for it is the responder, so thousands of idle subscribers cost
+ * no more than their queue entries. Events are shared between the queues
+ * instead of being copied into each one.
+ *
+ * Responders of parked reads are invoked from the thread which publishes, a
+ * server run by an event loop only queues the responses to the loop there.
+ * Readers which were waiting with nothing queued are answered with a single
+ * encoding of the event shared between all of them.
+ */
+class EventChannel {
+    public:
+        static constexpr size_t defaultBacklog = 1024;
+        struct Statistics {
+            uint64_t published = 0;
+            uint64_t delivered = 0;
+            /**
+             * Events dropped from queues which hit the backlog
+             */
+            uint64_t dropped = 0;
+            /**
+             * Events which were encoded once and sent as is to every reader
+             * that was waiting for them
+             */
+            uint64_t broadcasts = 0;
+        };
+    public:
+        explicit EventChannel(size_t backlog = defaultBacklog);
+        uint64_t subscribe();
+        /**
+         * Drop the subscriber, a parked read is answered with an error
+         */
+        void unsubscribe(uint64_t subscriber);
+        /**
+         * Queue the event for every subscriber and answer every parked read
+         */
+        void publish(const std::string& event);
+        /**
+         * Answer a read of up to count bytes with queued events, or park it
+         * until something is published. Only one read per subscriber can be
+         * parked at a time.
+         */
+        void read(uint64_t subscriber, uint16_t tag, uint32_t count, Backend::Responder responder);
+        /**
+         * Take up to count bytes of queued events without waiting
+         */
+        std::string poll(uint64_t subscriber, uint32_t count);
+        /**
+         * Answer a parked read with an error (it was flushed)
+         * @return false if the read was not parked anymore
+         */
+        bool cancel(uint64_t subscriber, uint16_t tag);
+        size_t subscribers();
+        size_t parked();
+        constexpr auto getBacklog() const noexcept { return _backlog; }
+        Statistics getStatistics();
+    private:
+        using Event = std::shared_ptr<const std::string>;
+        struct Subscriber {
+            std::deque<Event> queue;
+            /**
+             * How much of the event at the front went out already, events
+             * larger than a read are handed out in pieces
+             */
+            size_t consumed = 0;
+            bool parked = false;
+            uint16_t tag = 0;
+            uint32_t count = 0;
+            Backend::Responder responder;
+        };
+        std::string take(Subscriber& subscriber, uint32_t count);
+        static ReadResponse makeResponse(std::string&& data);
+    private:
+        std::mutex _lock;
+        size_t _backlog;
+        uint64_t _next = 1;
+        std::unordered_map<uint64_t, Subscriber> _subscribers;
+        size_t _parked = 0;
+        Statistics _stats;
+};
+
+} // end namespace kzr
+
+#endif // end KZR_EVENT_CHANNEL_H__
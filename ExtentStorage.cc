@@ -0,0 +1,158 @@
+/**
+ * @file
+ * Growable byte storage made up of fixed size extents implementation
+ * @copyright
+ * libkzr
+ * Copyright (c) 2019, Joshua Scoggins 
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR 
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "ExtentStorage.h"
+#include "Exception.h"
+#include <algorithm>
+#include <cstring>
+#include <iterator>
+
+namespace kzr {
+
+bool
+StorageBudget::reserve(uint64_t bytes) noexcept {
+    auto used = _used.load(std::memory_order_relaxed);
+    do {
+        if (bytes > getLimit() || used > getLimit() - bytes) {
+            return false;
+        }
+    } while (!_used.compare_exchange_weak(used, used + bytes, std::memory_order_relaxed));
+    return true;
+}
+
+ExtentStorage::ExtentStorage(size_t extentSize, StorageBudget* budget) : _extentSize(extentSize), _budget(budget) {
+    if (extentSize == 0) {
+        throw Exception("Extent size must be greater than zero!");
+    }
+}
+
+ExtentStorage::~ExtentStorage() {
+    releaseFrom(0);
+}
+
+size_t
+ExtentStorage::read(uint64_t offset, size_t count, std::vector<uint8_t>& output) const {
+    if (offset >= _length) {
+        return 0;
+    }
+    auto total = size_t(std::min<uint64_t>(count, _length - offset));
+    auto start = output.size();
+    output.resize(start + total);
+    auto* destination = output.data() + start;
+    size_t copied = 0;
+    while (copied < total) {
+        auto position = offset + copied;
+        auto index = size_t(position / _extentSize);
+        auto within = size_t(position % _extentSize);
+        auto amount = std::min(total - copied, _extentSize - within);
+        if (auto it = _extents.find(index); it != _extents.end()) {
+            std::memcpy(destination + copied, it->second.get() + within, amount);
+        } else {
+            // never written, a hole
+            std::memset(destination + copied, 0, amount);
+        }
+        copied += amount;
+    }
+    return total;
+}
+
+void
+ExtentStorage::write(uint64_t offset, const uint8_t* data, size_t count) {
+    if (count == 0) {
+        return;
+    } else if (offset > maximumLength || count > maximumLength - offset) {
+        // also keeps offset + count from wrapping around
+        throw Exception("file too large");
+    }
+    auto end = offset + count;
+    auto first = size_t(offset / _extentSize);
+    auto last = size_t((end - 1) / _extentSize);
+    if (_budget) {
+        // pay for the missing extents up front so a write which doesn't fit
+        // leaves the file as it was
+        uint64_t missing = 0;
+        for (auto index = first; index <= last; ++index) {
+            missing += _extents.count(index) == 0 ? 1 : 0;
+        }
+        if (missing > 0 && !_budget->reserve(missing * _extentSize)) {
+            throw Exception("no space left on file system");
+        }
+    }
+    size_t written = 0;
+    while (written < count) {
+        auto position = offset + written;
+        auto index = size_t(position / _extentSize);
+        auto within = size_t(position % _extentSize);
+        auto amount = std::min(count - written, _extentSize - within);
+        auto& extent = _extents[index];
+        if (!extent) {
+            extent = std::make_unique<uint8_t[]>(_extentSize);
+        }
+        std::memcpy(extent.get() + within, data + written, amount);
+        written += amount;
+    }
+    _length = std::max(_length, end);
+}
+
+void
+ExtentStorage::releaseFrom(size_t index) {
+    auto from = _extents.lower_bound(index);
+    if (_budget) {
+        _budget->release(uint64_t(std::distance(from, _extents.end())) * _extentSize);
+    }
+    _extents.erase(from, _extents.end());
+}
+
+void
+ExtentStorage::truncate(uint64_t length) {
+    if (length > maximumLength) {
+        throw Exception("file too large");
+    }
+    if (length < _length) {
+        auto keep = size_t((length + _extentSize - 1) / _extentSize);
+        releaseFrom(keep);
+        // the bytes past the new end in the last extent have to read back as
+        // zeros if the file grows again later. A file grown by truncate has
+        // no extents past what was written, those are holes already.
+        if (auto within = size_t(length % _extentSize); within != 0) {
+            if (auto it = _extents.find(keep - 1); it != _extents.end()) {
+                std::memset(it->second.get() + within, 0, _extentSize - within);
+            }
+        }
+    }
+    // growing leaves the extents alone, everything past the old end is zero
+    // already or not allocated at all
+    _length = length;
+}
+
+size_t
+ExtentStorage::resident() const noexcept {
+    return _extentSize * _extents.size();
+}
+
+} // end namespace kzr
@@ -0,0 +1,123 @@
+/**
+ * @file
+ * Growable byte storage made up of fixed size extents
+ * @copyright
+ * libkzr
+ * Copyright (c) 2019, Joshua Scoggins 
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR 
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef KZR_EXTENT_STORAGE_H__
+#define KZR_EXTENT_STORAGE_H__
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <vector>
+
+namespace kzr {
+
+/**
+ * The bytes of extents every storage sharing it may hold between them, a
+ * file system hands one to all of its files so a client can't fill the
+ * memory of the host by writing to many of them
+ */
+class StorageBudget {
+    public:
+        explicit StorageBudget(uint64_t limit) : _limit(limit) { }
+        StorageBudget(const StorageBudget&) = delete;
+        StorageBudget& operator=(const StorageBudget&) = delete;
+        /**
+         * @return false if the bytes would take it over the limit
+         */
+        bool reserve(uint64_t bytes) noexcept;
+        void release(uint64_t bytes) noexcept { _used.fetch_sub(bytes, std::memory_order_relaxed); }
+        void setLimit(uint64_t limit) noexcept { _limit.store(limit, std::memory_order_relaxed); }
+        uint64_t getLimit() const noexcept { return _limit.load(std::memory_order_relaxed); }
+        uint64_t getUsed() const noexcept { return _used.load(std::memory_order_relaxed); }
+    private:
+        std::atomic<uint64_t> _limit;
+        std::atomic<uint64_t> _used { 0 };
+};
+
+/**
+ * File contents stored as a list of fixed size extents instead of one
+ * contiguous buffer. Growing the file only ever allocates new extents so
+ * existing data is never copied, and extents which were never written to
+ * are not allocated at all (they read back as zeros). Only the extents
+ * which exist are kept track of, so a write far into a file costs no more
+ * than one at its start.
+ */
+class ExtentStorage {
+    public:
+        static constexpr size_t defaultExtentSize = 64 * 1024;
+        /**
+         * Files can't grow past this, it keeps offsets well clear of
+         * wrapping around
+         */
+        static constexpr uint64_t maximumLength = uint64_t(1) << 40;
+    public:
+        /**
+         * @param budget charged for every extent allocated, none if null
+         */
+        explicit ExtentStorage(size_t extentSize = defaultExtentSize, StorageBudget* budget = nullptr);
+        ~ExtentStorage();
+        ExtentStorage(const ExtentStorage&) = delete;
+        ExtentStorage& operator=(const ExtentStorage&) = delete;
+        constexpr auto length() const noexcept { return _length; }
+        constexpr auto getExtentSize() const noexcept { return _extentSize; }
+        /**
+         * Copy up to count bytes starting at offset onto the end of output.
+         * @return the number of bytes copied
+         */
+        size_t read(uint64_t offset, size_t count, std::vector<uint8_t>& output) const;
+        /**
+         * Store the bytes at offset, the storage grows as needed.
+         * @throw Exception if the end would be past maximumLength or the
+         * budget can't cover the extents it needs, nothing is written then
+         */
+        void write(uint64_t offset, const uint8_t* data, size_t count);
+        void write(uint64_t offset, const std::vector<uint8_t>& data) { write(offset, data.data(), data.size()); }
+        /**
+         * Change the length, extents past the end are released.
+         * @throw Exception if the length is past maximumLength
+         */
+        void truncate(uint64_t length);
+        /**
+         * The number of bytes actually allocated
+         */
+        size_t resident() const noexcept;
+    private:
+        using Extent = std::unique_ptr<uint8_t[]>;
+        /**
+         * Release the extents from the given index on
+         */
+        void releaseFrom(size_t index);
+    private:
+        size_t _extentSize;
+        StorageBudget* _budget;
+        uint64_t _length = 0;
+        std::map<size_t, Extent> _extents;
+};
+
+} // end namespace kzr
+
+#endif // end KZR_EXTENT_STORAGE_H__
@@ -0,0 +1,109 @@
+/**
+ * @file
+ * Deficit round robin between the connections sharing a request scheduler
+ * implementation
+ * @copyright
+ * libkzr
+ * Copyright (c) 2019, Joshua Scoggins 
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR 
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "FairQueue.h"
+
+namespace kzr {
+
+FairQueue::FairQueue(RequestScheduler& scheduler, size_t window, uint64_t quantum) :
+    _scheduler(scheduler),
+    _window(window == 0 ? scheduler.getWorkerCount() * 2 : window),
+    _quantum(quantum == 0 ? 1 : quantum) { }
+
+void
+FairQueue::schedule(uint64_t flow, uint64_t cost, uint64_t key, Job job, Priority priority) {
+    std::lock_guard<std::mutex> guard(_lock);
+    auto [it, created] = _flows.try_emplace(flow);
+    it->second.jobs.emplace_back(Pending { cost, key, std::move(job), priority });
+    if (created) {
+        _turns.emplace_back(flow);
+    }
+    ++_waiting;
+    release();
+}
+
+void
+FairQueue::release() {
+    while (_inFlight < _window && !_turns.empty()) {
+        auto id = _turns.front();
+        auto& flow = _flows[id];
+        if (!flow.granted) {
+            flow.deficit += _quantum;
+            flow.granted = true;
+        }
+        if (flow.jobs.front().cost > flow.deficit) {
+            // the turn is over, what is left of the deficit carries over
+            flow.granted = false;
+            _turns.pop_front();
+            _turns.emplace_back(id);
+            continue;
+        }
+        auto pending = std::move(flow.jobs.front());
+        flow.jobs.pop_front();
+        flow.deficit -= pending.cost;
+        if (flow.jobs.empty()) {
+            // an idle flow does not get to save up
+            _flows.erase(id);
+            _turns.pop_front();
+        }
+        --_waiting;
+        ++_inFlight;
+        ++_released;
+        // let in while holding the lock so the jobs of a flow reach the
+        // scheduler in order
+        _scheduler.schedule(pending.key, [this, job = std::move(pending.job)]() {
+                    try {
+                        job();
+                    } catch (...) {
+                        done();
+                        throw;
+                    }
+                    done();
+                }, pending.priority);
+    }
+}
+
+void
+FairQueue::done() {
+    std::lock_guard<std::mutex> guard(_lock);
+    --_inFlight;
+    release();
+}
+
+FairQueue::Statistics
+FairQueue::getStatistics() {
+    std::lock_guard<std::mutex> guard(_lock);
+    Statistics stats;
+    stats.released = _released;
+    stats.waiting = _waiting;
+    stats.flows = _flows.size();
+    return stats;
+}
+
+} // end namespace kzr
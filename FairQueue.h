@@ -0,0 +1,118 @@
+/**
+ * @file
+ * Deficit round robin between the connections sharing a request scheduler
+ * @copyright
+ * libkzr
+ * Copyright (c) 2019, Joshua Scoggins 
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR 
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef KZR_FAIR_QUEUE_H__
+#define KZR_FAIR_QUEUE_H__
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <unordered_map>
+#include "RequestScheduler.h"
+
+namespace kzr {
+
+/**
+ * Sits in front of a request scheduler and lets only so many jobs into it
+ * at a time. Jobs wait in a queue per flow (the server uses one per
+ * connection) and the flows take turns by deficit round robin: each turn a
+ * flow is granted a quantum of bytes and lets jobs in for as long as it has
+ * enough left to pay for the next one. A connection issuing a stream of
+ * large transfers gets the same share of the scheduler as one issuing small
+ * requests, instead of a share in proportion to how much it asks for.
+ *
+ * The jobs of a flow are let in in the order they came, so whatever order
+ * the scheduler keeps between them is kept.
+ */
+class FairQueue {
+    public:
+        using Job = RequestScheduler::Job;
+        using Priority = RequestScheduler::Priority;
+        static constexpr size_t defaultQuantum = 16 * 1024;
+        struct Statistics {
+            uint64_t released = 0;
+            /**
+             * Jobs waiting for their turn right now
+             */
+            uint64_t waiting = 0;
+            uint64_t flows = 0;
+        };
+    public:
+        /**
+         * @param window the most jobs let into the scheduler and not done
+         * yet, twice the number of workers if zero
+         * @param quantum the bytes a flow is granted each turn
+         */
+        explicit FairQueue(RequestScheduler& scheduler, size_t window = 0, uint64_t quantum = defaultQuantum);
+        FairQueue(const FairQueue&) = delete;
+        FairQueue& operator=(const FairQueue&) = delete;
+        /**
+         * Schedule the job under the key once the flow gets its turn
+         * @param cost what the job moves in bytes
+         */
+        void schedule(uint64_t flow, uint64_t cost, uint64_t key, Job job, Priority priority = Priority::Urgent);
+        constexpr auto getWindow() const noexcept { return _window; }
+        constexpr auto getQuantum() const noexcept { return _quantum; }
+        Statistics getStatistics();
+    private:
+        struct Pending {
+            uint64_t cost;
+            uint64_t key;
+            Job job;
+            Priority priority;
+        };
+        struct Flow {
+            std::deque<Pending> jobs;
+            uint64_t deficit = 0;
+            /**
+             * The quantum of the current turn has been granted
+             */
+            bool granted = false;
+        };
+        /**
+         * Let jobs into the scheduler while the window allows, the lock
+         * has to be held
+         */
+        void release();
+        void done();
+    private:
+        RequestScheduler& _scheduler;
+        size_t _window;
+        uint64_t _quantum;
+        std::mutex _lock;
+        std::unordered_map<uint64_t, Flow> _flows;
+        /**
+         * The flows with jobs waiting, the one whose turn it is in front
+         */
+        std::deque<uint64_t> _turns;
+        size_t _inFlight = 0;
+        uint64_t _released = 0;
+        uint64_t _waiting = 0;
+};
+
+} // end namespace kzr
+
+#endif // end KZR_FAIR_QUEUE_H__
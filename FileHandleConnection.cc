@@ -27,7 +27,10 @@
  */
 
 #include "FileHandleConnection.h"
+#include <cerrno>
 #include <unistd.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
 
 namespace kzr {
 
@@ -41,7 +44,16 @@ FileHandleConnection::~FileHandleConnection() {
 size_t
 FileHandleConnection::rawWrite(const std::string& data) {
     if (isValidHandle()) {
-        return ::write(_handle, data.c_str(), data.size());
+        // sockets are allowed to accept less than the full buffer
+        size_t total = 0;
+        while (total < data.size()) {
+            if (auto count = ::write(_handle, data.c_str() + total, data.size() - total); count <= 0) {
+                break;
+            } else {
+                total += count;
+            }
+        }
+        return total;
     } else {
         return 0;
     }
@@ -51,11 +63,78 @@ FileHandleConnection::rawWrite(const std::string& data) {
 size_t
 FileHandleConnection::rawRead(std::string& data) {
     if (isValidHandle()) {
-        return ::read(_handle, data.data(), data.capacity());
+        // a message may arrive in several pieces so keep going until the
+        // buffer is full or the other side hangs up
+        size_t total = 0;
+        while (total < data.size()) {
+            if (auto count = ::read(_handle, data.data() + total, data.size() - total); count <= 0) {
+                break;
+            } else {
+                total += count;
+            }
+        }
+        return total;
     } else {
         return 0;
     }
 }
 
+size_t
+FileHandleConnection::rawSendFile(int fd, uint64_t offset, size_t count) {
+    if (!isValidHandle()) {
+        return 0;
+    }
+    size_t total = 0;
+    while (total < count) {
+        off_t position = off_t(offset + total);
+        if (auto sent = ::sendfile(_handle, fd, &position, count - total); sent > 0) {
+            total += size_t(sent);
+        } else if (sent < 0 && errno == EINTR) {
+            continue;
+        } else if (sent < 0 && total == 0 && (errno == EINVAL || errno == ENOSYS)) {
+            // this kind of descriptor can't be spliced from, copy instead
+            return Parent::rawSendFile(fd, offset, count);
+        } else {
+            break;
+        }
+    }
+    return total;
+}
+
+size_t
+FileHandleConnection::rawWriteVector(const std::string& header, const uint8_t* data, size_t count) {
+    if (!isValidHandle()) {
+        return 0;
+    }
+    struct iovec pieces[2];
+    pieces[0].iov_base = const_cast<char*>(header.data());
+    pieces[0].iov_len = header.size();
+    pieces[1].iov_base = const_cast<uint8_t*>(data);
+    pieces[1].iov_len = count;
+    struct iovec* current = pieces;
+    int remaining = 2;
+    size_t total = 0;
+    while (remaining > 0) {
+        auto written = ::writev(_handle, current, remaining);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        } else if (written <= 0) {
+            break;
+        }
+        total += size_t(written);
+        // step over whatever was fully written and trim the rest
+        auto consumed = size_t(written);
+        while (remaining > 0 && consumed >= current->iov_len) {
+            consumed -= current->iov_len;
+            ++current;
+            --remaining;
+        }
+        if (remaining > 0) {
+            current->iov_base = static_cast<uint8_t*>(current->iov_base) + consumed;
+            current->iov_len -= consumed;
+        }
+    }
+    return total;
+}
 
 } // end namespace kzr
@@ -45,6 +45,17 @@ class FileHandleConnection : public Connection {
     protected:
         [[nodiscard]] virtual size_t rawWrite(const std::string& data) override;
         [[nodiscard]] virtual size_t rawRead(std::string& data) override;
+        /**
+         * Uses sendfile so the data goes from the page cache straight to the
+         * handle, falls back to copying when the kernel refuses the pair of
+         * descriptors.
+         */
+        [[nodiscard]] virtual size_t rawSendFile(int fd, uint64_t offset, size_t count) override;
+        /**
+         * Gathers the header and data with writev instead of copying them
+         * together.
+         */
+        [[nodiscard]] virtual size_t rawWriteVector(const std::string& header, const uint8_t* data, size_t count) override;
     private:
         int _handle;
         bool _destroy;
@@ -0,0 +1,247 @@
+/**
+ * @file
+ * Access to the header fields of an undecoded message implementation
+ * @copyright
+ * libkzr
+ * Copyright (c) 2019, Joshua Scoggins 
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR 
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "FrameView.h"
+#include "Exception.h"
+
+namespace kzr {
+
+namespace {
+// everything is laid out right after the type and the tag
+constexpr size_t typeOffset = 0;
+constexpr size_t tagOffset = 1;
+constexpr size_t bodyOffset = 3;
+// the newfid of a walk and the afid of an attach
+constexpr size_t secondFidOffset = bodyOffset + 4;
+constexpr size_t walkNamesOffset = secondFidOffset + 4;
+constexpr size_t ioOffsetOffset = bodyOffset + 4;
+constexpr size_t ioCountOffset = ioOffsetOffset + 8;
+} // end namespace
+
+FrameView::FrameView(std::string&& frame) : _frame(std::move(frame)) {
+    if (_frame.length() < bodyOffset) {
+        throw Exception("message is too short to hold a header!");
+    }
+    _type = Operation(uint8_t(_frame[typeOffset]));
+}
+
+uint16_t
+FrameView::get16(size_t offset) const {
+    if (_frame.length() < offset + 2) {
+        throw Exception("message is too short!");
+    }
+    return build(uint8_t(_frame[offset]), uint8_t(_frame[offset + 1]));
+}
+
+uint32_t
+FrameView::get32(size_t offset) const {
+    return build(get16(offset), get16(offset + 2));
+}
+
+uint64_t
+FrameView::get64(size_t offset) const {
+    return build(get32(offset), get32(offset + 4));
+}
+
+void
+FrameView::put16(size_t offset, uint16_t value) {
+    if (_frame.length() < offset + 2) {
+        throw Exception("message is too short!");
+    }
+    _frame[offset] = char(uint8_t(value));
+    _frame[offset + 1] = char(uint8_t(value >> 8));
+}
+
+void
+FrameView::put32(size_t offset, uint32_t value) {
+    put16(offset, uint16_t(value));
+    put16(offset + 2, uint16_t(value >> 16));
+}
+
+uint16_t
+FrameView::getTag() const {
+    return get16(tagOffset);
+}
+
+void
+FrameView::setTag(uint16_t tag) {
+    put16(tagOffset, tag);
+}
+
+bool
+FrameView::hasFid() const noexcept {
+    switch (_type) {
+        case Operation::TAuth:
+        case Operation::TAttach:
+        case Operation::TWalk:
+        case Operation::TOpen:
+        case Operation::TCreate:
+        case Operation::TRead:
+        case Operation::TWrite:
+        case Operation::TClunk:
+        case Operation::TRemove:
+        case Operation::TStat:
+        case Operation::TWStat:
+            return true;
+        default:
+            return false;
+    }
+}
+
+bool
+FrameView::hasSecondFid() const noexcept {
+    return _type == Operation::TWalk || _type == Operation::TAttach;
+}
+
+std::optional<uint32_t>
+FrameView::getFid() const {
+    if (hasFid()) {
+        return get32(bodyOffset);
+    } else {
+        return std::nullopt;
+    }
+}
+
+void
+FrameView::setFid(uint32_t fid) {
+    if (!hasFid()) {
+        throw Exception("message does not carry a fid!");
+    }
+    put32(bodyOffset, fid);
+}
+
+std::optional<uint32_t>
+FrameView::getSecondFid() const {
+    if (hasSecondFid()) {
+        return get32(secondFidOffset);
+    } else {
+        return std::nullopt;
+    }
+}
+
+void
+FrameView::setSecondFid(uint32_t fid) {
+    if (!hasSecondFid()) {
+        throw Exception("message does not carry a second fid!");
+    }
+    put32(secondFidOffset, fid);
+}
+
+std::optional<uint64_t>
+FrameView::getOffset() const {
+    if (_type == Operation::TRead || _type == Operation::TWrite) {
+        return get64(ioOffsetOffset);
+    } else {
+        return std::nullopt;
+    }
+}
+
+std::optional<uint32_t>
+FrameView::getCount() const {
+    if (_type == Operation::TRead || _type == Operation::TWrite) {
+        return get32(ioCountOffset);
+    } else if (_type == Operation::RRead) {
+        return get32(bodyOffset);
+    } else {
+        return std::nullopt;
+    }
+}
+
+std::optional<uint16_t>
+FrameView::getOldTag() const {
+    if (_type == Operation::TFlush) {
+        return get16(bodyOffset);
+    } else {
+        return std::nullopt;
+    }
+}
+
+void
+FrameView::setOldTag(uint16_t tag) {
+    if (_type != Operation::TFlush) {
+        throw Exception("message is not a flush!");
+    }
+    put16(bodyOffset, tag);
+}
+
+std::optional<uint16_t>
+FrameView::getWalkCount() const {
+    if (_type == Operation::TWalk) {
+        return get16(walkNamesOffset);
+    } else if (_type == Operation::RWalk) {
+        return get16(bodyOffset);
+    } else {
+        return std::nullopt;
+    }
+}
+
+Request
+FrameView::decodeRequest() const {
+    MessageStream msg;
+    msg.str(_frame);
+    Request request;
+    msg >> request;
+    return request;
+}
+
+Response
+FrameView::decodeResponse() const {
+    MessageStream msg;
+    msg.str(_frame);
+    Response response;
+    msg >> response;
+    return response;
+}
+
+FrameView
+FrameView::make(Operation type, uint16_t tag, uint32_t fid) {
+    std::string frame(bodyOffset + 4, '\0');
+    frame[typeOffset] = char(uint8_t(type));
+    FrameView result(std::move(frame));
+    result.setTag(tag);
+    result.put32(bodyOffset, fid);
+    return result;
+}
+
+} // end namespace kzr
+
+kzr::Connection&
+operator<<(kzr::Connection& c, const kzr::FrameView& frame) {
+    kzr::MessageStream msg;
+    msg.str(frame.bytes());
+    c << msg;
+    return c;
+}
+
+kzr::Connection&
+operator>>(kzr::Connection& c, kzr::FrameView& frame) {
+    kzr::MessageStream msg;
+    c >> msg;
+    frame = kzr::FrameView(msg.str());
+    return c;
+}
@@ -0,0 +1,119 @@
+/**
+ * @file
+ * Access to the header fields of an undecoded message
+ * @copyright
+ * libkzr
+ * Copyright (c) 2019, Joshua Scoggins 
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR 
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef KZR_FRAME_VIEW_H__
+#define KZR_FRAME_VIEW_H__
+#include <cstdint>
+#include <optional>
+#include <string>
+#include "Message.h"
+#include "Interaction.h"
+#include "Connection.h"
+
+namespace kzr {
+
+/**
+ * A message as it came off of the wire (minus the size field) where only the
+ * type and tag are looked at up front. The fields which sit at a fixed place
+ * right after the tag (the fid a request acts on, the newfid of a walk, the
+ * offset and count of a read or write...) can be read and patched in place;
+ * the rest of the body is only decoded when asked for. Meant for code which
+ * routes or forwards messages and has no use for most of what is in them.
+ */
+class FrameView {
+    public:
+        FrameView() = default;
+        /**
+         * @throw Exception if the frame is too short to hold a header
+         */
+        explicit FrameView(std::string&& frame);
+        explicit FrameView(const MessageStream& msg) : FrameView(msg.str()) { }
+        /**
+         * The size of the message on the wire, including the size field
+         */
+        auto size() const noexcept { return _frame.length() + 4; }
+        constexpr auto getType() const noexcept { return _type; }
+        constexpr auto isRequest() const noexcept { return (uint8_t(_type) & 1) == 0; }
+        uint16_t getTag() const;
+        void setTag(uint16_t tag);
+        /**
+         * The fid the request acts on (the afid of an auth)
+         */
+        std::optional<uint32_t> getFid() const;
+        void setFid(uint32_t fid);
+        /**
+         * The newfid of a walk or the afid of an attach
+         */
+        std::optional<uint32_t> getSecondFid() const;
+        void setSecondFid(uint32_t fid);
+        /**
+         * The offset of a read or write request
+         */
+        std::optional<uint64_t> getOffset() const;
+        /**
+         * The count of a read or write request or of a read response
+         */
+        std::optional<uint32_t> getCount() const;
+        /**
+         * The oldtag of a flush request
+         */
+        std::optional<uint16_t> getOldTag() const;
+        void setOldTag(uint16_t tag);
+        /**
+         * The number of names of a walk request or qids of a walk response
+         */
+        std::optional<uint16_t> getWalkCount() const;
+        /**
+         * Decode the whole message
+         */
+        Request decodeRequest() const;
+        Response decodeResponse() const;
+        const std::string& bytes() const noexcept { return _frame; }
+        /**
+         * Build a frame which only consists of a header followed by a single
+         * fid, such as a clunk
+         */
+        static FrameView make(Operation type, uint16_t tag, uint32_t fid);
+    private:
+        uint16_t get16(size_t offset) const;
+        uint32_t get32(size_t offset) const;
+        uint64_t get64(size_t offset) const;
+        void put16(size_t offset, uint16_t value);
+        void put32(size_t offset, uint32_t value);
+        bool hasFid() const noexcept;
+        bool hasSecondFid() const noexcept;
+    private:
+        std::string _frame;
+        Operation _type = Operation::TBad;
+};
+
+} // end namespace kzr
+
+kzr::Connection& operator<<(kzr::Connection&, const kzr::FrameView&);
+kzr::Connection& operator>>(kzr::Connection&, kzr::FrameView&);
+
+#endif // end KZR_FRAME_VIEW_H__
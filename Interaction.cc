@@ -99,3 +99,47 @@ operator>>(kzr::MessageStream& msg, kzr::Interaction& thing) {
         throw kzr::Exception("Cannot deduce type because message is not in a good state!");
     }
 }
+
+kzr::EncodedResponse
+kzr::EncodedResponse::read(const std::string& data) {
+    // the count followed by the data, built directly since the payload is
+    // the only part worth encoding once
+    auto count = uint32_t(data.length());
+    auto body = std::make_shared<std::string>();
+    body->reserve(data.length() + 4);
+    body->push_back(char(uint8_t(count)));
+    body->push_back(char(uint8_t(count >> 8)));
+    body->push_back(char(uint8_t(count >> 16)));
+    body->push_back(char(uint8_t(count >> 24)));
+    body->append(data);
+    EncodedResponse result;
+    result.type = Operation::RRead;
+    result.body = std::move(body);
+    return result;
+}
+
+kzr::Response
+kzr::EncodedResponse::decode() const {
+    kzr::MessageStream msg;
+    msg << uint8_t(type) << kzr::notag;
+    if (body) {
+        msg.write(*body);
+    }
+    kzr::Response response;
+    msg >> response;
+    return response;
+}
+
+kzr::EncodedResponse
+kzr::EncodedResponse::encode(const kzr::Response& response) {
+    kzr::MessageStream msg;
+    msg << response;
+    auto contents = msg.str();
+    if (contents.length() < 3) {
+        throw kzr::Exception("encoded response is missing its header!");
+    }
+    EncodedResponse result;
+    result.type = Operation(uint8_t(contents[0]));
+    result.body = std::make_shared<const std::string>(contents, 3);
+    return result;
+}
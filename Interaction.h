@@ -25,10 +25,12 @@
  * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
-#ifndef KZR_CLIENT_H__
-#define KZR_CLIENT_H__
+#ifndef KZR_INTERACTION_H__
+#define KZR_INTERACTION_H__
 #include <variant>
 #include <functional>
+#include <memory>
+#include <string>
 #include "Message.h"
 namespace kzr {
 using Response = std::variant<
@@ -48,6 +50,31 @@ KZR_PROTOCOL_KINDS
 /// A top level return and encoding type that client and servers send off
 using Interaction = std::variant<Response, Request>;
 
+/**
+ * A response encoded once so it can be sent any number of times, only the
+ * tag differs from one copy to the next and it is not part of the encoding.
+ */
+struct EncodedResponse {
+    Operation type = Operation::RBad;
+    /**
+     * Everything after the tag
+     */
+    std::shared_ptr<const std::string> body;
+    /**
+     * Encode an Rread carrying the given data
+     */
+    static EncodedResponse read(const std::string& data);
+    /**
+     * Encode any response, its tag is dropped
+     */
+    static EncodedResponse encode(const Response& response);
+    /**
+     * Turn it back into a response (with no tag) for paths which can't send
+     * it as is
+     */
+    Response decode() const;
+};
+
 using RecieveInteraction = std::function<Interaction()>;
 using SendInteraction = std::function<void(const Interaction&)>;
 } // end namespace kzr
@@ -58,4 +85,4 @@ kzr::MessageStream& operator<<(kzr::MessageStream&, const kzr::Response&);
 kzr::MessageStream& operator>>(kzr::MessageStream&, kzr::Response&);
 kzr::MessageStream& operator<<(kzr::MessageStream&, const kzr::Interaction&);
 kzr::MessageStream& operator>>(kzr::MessageStream&, kzr::Interaction&);
-#endif // end KZR_CLIENT_H__
+#endif // end KZR_INTERACTION_H__
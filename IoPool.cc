@@ -0,0 +1,132 @@
+/**
+ * @file
+ * Blocking disk I/O carried out on a pool of dedicated threads implementation
+ * @copyright
+ * libkzr
+ * Copyright (c) 2019, Joshua Scoggins 
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR 
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "IoPool.h"
+#include <cerrno>
+#include <unistd.h>
+
+namespace kzr {
+
+IoPool::IoPool(size_t threads) {
+    if (threads == 0) {
+        threads = 1;
+    }
+    for (size_t i = 0; i < threads; ++i) {
+        _threads.emplace_back([this]() { run(); });
+    }
+}
+
+IoPool::~IoPool() {
+    {
+        std::lock_guard<std::mutex> guard(_lock);
+        _stopping = true;
+    }
+    _ready.notify_all();
+    for (auto& thread : _threads) {
+        thread.join();
+    }
+}
+
+void
+IoPool::run() {
+    while (true) {
+        Job job;
+        {
+            std::unique_lock<std::mutex> guard(_lock);
+            _ready.wait(guard, [this]() { return _stopping || !_jobs.empty(); });
+            if (_jobs.empty()) {
+                // only reached when stopping and everything has been done
+                return;
+            }
+            job = std::move(_jobs.front());
+            _jobs.pop_front();
+        }
+        job();
+    }
+}
+
+void
+IoPool::post(Job&& job) {
+    {
+        std::lock_guard<std::mutex> guard(_lock);
+        _jobs.emplace_back(std::move(job));
+    }
+    _ready.notify_one();
+}
+
+size_t
+IoPool::queued() {
+    std::lock_guard<std::mutex> guard(_lock);
+    return _jobs.size();
+}
+
+void
+IoPool::read(int fd, uint64_t offset, size_t count, Callback callback) {
+    post([fd, offset, count, callback = std::move(callback)]() {
+        Result result;
+        result.data.resize(count);
+        do {
+            result.count = ::pread(fd, result.data.data(), count, off_t(offset));
+        } while (result.count < 0 && errno == EINTR);
+        if (result.count < 0) {
+            result.error = errno;
+            result.data.clear();
+        } else {
+            result.data.resize(size_t(result.count));
+        }
+        callback(std::move(result));
+    });
+}
+
+void
+IoPool::write(int fd, uint64_t offset, std::vector<uint8_t>&& data, Callback callback) {
+    post([fd, offset, data = std::move(data), callback = std::move(callback)]() {
+        Result result;
+        do {
+            result.count = ::pwrite(fd, data.data(), data.size(), off_t(offset));
+        } while (result.count < 0 && errno == EINTR);
+        if (result.count < 0) {
+            result.error = errno;
+        }
+        callback(std::move(result));
+    });
+}
+
+void
+IoPool::sync(int fd, bool dataOnly, Callback callback) {
+    post([fd, dataOnly, callback = std::move(callback)]() {
+        Result result;
+        result.count = dataOnly ? ::fdatasync(fd) : ::fsync(fd);
+        if (result.count < 0) {
+            result.error = errno;
+        }
+        callback(std::move(result));
+    });
+}
+
+} // end namespace kzr
@@ -0,0 +1,103 @@
+/**
+ * @file
+ * Blocking disk I/O carried out on a pool of dedicated threads
+ * @copyright
+ * libkzr
+ * Copyright (c) 2019, Joshua Scoggins 
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR 
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef KZR_IO_POOL_H__
+#define KZR_IO_POOL_H__
+#include <cstdint>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <sys/types.h>
+
+namespace kzr {
+
+/**
+ * Runs pread, pwrite and fsync calls on threads of its own so the threads
+ * handling requests never wait on storage. Every operation hands its outcome
+ * to a callback which is invoked on the I/O thread once the call returns.
+ *
+ * Callers must keep the descriptor open until the callback runs, usually by
+ * capturing whatever owns it in the callback.
+ */
+class IoPool {
+    public:
+        static constexpr size_t defaultThreadCount = 4;
+        struct Result {
+            /**
+             * The return value of the system call
+             */
+            ssize_t count = 0;
+            /**
+             * errno when count is negative
+             */
+            int error = 0;
+            /**
+             * The bytes read, empty for other operations
+             */
+            std::vector<uint8_t> data;
+        };
+        using Callback = std::function<void(Result&&)>;
+        using Job = std::function<void()>;
+    public:
+        explicit IoPool(size_t threads = defaultThreadCount);
+        /**
+         * Finishes every queued operation before returning
+         */
+        ~IoPool();
+        IoPool(const IoPool&) = delete;
+        IoPool& operator=(const IoPool&) = delete;
+        void read(int fd, uint64_t offset, size_t count, Callback callback);
+        void write(int fd, uint64_t offset, std::vector<uint8_t>&& data, Callback callback);
+        /**
+         * fdatasync when dataOnly is set, fsync otherwise
+         */
+        void sync(int fd, bool dataOnly, Callback callback);
+        /**
+         * Run any other blocking work on the pool
+         */
+        void post(Job&& job);
+        /**
+         * The number of operations waiting for a thread
+         */
+        size_t queued();
+        auto getThreadCount() const noexcept { return _threads.size(); }
+    private:
+        void run();
+    private:
+        std::mutex _lock;
+        std::condition_variable _ready;
+        std::deque<Job> _jobs;
+        bool _stopping = false;
+        std::vector<std::thread> _threads;
+};
+
+} // end namespace kzr
+
+#endif // end KZR_IO_POOL_H__
@@ -0,0 +1,325 @@
+/**
+ * @file
+ * Backend serving host files out of memory mappings implementation
+ * @copyright
+ * libkzr
+ * Copyright (c) 2019, Joshua Scoggins 
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR 
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "MappedFileSystem.h"
+#include "AccessPermissions.h"
+#include "Exception.h"
+#include <algorithm>
+#include <cerrno>
+#include <csetjmp>
+#include <csignal>
+#include <cstring>
+#include <mutex>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace kzr {
+
+namespace {
+constexpr uint64_t dontTouch64 = ~uint64_t(0);
+/**
+ * The number of reads in a row which have to agree before a hint is given
+ */
+constexpr uint32_t sequentialThreshold = 2;
+constexpr uint32_t randomThreshold = 4;
+
+size_t
+pageSize() noexcept {
+    static const size_t size = size_t(::sysconf(_SC_PAGESIZE));
+    return size;
+}
+
+/**
+ * Set while the thread copies out of a mapping
+ */
+thread_local sigjmp_buf* volatile copyFault = nullptr;
+struct sigaction previousBusHandler;
+
+void
+onBusError(int signal, siginfo_t* info, void* context) {
+    if (copyFault) {
+        siglongjmp(*copyFault, 1);
+    }
+    // not a copy of ours, hand it on and stay installed for the next one
+    if (previousBusHandler.sa_flags & SA_SIGINFO) {
+        previousBusHandler.sa_sigaction(signal, info, context);
+    } else if (previousBusHandler.sa_handler != SIG_DFL && previousBusHandler.sa_handler != SIG_IGN) {
+        previousBusHandler.sa_handler(signal);
+    } else {
+        // nobody else wants it, the faulting access runs again and takes
+        // the process down as it would have without us
+        ::signal(SIGBUS, SIG_DFL);
+    }
+}
+
+/**
+ * Copy out of a mapping, a file shrunk by someone else meanwhile raises
+ * SIGBUS for the pages past its new end
+ * @return false if the copy ran past the end of the file
+ */
+bool
+guardedCopy(uint8_t* to, const uint8_t* from, size_t count) {
+    static std::once_flag installed;
+    std::call_once(installed, []() {
+                struct sigaction action {};
+                action.sa_sigaction = onBusError;
+                action.sa_flags = SA_SIGINFO;
+                sigemptyset(&action.sa_mask);
+                ::sigaction(SIGBUS, &action, &previousBusHandler);
+            });
+    sigjmp_buf jump;
+    if (sigsetjmp(jump, 1) != 0) {
+        copyFault = nullptr;
+        return false;
+    }
+    copyFault = &jump;
+    std::memcpy(to, from, count);
+    copyFault = nullptr;
+    return true;
+}
+
+} // end namespace
+
+MappedFileSystem::Mapping::~Mapping() {
+    ::munmap(const_cast<uint8_t*>(_data), _length);
+}
+
+MappedFileSystem::MappedFileSystem(const std::string& path, size_t addressSpaceBudget, Clock::duration idleTimeout, size_t descriptorCapacity) :
+    PassthroughFileSystem(path, descriptorCapacity),
+    _budget(addressSpaceBudget),
+    _idleTimeout(idleTimeout) { }
+
+MappedFileSystem::MappingHandle
+MappedFileSystem::map(const std::string& path, int fd, const struct stat& info, uint64_t offset, size_t count) {
+    auto length = size_t(info.st_size);
+    if (!S_ISREG(info.st_mode) || length < _minimumMappedSize || length > _budget) {
+        return nullptr;
+    }
+    auto qid = makeQid(info);
+    auto now = Clock::now();
+    std::lock_guard<std::mutex> guard(_mappingLock);
+    sweep(now);
+    if (auto it = _files.find(path); it != _files.end()) {
+        // the length is checked on its own since a shrunk file has to be
+        // remapped whatever the version says
+        if (it->second.qid.getPath() == qid.getPath() && it->second.qid.getVersion() == qid.getVersion() && it->second.mapping->length() == length) {
+            auto& file = it->second;
+            ++_stats.hits;
+            file.lastUse = now;
+            _order.splice(_order.begin(), _order, file.position);
+            observe(file, offset, count);
+            return file.mapping;
+        }
+        // the file changed since it was mapped
+        release(path);
+    }
+    while (_mapped + length > _budget && !_order.empty()) {
+        release(_order.back());
+    }
+    auto address = ::mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+    if (address == MAP_FAILED) {
+        return nullptr;
+    }
+    ++_stats.maps;
+    _mapped += length;
+    _order.emplace_front(path);
+    MappedFile file;
+    file.mapping = std::make_shared<const Mapping>(static_cast<const uint8_t*>(address), length);
+    file.qid = qid;
+    file.lastUse = now;
+    file.position = _order.begin();
+    auto& inserted = _files.emplace(path, std::move(file)).first->second;
+    observe(inserted, offset, count);
+    return inserted.mapping;
+}
+
+void
+MappedFileSystem::observe(MappedFile& file, uint64_t offset, size_t count) {
+    auto base = const_cast<uint8_t*>(file.mapping->getData());
+    auto length = file.mapping->length();
+    if (offset == file.nextOffset) {
+        file.randomReads = 0;
+        if (++file.sequentialReads >= sequentialThreshold) {
+            if (file.advice != Advice::Sequential) {
+                ::madvise(base, length, MADV_SEQUENTIAL);
+                file.advice = Advice::Sequential;
+                ++_stats.sequentialHints;
+            }
+            // ask for the next window once the reader is halfway through the
+            // last one, not on every read
+            auto end = offset + count;
+            if (end + _readAheadWindow / 2 > file.prefetchedTo && end < length) {
+                auto start = std::max<uint64_t>(end, file.prefetchedTo);
+                start -= start % pageSize();
+                auto stop = std::min<uint64_t>(length, end + _readAheadWindow);
+                if (stop > start) {
+                    ::madvise(base + start, size_t(stop - start), MADV_WILLNEED);
+                    ++_stats.willNeedHints;
+                }
+                file.prefetchedTo = stop;
+            }
+        }
+    } else {
+        file.sequentialReads = 0;
+        file.prefetchedTo = 0;
+        if (++file.randomReads >= randomThreshold && file.advice != Advice::Random) {
+            ::madvise(base, length, MADV_RANDOM);
+            file.advice = Advice::Random;
+            ++_stats.randomHints;
+        }
+    }
+    file.nextOffset = offset + count;
+}
+
+void
+MappedFileSystem::release(const std::string& path) {
+    if (auto it = _files.find(path); it != _files.end()) {
+        // readers still holding the mapping keep it around until they finish
+        _mapped -= it->second.mapping->length();
+        _order.erase(it->second.position);
+        _files.erase(it);
+        ++_stats.unmaps;
+    }
+}
+
+void
+MappedFileSystem::unmap(const std::string& path) {
+    std::lock_guard<std::mutex> guard(_mappingLock);
+    release(path);
+}
+
+void
+MappedFileSystem::forget(const std::string& path) {
+    PassthroughFileSystem::forget(path);
+    std::lock_guard<std::mutex> guard(_mappingLock);
+    std::vector<std::string> paths;
+    for (const auto& [mapped, file] : _files) {
+        if (mapped == path || (mapped.size() > path.size() && mapped.compare(0, path.size(), path) == 0 && mapped[path.size()] == '/')) {
+            paths.emplace_back(mapped);
+        }
+    }
+    for (const auto& mapped : paths) {
+        release(mapped);
+    }
+}
+
+void
+MappedFileSystem::sweep(Clock::time_point now) {
+    while (!_order.empty()) {
+        // the least recently used mapping is at the back
+        if (auto& file = _files.at(_order.back()); now - file.lastUse < _idleTimeout) {
+            break;
+        }
+        release(_order.back());
+    }
+}
+
+void
+MappedFileSystem::sweep() {
+    std::lock_guard<std::mutex> guard(_mappingLock);
+    sweep(Clock::now());
+}
+
+MappedFileSystem::MappingStatistics
+MappedFileSystem::getMappingStatistics() {
+    std::lock_guard<std::mutex> guard(_mappingLock);
+    return _stats;
+}
+
+MappedFileServer::MappedFileServer(MappedFileSystem& fs) : Parent(fs), _fs(fs) { }
+
+MappedFileSystem::MappingHandle
+MappedFileServer::mappingFor(FidEntry& entry, const ReadRequest& request) {
+    if (!entry.open || !allowsReading(entry.mode)) {
+        throw Exception("fid not open for reading");
+    } else if (entry.qid.isDirectory()) {
+        return nullptr;
+    }
+    struct stat info;
+    if (::fstat(entry.handle->getDescriptor(), &info) != 0) {
+        throw Exception(std::strerror(errno));
+    }
+    auto length = uint64_t(info.st_size);
+    auto count = request.getOffset() >= length ? 0 : size_t(std::min<uint64_t>(request.getCount(), length - request.getOffset()));
+    return _fs.map(entry.path, entry.handle->getDescriptor(), info, request.getOffset(), count);
+}
+
+bool
+MappedFileServer::readRegion(const ReadRequest& request, ReadRegion& region) {
+    auto& entry = lookup(request.getFid());
+    if (auto mapping = mappingFor(entry, request); mapping) {
+        // the mapping was made for this exact size so it covers the range
+        auto offset = std::min<uint64_t>(request.getOffset(), mapping->length());
+        region.owner = mapping;
+        region.view = mapping->getData() + offset;
+        region.offset = offset;
+        region.count = size_t(std::min<uint64_t>(request.getCount(), mapping->length() - offset));
+        return true;
+    }
+    return Parent::readRegion(request, region);
+}
+
+ReadResponse
+MappedFileServer::read(const ReadRequest& request) {
+    auto& entry = lookup(request.getFid());
+    if (auto mapping = mappingFor(entry, request); mapping) {
+        // used when the caller wants a materialized response
+        ReadResponse response;
+        auto offset = std::min<uint64_t>(request.getOffset(), mapping->length());
+        auto count = size_t(std::min<uint64_t>(request.getCount(), mapping->length() - offset));
+        auto& data = response.getData();
+        data.resize(count);
+        if (guardedCopy(data.data(), mapping->getData() + offset, count)) {
+            return response;
+        }
+        // shrunk since it was looked at, the descriptor knows what is left
+        _fs.unmap(entry.path);
+    }
+    return Parent::read(request);
+}
+
+OpenResponse
+MappedFileServer::open(const OpenRequest& request) {
+    auto response = Parent::open(request);
+    if (hasMode(request.getMode(), OpenMode::Truncate)) {
+        _fs.unmap(lookup(request.getFid()).path);
+    }
+    return response;
+}
+
+WStatResponse
+MappedFileServer::wstat(const WStatRequest& request) {
+    auto path = lookup(request.getFid()).path;
+    auto response = Parent::wstat(request);
+    if (request.getStat().getLength() != dontTouch64) {
+        _fs.unmap(path);
+    }
+    return response;
+}
+
+} // end namespace kzr
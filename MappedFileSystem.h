@@ -0,0 +1,175 @@
+/**
+ * @file
+ * Backend serving host files out of memory mappings
+ * @copyright
+ * libkzr
+ * Copyright (c) 2019, Joshua Scoggins 
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR 
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef KZR_MAPPED_FILE_SYSTEM_H__
+#define KZR_MAPPED_FILE_SYSTEM_H__
+#include <cstdint>
+#include <chrono>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include "PassthroughFileSystem.h"
+
+namespace kzr {
+
+/**
+ * A read-mostly export of a host directory where file contents are mapped
+ * into memory once and reads are answered straight out of the mapping. The
+ * access pattern of every mapping is tracked to hand the kernel sequential,
+ * willneed or random hints, and mappings are dropped once they sit idle or
+ * the address space budget runs out (least recently used first).
+ *
+ * The mappings are shared. A file which changed size since it was mapped is
+ * mapped again, and a read which runs past the end of a file shrunk by
+ * someone else meanwhile is caught (through a SIGBUS handler) and answered
+ * from the descriptor instead. Regions handed out for zero copy sends are
+ * only checked against the size of the file when they are handed out, one
+ * shrunk while the region is being sent can still fail the send.
+ */
+class MappedFileSystem : public PassthroughFileSystem {
+    public:
+        using Clock = std::chrono::steady_clock;
+        static constexpr size_t defaultAddressSpaceBudget = size_t(1) << 30;
+        /**
+         * Files smaller than this are cheaper to send with sendfile than to
+         * map
+         */
+        static constexpr size_t defaultMinimumMappedSize = 64 * 1024;
+        static constexpr size_t defaultReadAheadWindow = 2 * 1024 * 1024;
+        class Mapping {
+            public:
+                Mapping(const uint8_t* data, size_t length) : _data(data), _length(length) { }
+                ~Mapping();
+                Mapping(const Mapping&) = delete;
+                Mapping& operator=(const Mapping&) = delete;
+                constexpr auto getData() const noexcept { return _data; }
+                constexpr auto length() const noexcept { return _length; }
+            private:
+                const uint8_t* _data;
+                size_t _length;
+        };
+        using MappingHandle = std::shared_ptr<const Mapping>;
+        struct MappingStatistics {
+            uint64_t hits = 0;
+            uint64_t maps = 0;
+            uint64_t unmaps = 0;
+            uint64_t sequentialHints = 0;
+            uint64_t randomHints = 0;
+            uint64_t willNeedHints = 0;
+        };
+    public:
+        explicit MappedFileSystem(const std::string& path,
+                size_t addressSpaceBudget = defaultAddressSpaceBudget,
+                Clock::duration idleTimeout = std::chrono::seconds(30),
+                size_t descriptorCapacity = defaultDescriptorCapacity);
+        ~MappedFileSystem() override = default;
+        /**
+         * Get the mapping of the file and record a read of count bytes at
+         * offset against it.
+         * @param info the current stat of the descriptor, a mapping made of
+         * an older version of the file is replaced
+         * @return nullptr when the file can not or should not be mapped
+         */
+        MappingHandle map(const std::string& path, int fd, const struct stat& info, uint64_t offset, size_t count);
+        /**
+         * Drop the mapping of a file, readers which still hold it keep it
+         * alive until they are done.
+         */
+        void unmap(const std::string& path);
+        void forget(const std::string& path) override;
+        /**
+         * Drop every mapping which has not been used within the idle timeout
+         */
+        void sweep();
+        constexpr auto getAddressSpaceBudget() const noexcept { return _budget; }
+        auto getMappedBytes() const noexcept { return _mapped; }
+        void setMinimumMappedSize(size_t value) noexcept { _minimumMappedSize = value; }
+        constexpr auto getMinimumMappedSize() const noexcept { return _minimumMappedSize; }
+        void setReadAheadWindow(size_t value) noexcept { _readAheadWindow = value; }
+        MappingStatistics getMappingStatistics();
+    private:
+        enum class Advice {
+            Normal,
+            Sequential,
+            Random,
+        };
+        using Order = std::list<std::string>;
+        struct MappedFile {
+            MappingHandle mapping;
+            Qid qid;
+            Clock::time_point lastUse;
+            Order::iterator position;
+            Advice advice = Advice::Normal;
+            uint64_t nextOffset = 0;
+            uint64_t prefetchedTo = 0;
+            uint32_t sequentialReads = 0;
+            uint32_t randomReads = 0;
+        };
+        void observe(MappedFile& file, uint64_t offset, size_t count);
+        void release(const std::string& path);
+        void sweep(Clock::time_point now);
+    private:
+        std::mutex _mappingLock;
+        size_t _budget;
+        Clock::duration _idleTimeout;
+        size_t _minimumMappedSize = defaultMinimumMappedSize;
+        size_t _readAheadWindow = defaultReadAheadWindow;
+        size_t _mapped = 0;
+        std::unordered_map<std::string, MappedFile> _files;
+        /// most recently used at the front
+        Order _order;
+        MappingStatistics _stats;
+};
+
+/**
+ * Serves a MappedFileSystem to a single connection
+ */
+class MappedFileServer : public PassthroughFileServer {
+    public:
+        using Parent = PassthroughFileServer;
+    public:
+        explicit MappedFileServer(MappedFileSystem& fs);
+        ~MappedFileServer() override = default;
+        OpenResponse open(const OpenRequest&) override;
+        ReadResponse read(const ReadRequest&) override;
+        bool readRegion(const ReadRequest&, ReadRegion&) override;
+        WStatResponse wstat(const WStatRequest&) override;
+    private:
+        /**
+         * Look up the mapping to answer a read with
+         * @return nullptr when the read has to go through the descriptor
+         */
+        MappedFileSystem::MappingHandle mappingFor(FidEntry& entry, const ReadRequest& request);
+    private:
+        MappedFileSystem& _fs;
+};
+
+} // end namespace kzr
+
+#endif // end KZR_MAPPED_FILE_SYSTEM_H__
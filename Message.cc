@@ -104,6 +104,15 @@ Stat::decode(MessageStream& msg) {
         >> _muid;
 }
 
+bool
+Stat::changesNothing() const noexcept {
+    const auto& qid = getQid();
+    return _type == uint16_t(~0) && _dev == uint32_t(~0) &&
+        qid.getType() == uint8_t(~0) && qid.getVersion() == uint32_t(~0) && qid.getPath() == uint64_t(~0) &&
+        _mode == uint32_t(~0) && _atime == uint32_t(~0) && _mtime == uint32_t(~0) && _length == uint64_t(~0) &&
+        getName().empty() && _uid.empty() && _gid.empty() && _muid.empty();
+}
+
 void
 AuthenticationRequest::encode(MessageStream& msg) const {
     Parent::encode(msg);
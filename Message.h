@@ -42,6 +42,19 @@
 
 namespace kzr {
 
+/**
+ * The bits which make up the type field of a Qid
+ */
+enum class QidType : uint8_t {
+    File = 0x00,
+    Temporary = 0x04,
+    Authentication = 0x08,
+    Mount = 0x10,
+    Exclusive = 0x20,
+    AppendOnly = 0x40,
+    Directory = 0x80,
+};
+
 /**
  * A unique identification for the given file being accessed by the server
  */
@@ -67,6 +80,8 @@ class Qid  {
          * server.
          */
         constexpr auto getPath() const noexcept { return _path; }
+        constexpr bool hasType(QidType t) const noexcept { return (_type & uint8_t(t)) != 0; }
+        constexpr bool isDirectory() const noexcept { return hasType(QidType::Directory); }
         void encode(MessageStream&) const;
         void decode(MessageStream&);
     private:
@@ -118,6 +133,11 @@ class Stat : public HasQid, public HasName {
         X(LastModificationTime, _mtime, uint32_t);
         X(Length, _length, uint64_t);
 #undef X
+        /**
+         * A wstat which leaves every field alone asks for the file to be
+         * committed to stable storage
+         */
+        bool changesNothing() const noexcept;
     private:
         uint16_t _type;
         uint32_t _dev;
@@ -263,11 +283,11 @@ class VersionMessage : public Message<ConceptualOperation::Version, dir> {
          * Get the total size of a message
          */
         constexpr auto getMsize() const noexcept { return _msize; }
-        void setMsize(uint16_t msize) noexcept { _msize = msize; }
+        void setMsize(uint32_t msize) noexcept { _msize = msize; }
         void setVersion(const std::string& value) { _version = value; }
     private:
         std::string _version;
-        uint16_t _msize;
+        uint32_t _msize;
     };
 using VersionRequest = VersionMessage<MessageDirection::Request>;
 using VersionResponse = VersionMessage<MessageDirection::Response>;
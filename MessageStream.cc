@@ -70,7 +70,10 @@ MessageStream::encode(uint32_t value) {
 
 void
 MessageStream::decode(uint64_t& out) {
-    out = build(decode<uint32_t>(), decode<uint32_t>());
+    // argument evaluation order is unspecified so pull the halves out first
+    auto lower = decode<uint32_t>();
+    auto upper = decode<uint32_t>();
+    out = build(lower, upper);
 }
 
 void
@@ -82,7 +85,7 @@ MessageStream::encode(uint64_t value) {
 void
 MessageStream::decode(std::string& data) {
     auto len = decode<uint16_t>();
-    data.reserve(len);
+    data.resize(len);
     _storage.read(data.data(), len);
 }
 void
@@ -0,0 +1,155 @@
+/**
+ * @file
+ * Client side cache of file contents implementation
+ * @copyright
+ * libkzr
+ * Copyright (c) 2019, Joshua Scoggins 
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR 
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "PageCache.h"
+#include <algorithm>
+
+namespace kzr {
+
+namespace {
+// checked before the number of slots is worked out from it
+size_t
+validPageSize(size_t pageSize) {
+    if (pageSize == 0) {
+        throw Exception("Page size must be greater than zero!");
+    }
+    return pageSize;
+}
+} // end namespace
+
+PageCache::PageCache(size_t pageSize, size_t capacity) : _pageSize(validPageSize(pageSize)), _slots(std::max<size_t>(1, capacity / _pageSize)) { }
+
+const std::vector<uint8_t>*
+PageCache::find(uint64_t path, uint32_t version, uint64_t page) {
+    if (auto file = _files.find(path); file == _files.end()) {
+        ++_stats.misses;
+        return nullptr;
+    } else if (file->second.version != version) {
+        invalidate(path);
+        ++_stats.misses;
+        return nullptr;
+    } else if (auto it = _index.find(Key { path, page }); it == _index.end()) {
+        ++_stats.misses;
+        return nullptr;
+    } else {
+        ++_stats.hits;
+        auto& slot = _slots[it->second];
+        slot.referenced = true;
+        return &slot.data;
+    }
+}
+
+void
+PageCache::insert(uint64_t path, uint32_t version, uint64_t page, std::vector<uint8_t>&& data) {
+    observe(path, version);
+    Key key { path, page };
+    if (auto it = _index.find(key); it != _index.end()) {
+        auto& slot = _slots[it->second];
+        slot.data = std::move(data);
+        slot.referenced = true;
+        return;
+    }
+    auto index = claimSlot();
+    auto& slot = _slots[index];
+    slot.key = key;
+    slot.data = std::move(data);
+    slot.used = true;
+    // a newly inserted page has to survive one sweep of the hand
+    slot.referenced = true;
+    _index.emplace(key, index);
+    auto& file = _files[path];
+    file.version = version;
+    file.slots.emplace(index);
+}
+
+size_t
+PageCache::claimSlot() {
+    while (true) {
+        auto index = _hand;
+        _hand = (_hand + 1) % _slots.size();
+        auto& slot = _slots[index];
+        if (!slot.used) {
+            return index;
+        } else if (slot.referenced) {
+            slot.referenced = false;
+        } else {
+            ++_stats.evictions;
+            release(index);
+            return index;
+        }
+    }
+}
+
+void
+PageCache::release(size_t index) {
+    auto& slot = _slots[index];
+    if (!slot.used) {
+        return;
+    }
+    _index.erase(slot.key);
+    if (auto file = _files.find(slot.key.path); file != _files.end()) {
+        file->second.slots.erase(index);
+        if (file->second.slots.empty()) {
+            _files.erase(file);
+        }
+    }
+    slot.used = false;
+    slot.referenced = false;
+    // give the memory back, the capacity is a promise about resident data
+    std::vector<uint8_t>().swap(slot.data);
+}
+
+void
+PageCache::observe(uint64_t path, uint32_t version) {
+    if (auto file = _files.find(path); file != _files.end() && file->second.version != version) {
+        invalidate(path);
+    }
+}
+
+void
+PageCache::invalidate(uint64_t path) {
+    if (auto file = _files.find(path); file != _files.end()) {
+        ++_stats.invalidations;
+        // release modifies the set so work from a copy
+        std::vector<size_t> slots(file->second.slots.begin(), file->second.slots.end());
+        for (auto index : slots) {
+            release(index);
+        }
+        _files.erase(path);
+    }
+}
+
+void
+PageCache::clear() {
+    for (size_t i = 0; i < _slots.size(); ++i) {
+        release(i);
+    }
+    _files.clear();
+}
+
+} // end namespace kzr
@@ -0,0 +1,108 @@
+/**
+ * @file
+ * Client side cache of file contents
+ * @copyright
+ * libkzr
+ * Copyright (c) 2019, Joshua Scoggins 
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR 
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef KZR_PAGE_CACHE_H__
+#define KZR_PAGE_CACHE_H__
+#include <cstdint>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+#include "Message.h"
+
+namespace kzr {
+
+/**
+ * A fixed size block cache of file contents keyed by the qid path of the file
+ * and the page index within it. Every page is tagged with the qid version it
+ * was read under; observing a different version for a file drops all of its
+ * pages. Eviction uses the CLOCK algorithm so a hit only has to set a bit.
+ */
+class PageCache {
+    public:
+        static constexpr size_t defaultPageSize = 4096;
+        static constexpr size_t defaultCapacity = 16 * 1024 * 1024;
+        struct Statistics {
+            uint64_t hits = 0;
+            uint64_t misses = 0;
+            uint64_t evictions = 0;
+            uint64_t invalidations = 0;
+        };
+    public:
+        explicit PageCache(size_t pageSize = defaultPageSize, size_t capacity = defaultCapacity);
+        constexpr auto getPageSize() const noexcept { return _pageSize; }
+        /**
+         * The maximum number of bytes of file data held by the cache
+         */
+        auto getCapacity() const noexcept { return _slots.size() * _pageSize; }
+        /**
+         * Lookup a page of the given file. A page shorter than the page size
+         * marks the end of the file.
+         * @return the contents of the page or nullptr on a miss
+         */
+        const std::vector<uint8_t>* find(uint64_t path, uint32_t version, uint64_t page);
+        void insert(uint64_t path, uint32_t version, uint64_t page, std::vector<uint8_t>&& data);
+        /**
+         * Note the current version of a file (from an Ropen or Rstat), any
+         * pages held under another version are dropped.
+         */
+        void observe(uint64_t path, uint32_t version);
+        void invalidate(uint64_t path);
+        void clear();
+        const Statistics& getStatistics() const noexcept { return _stats; }
+    private:
+        struct Key {
+            uint64_t path;
+            uint64_t page;
+            bool operator==(const Key& other) const noexcept { return path == other.path && page == other.page; }
+        };
+        struct KeyHash {
+            size_t operator()(const Key& k) const noexcept { return std::hash<uint64_t>()(k.path * 0x9E3779B97F4A7C15ull ^ k.page); }
+        };
+        struct Slot {
+            Key key;
+            std::vector<uint8_t> data;
+            bool used = false;
+            bool referenced = false;
+        };
+        struct FileEntry {
+            uint32_t version;
+            std::unordered_set<size_t> slots;
+        };
+        size_t claimSlot();
+        void release(size_t slot);
+    private:
+        size_t _pageSize;
+        std::vector<Slot> _slots;
+        size_t _hand = 0;
+        std::unordered_map<Key, size_t, KeyHash> _index;
+        std::unordered_map<uint64_t, FileEntry> _files;
+        Statistics _stats;
+};
+
+} // end namespace kzr
+
+#endif // end KZR_PAGE_CACHE_H__
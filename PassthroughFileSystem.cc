@@ -0,0 +1,843 @@
+/**
+ * @file
+ * Backend exporting a directory of the host implementation
+ * @copyright
+ * libkzr
+ * Copyright (c) 2019, Joshua Scoggins 
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR 
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "PassthroughFileSystem.h"
+#include "AccessPermissions.h"
+#include "Exception.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <grp.h>
+#include <pwd.h>
+#include <unistd.h>
+#include <vector>
+
+namespace kzr {
+
+namespace {
+constexpr uint32_t dontTouch32 = ~uint32_t(0);
+constexpr uint64_t dontTouch64 = ~uint64_t(0);
+
+[[noreturn]] void
+hostError() {
+    throw Exception(std::strerror(errno));
+}
+
+int
+openFlagsFor(uint8_t mode) noexcept {
+    switch (getAccessMode(mode)) {
+        case OpenMode::Write:
+            return O_WRONLY;
+        case OpenMode::ReadWrite:
+            return O_RDWR;
+        default:
+            return O_RDONLY;
+    }
+}
+
+} // end namespace
+
+HostDescriptor::~HostDescriptor() {
+    if (_fd >= 0) {
+        ::close(_fd);
+    }
+}
+
+PassthroughFileSystem::PassthroughFileSystem(const std::string& path, size_t descriptorCapacity) : _capacity(descriptorCapacity) {
+    if (auto fd = ::open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC); fd < 0) {
+        throw Exception("could not open ", path, ": ", std::strerror(errno));
+    } else {
+        _root = std::make_shared<HostDescriptor>(fd);
+    }
+    struct stat info;
+    if (::fstat(_root->getDescriptor(), &info) != 0) {
+        hostError();
+    }
+    _rootDevice = info.st_dev;
+}
+
+std::pair<std::string, std::string>
+PassthroughFileSystem::split(const std::string& path) {
+    if (auto slash = path.rfind('/'); slash == std::string::npos) {
+        return { "", path };
+    } else {
+        return { path.substr(0, slash), path.substr(slash + 1) };
+    }
+}
+
+std::string
+PassthroughFileSystem::join(const std::string& directory, const std::string& name) {
+    return directory.empty() ? name : directory + "/" + name;
+}
+
+std::string
+PassthroughFileSystem::makeKey(const std::string& path, int flags) {
+    // 9p names cannot contain a NUL so it makes a safe separator
+    return path + '\0' + std::to_string(flags);
+}
+
+PassthroughFileSystem::Handle
+PassthroughFileSystem::acquire(const std::string& path, int flags) {
+    if (path.empty() && (flags & O_DIRECTORY)) {
+        return _root;
+    }
+    auto key = makeKey(path, flags);
+    {
+        std::lock_guard<std::mutex> guard(_lock);
+        if (auto it = _descriptors.find(key); it != _descriptors.end()) {
+            ++_stats.hits;
+            _order.splice(_order.begin(), _order, it->second.position);
+            return it->second.handle;
+        }
+        ++_stats.misses;
+    }
+    // open relative to the containing directory, which is itself cached
+    int fd;
+    if (path.empty()) {
+        fd = ::openat(_root->getDescriptor(), ".", flags | O_CLOEXEC);
+    } else {
+        auto [parent, name] = split(path);
+        auto directory = acquire(parent, O_RDONLY | O_DIRECTORY);
+        fd = ::openat(directory->getDescriptor(), name.c_str(), flags | O_NOFOLLOW | O_CLOEXEC);
+    }
+    if (fd < 0) {
+        hostError();
+    }
+    auto handle = std::make_shared<HostDescriptor>(fd);
+    if (_capacity == 0) {
+        return handle;
+    }
+    std::lock_guard<std::mutex> guard(_lock);
+    if (auto it = _descriptors.find(key); it != _descriptors.end()) {
+        // someone else opened it while we were
+        return it->second.handle;
+    }
+    while (_descriptors.size() >= _capacity) {
+        // the descriptor stays open for as long as a fid still holds it
+        _descriptors.erase(_order.back());
+        _order.pop_back();
+        ++_stats.evictions;
+    }
+    _order.emplace_front(key);
+    _descriptors.emplace(key, CacheEntry { handle, _order.begin() });
+    return handle;
+}
+
+void
+PassthroughFileSystem::forget(const std::string& path) {
+    std::lock_guard<std::mutex> guard(_lock);
+    for (auto it = _order.begin(); it != _order.end();) {
+        auto entryPath = it->substr(0, it->find('\0'));
+        if (entryPath == path || (entryPath.size() > path.size() && entryPath.compare(0, path.size(), path) == 0 && entryPath[path.size()] == '/')) {
+            _descriptors.erase(*it);
+            it = _order.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+bool
+PassthroughFileSystem::lookup(const std::string& path, struct stat& info) {
+    int result;
+    if (path.empty()) {
+        result = ::fstat(_root->getDescriptor(), &info);
+    } else {
+        auto [parent, name] = split(path);
+        auto directory = acquire(parent, O_RDONLY | O_DIRECTORY);
+        result = ::fstatat(directory->getDescriptor(), name.c_str(), &info, AT_SYMLINK_NOFOLLOW);
+    }
+    if (result != 0) {
+        if (errno == ENOENT || errno == ENOTDIR) {
+            return false;
+        }
+        hostError();
+    }
+    return true;
+}
+
+Qid
+PassthroughFileSystem::makeQid(const struct stat& info) const noexcept {
+    Qid qid;
+    qid.setType(S_ISDIR(info.st_mode) ? uint8_t(QidType::Directory) : uint8_t(QidType::File));
+    // inode numbers are only unique per device, keep files of other mounts
+    // from colliding with the exported one
+    qid.setPath(uint64_t(info.st_ino) ^ (uint64_t(info.st_dev - _rootDevice) << 48));
+    // the size is mixed in since writes can land within the granularity of
+    // the modification time
+    qid.setVersion(uint32_t(info.st_mtim.tv_sec) ^ uint32_t(info.st_mtim.tv_nsec) ^ uint32_t(uint64_t(info.st_size) * 2654435761u));
+    return qid;
+}
+
+std::string
+PassthroughFileSystem::userName(uid_t uid) {
+    std::lock_guard<std::mutex> guard(_lock);
+    if (auto it = _users.find(uid); it != _users.end()) {
+        return it->second;
+    }
+    std::vector<char> buffer(4096);
+    struct passwd entry;
+    struct passwd* result = nullptr;
+    std::string name;
+    if (::getpwuid_r(uid, &entry, buffer.data(), buffer.size(), &result) == 0 && result) {
+        name = result->pw_name;
+    } else {
+        name = std::to_string(uid);
+    }
+    _users.emplace(uid, name);
+    return name;
+}
+
+std::string
+PassthroughFileSystem::groupName(gid_t gid) {
+    std::lock_guard<std::mutex> guard(_lock);
+    if (auto it = _groups.find(gid); it != _groups.end()) {
+        return it->second;
+    }
+    std::vector<char> buffer(4096);
+    struct group entry;
+    struct group* result = nullptr;
+    std::string name;
+    if (::getgrgid_r(gid, &entry, buffer.data(), buffer.size(), &result) == 0 && result) {
+        name = result->gr_name;
+    } else {
+        name = std::to_string(gid);
+    }
+    _groups.emplace(gid, name);
+    return name;
+}
+
+gid_t
+PassthroughFileSystem::groupId(const std::string& name) {
+    std::vector<char> buffer(4096);
+    struct group entry;
+    struct group* result = nullptr;
+    if (::getgrnam_r(name.c_str(), &entry, buffer.data(), buffer.size(), &result) == 0 && result) {
+        return result->gr_gid;
+    }
+    throw Exception("unknown group ", name);
+}
+
+Stat
+PassthroughFileSystem::makeStat(const std::string& name, const struct stat& info) {
+    Stat s;
+    s.setType(0);
+    s.setDevice(0);
+    s.setQid(makeQid(info));
+    uint32_t mode = info.st_mode & uint32_t(FileMode::PermissionMask);
+    if (S_ISDIR(info.st_mode)) {
+        mode |= uint32_t(FileMode::Directory);
+    }
+    s.setPermissions(mode);
+    s.setLastAccessTime(uint32_t(info.st_atime));
+    s.setLastModificationTime(uint32_t(info.st_mtime));
+    s.setLength(S_ISDIR(info.st_mode) ? 0 : uint64_t(info.st_size));
+    s.setName(name.empty() ? "/" : name);
+    s.setOwner(userName(info.st_uid));
+    s.setGroup(groupName(info.st_gid));
+    s.setUserThatLastModified(userName(info.st_uid));
+    return s;
+}
+
+PassthroughFileSystem::Statistics
+PassthroughFileSystem::getStatistics() {
+    std::lock_guard<std::mutex> guard(_lock);
+    return _stats;
+}
+
+PassthroughFileServer::PassthroughFileServer(PassthroughFileSystem& fs) : _fs(fs) { }
+
+PassthroughFileServer::FidEntry&
+PassthroughFileServer::lookup(uint32_t fid) {
+    if (auto it = _fids.find(fid); it != _fids.end()) {
+        return it->second;
+    }
+    throw Exception("unknown fid ", fid);
+}
+
+struct stat
+PassthroughFileServer::statOf(const FidEntry& entry) {
+    struct stat info;
+    if (entry.handle) {
+        if (::fstat(entry.handle->getDescriptor(), &info) != 0) {
+            hostError();
+        }
+    } else if (!_fs.lookup(entry.path, info)) {
+        throw Exception("file does not exist");
+    }
+    return info;
+}
+
+void
+PassthroughFileServer::reset() {
+    _fids.clear();
+}
+
+AttachResponse
+PassthroughFileServer::attach(const AttachRequest& request) {
+    if (request.getAuthenticationHandle() != nofid) {
+        throw Exception("authentication not required");
+    } else if (request.getFid() == nofid || _fids.count(request.getFid()) != 0) {
+        throw Exception("fid in use");
+    }
+    FidEntry entry;
+    entry.qid = _fs.makeQid(statOf(entry));
+    AttachResponse response;
+    response.setQid(entry.qid);
+    _fids.emplace(request.getFid(), std::move(entry));
+    return response;
+}
+
+WalkResponse
+PassthroughFileServer::walk(const WalkRequest& request) {
+    auto& source = lookup(request.getFid());
+    if (source.open) {
+        throw Exception("cannot walk an open fid");
+    } else if (request.getNewFid() != request.getFid() && (request.getNewFid() == nofid || _fids.count(request.getNewFid()) != 0)) {
+        throw Exception("fid in use");
+    }
+    WalkResponse response;
+    auto path = source.path;
+    auto qid = source.qid;
+    for (const auto& name : request.getWname()) {
+        std::string next;
+        if (!qid.isDirectory()) {
+            if (response.getWqid().empty()) {
+                throw Exception("not a directory");
+            }
+            break;
+        } else if (name == "..") {
+            // the export is the root, there is no going above it
+            next = PassthroughFileSystem::split(path).first;
+        } else if (name == ".") {
+            next = path;
+        } else if (name.empty() || name.find('/') != std::string::npos) {
+            if (response.getWqid().empty()) {
+                throw Exception("illegal name");
+            }
+            break;
+        } else {
+            next = PassthroughFileSystem::join(path, name);
+        }
+        struct stat info;
+        if (!_fs.lookup(next, info)) {
+            if (response.getWqid().empty()) {
+                throw Exception("file does not exist");
+            }
+            break;
+        }
+        path = next;
+        qid = _fs.makeQid(info);
+        response.getWqid().emplace_back(qid);
+    }
+    // a partial walk leaves newfid unbound
+    if (response.getWqid().size() == request.getWname().size()) {
+        FidEntry entry;
+        entry.path = path;
+        entry.qid = qid;
+        _fids[request.getNewFid()] = std::move(entry);
+    }
+    return response;
+}
+
+OpenResponse
+PassthroughFileServer::open(const OpenRequest& request) {
+    auto& entry = lookup(request.getFid());
+    if (entry.open) {
+        throw Exception("fid already open");
+    }
+    auto mode = request.getMode();
+    auto flags = openFlagsFor(mode);
+    if (entry.qid.isDirectory()) {
+        if (flags != O_RDONLY || hasMode(mode, OpenMode::Truncate)) {
+            throw Exception("is a directory");
+        }
+        flags |= O_DIRECTORY;
+    }
+    entry.handle = _fs.acquire(entry.path, flags);
+    if (hasMode(mode, OpenMode::Truncate)) {
+        // the descriptor may be shared so truncate it instead of opening
+        // with O_TRUNC
+        auto writable = flags == O_RDONLY ? _fs.acquire(entry.path, O_WRONLY) : entry.handle;
+        if (::ftruncate(writable->getDescriptor(), 0) != 0) {
+            entry.handle.reset();
+            hostError();
+        }
+    }
+    entry.open = true;
+    entry.mode = mode;
+    entry.qid = _fs.makeQid(statOf(entry));
+    OpenResponse response;
+    response.setQid(entry.qid);
+    response.setIounit(0);
+    return response;
+}
+
+CreateResponse
+PassthroughFileServer::create(const CreateRequest& request) {
+    auto& entry = lookup(request.getFid());
+    if (entry.open) {
+        throw Exception("fid already open");
+    } else if (!entry.qid.isDirectory()) {
+        throw Exception("not a directory");
+    }
+    const auto& name = request.getName();
+    if (name.empty() || name == "." || name == ".." || name.find('/') != std::string::npos) {
+        throw Exception("illegal name");
+    }
+    auto perm = request.getPermissions();
+    auto mode = request.getMode();
+    auto directory = _fs.directory(entry.path);
+    auto path = PassthroughFileSystem::join(entry.path, name);
+    PassthroughFileSystem::Handle handle;
+    if (hasMode(perm, FileMode::Directory)) {
+        if (openFlagsFor(mode) != O_RDONLY || hasMode(mode, OpenMode::Truncate)) {
+            throw Exception("is a directory");
+        } else if (::mkdirat(directory->getDescriptor(), name.c_str(), perm & uint32_t(FileMode::PermissionMask)) != 0) {
+            hostError();
+        }
+        handle = _fs.acquire(path, O_RDONLY | O_DIRECTORY);
+    } else {
+        auto fd = ::openat(directory->getDescriptor(), name.c_str(), openFlagsFor(mode) | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, perm & uint32_t(FileMode::PermissionMask));
+        if (fd < 0) {
+            hostError();
+        }
+        // this descriptor is private to the fid, the cache hands out its own
+        handle = std::make_shared<HostDescriptor>(fd);
+    }
+    entry.path = path;
+    entry.handle = handle;
+    entry.open = true;
+    entry.mode = mode;
+    entry.qid = _fs.makeQid(statOf(entry));
+    CreateResponse response;
+    response.setQid(entry.qid);
+    response.setIounit(0);
+    return response;
+}
+
+void
+PassthroughFileServer::readDirectory(FidEntry& entry, const ReadRequest& request, std::vector<uint8_t>& output) {
+    if (request.getOffset() == 0) {
+        if (entry.directory) {
+            ::rewinddir(entry.directory.get());
+        } else {
+            // the stream needs its own file position so it cannot share the
+            // cached descriptor
+            auto fd = ::openat(entry.handle->getDescriptor(), ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            if (fd < 0) {
+                hostError();
+            } else if (auto dir = ::fdopendir(fd); !dir) {
+                ::close(fd);
+                hostError();
+            } else {
+                entry.directory.reset(dir);
+            }
+        }
+        entry.pending.clear();
+        entry.directoryOffset = 0;
+    } else if (request.getOffset() != entry.directoryOffset || !entry.directory) {
+        throw Exception("bad directory offset");
+    }
+    auto dir = entry.directory.get();
+    while (true) {
+        if (entry.pending.empty()) {
+            errno = 0;
+            auto ent = ::readdir(dir);
+            if (!ent) {
+                if (errno != 0) {
+                    hostError();
+                }
+                break;
+            } else if (std::strcmp(ent->d_name, ".") == 0 || std::strcmp(ent->d_name, "..") == 0) {
+                continue;
+            }
+            struct stat info;
+            if (::fstatat(::dirfd(dir), ent->d_name, &info, AT_SYMLINK_NOFOLLOW) != 0) {
+                // removed since the directory was read
+                continue;
+            }
+            MessageStream msg;
+            msg << _fs.makeStat(ent->d_name, info);
+            entry.pending = msg.str();
+        }
+        // only whole entries are ever returned
+        if (output.size() + entry.pending.size() > request.getCount()) {
+            if (output.empty()) {
+                throw Exception("read count too small for directory entry");
+            }
+            break;
+        }
+        output.insert(output.end(), entry.pending.begin(), entry.pending.end());
+        entry.pending.clear();
+    }
+    entry.directoryOffset += output.size();
+}
+
+ReadResponse
+PassthroughFileServer::read(const ReadRequest& request) {
+    auto& entry = lookup(request.getFid());
+    if (!entry.open || !allowsReading(entry.mode)) {
+        throw Exception("fid not open for reading");
+    }
+    ReadResponse response;
+    auto& output = response.getData();
+    if (entry.qid.isDirectory()) {
+        readDirectory(entry, request, output);
+    } else {
+        output.resize(request.getCount());
+        auto count = ::pread(entry.handle->getDescriptor(), output.data(), output.size(), off_t(request.getOffset()));
+        if (count < 0) {
+            hostError();
+        }
+        output.resize(size_t(count));
+    }
+    return response;
+}
+
+bool
+PassthroughFileServer::submit(Request& request, Responder responder) {
+    if (!_pool) {
+        return false;
+    }
+    // the checks happen here, on the thread which owns the fid table, only
+    // the system call itself is handed off
+    if (auto read = std::get_if<ReadRequest>(&request); read) {
+        auto& entry = lookup(read->getFid());
+        if (!entry.open || !allowsReading(entry.mode)) {
+            throw Exception("fid not open for reading");
+        } else if (entry.qid.isDirectory()) {
+            return false;
+        }
+        auto handle = entry.handle;
+        _pool->read(handle->getDescriptor(), read->getOffset(), read->getCount(), [handle, responder](IoPool::Result&& result) {
+            if (result.count < 0) {
+                ErrorResponse error;
+                error.setErrorName(std::strerror(result.error));
+                responder(error);
+            } else {
+                ReadResponse response;
+                response.getData() = std::move(result.data);
+                responder(response);
+            }
+        });
+        return true;
+    } else if (auto write = std::get_if<WriteRequest>(&request); write) {
+        auto& entry = lookup(write->getFid());
+        if (!entry.open || !allowsWriting(entry.mode)) {
+            throw Exception("fid not open for writing");
+        }
+        auto handle = entry.handle;
+        _pool->write(handle->getDescriptor(), write->getOffset(), std::move(write->getData()), [handle, responder](IoPool::Result&& result) {
+            if (result.count < 0) {
+                ErrorResponse error;
+                error.setErrorName(std::strerror(result.error));
+                responder(error);
+            } else {
+                WriteResponse response;
+                response.setCount(uint32_t(result.count));
+                responder(response);
+            }
+        });
+        return true;
+    } else if (auto wstat = std::get_if<WStatRequest>(&request); wstat && _scheduler && wstat->getStat().changesNothing()) {
+        scheduleSync(lookup(wstat->getFid()), WStatResponse(), responder);
+        return true;
+    } else if (auto clunk = std::get_if<ClunkRequest>(&request); clunk && _scheduler && _syncOnClunk) {
+        auto& entry = lookup(clunk->getFid());
+        if (!entry.open || !allowsWriting(entry.mode) || hasMode(entry.mode, OpenMode::RemoveOnClose)) {
+            return false;
+        }
+        // the fid goes away now, the handle keeps the file open for the sync
+        auto held = std::move(entry);
+        _fids.erase(clunk->getFid());
+        scheduleSync(held, ClunkResponse(), responder);
+        return true;
+    }
+    return false;
+}
+
+void
+PassthroughFileServer::scheduleSync(FidEntry& entry, Response&& response, Responder responder) {
+    auto handle = entry.handle ? entry.handle : _fs.acquire(entry.path, entry.qid.isDirectory() ? O_RDONLY | O_DIRECTORY : O_RDONLY);
+    _scheduler->request(entry.qid.getPath(), handle->getDescriptor(), handle, [response = std::move(response), responder](int error) {
+        if (error != 0) {
+            ErrorResponse failure;
+            failure.setErrorName(std::strerror(error));
+            responder(failure);
+        } else {
+            responder(response);
+        }
+    });
+}
+
+void
+PassthroughFileServer::syncNow(FidEntry& entry) {
+    auto handle = entry.handle ? entry.handle : _fs.acquire(entry.path, entry.qid.isDirectory() ? O_RDONLY | O_DIRECTORY : O_RDONLY);
+    if (::fsync(handle->getDescriptor()) != 0) {
+        hostError();
+    }
+}
+
+bool
+PassthroughFileServer::readRegion(const ReadRequest& request, ReadRegion& region) {
+    auto& entry = lookup(request.getFid());
+    if (!entry.open || !allowsReading(entry.mode)) {
+        throw Exception("fid not open for reading");
+    } else if (entry.qid.isDirectory()) {
+        // directory entries are synthesized, there is nothing to send from
+        return false;
+    }
+    // the size goes out before the data so it has to be exact
+    struct stat info;
+    if (::fstat(entry.handle->getDescriptor(), &info) != 0) {
+        hostError();
+    } else if (!S_ISREG(info.st_mode)) {
+        return false;
+    }
+    auto length = uint64_t(info.st_size);
+    region.owner = entry.handle;
+    region.descriptor = entry.handle->getDescriptor();
+    region.offset = request.getOffset();
+    region.count = request.getOffset() >= length ? 0 : size_t(std::min<uint64_t>(request.getCount(), length - request.getOffset()));
+    return true;
+}
+
+bool
+PassthroughFileServer::identify(uint32_t fid, Qid& qid) {
+    auto it = _fids.find(fid);
+    if (it == _fids.end()) {
+        return false;
+    } else if (auto& entry = it->second; !entry.open || !allowsReading(entry.mode) || entry.qid.isDirectory() || !entry.handle) {
+        return false;
+    }
+    // the qid stored with the fid is from when it was opened, the version
+    // has to reflect what the file holds now
+    struct stat info;
+    if (::fstat(it->second.handle->getDescriptor(), &info) != 0 || !S_ISREG(info.st_mode)) {
+        return false;
+    }
+    qid = _fs.makeQid(info);
+    return true;
+}
+
+WriteResponse
+PassthroughFileServer::write(const WriteRequest& request) {
+    auto& entry = lookup(request.getFid());
+    if (!entry.open || !allowsWriting(entry.mode)) {
+        throw Exception("fid not open for writing");
+    }
+    const auto& data = request.getData();
+    auto count = ::pwrite(entry.handle->getDescriptor(), data.data(), data.size(), off_t(request.getOffset()));
+    if (count < 0) {
+        hostError();
+    }
+    WriteResponse response;
+    response.setCount(uint32_t(count));
+    return response;
+}
+
+void
+PassthroughFileServer::removePath(const std::string& path) {
+    if (path.empty()) {
+        throw Exception("cannot remove root");
+    }
+    struct stat info;
+    if (!_fs.lookup(path, info)) {
+        throw Exception("file does not exist");
+    }
+    auto [parent, name] = PassthroughFileSystem::split(path);
+    auto directory = _fs.directory(parent);
+    if (::unlinkat(directory->getDescriptor(), name.c_str(), S_ISDIR(info.st_mode) ? AT_REMOVEDIR : 0) != 0) {
+        hostError();
+    }
+    _fs.forget(path);
+}
+
+ClunkResponse
+PassthroughFileServer::clunk(const ClunkRequest& request) {
+    auto entry = std::move(lookup(request.getFid()));
+    _fids.erase(request.getFid());
+    if (_syncOnClunk && entry.open && allowsWriting(entry.mode) && !hasMode(entry.mode, OpenMode::RemoveOnClose)) {
+        syncNow(entry);
+    }
+    if (entry.open && hasMode(entry.mode, OpenMode::RemoveOnClose)) {
+        try {
+            removePath(entry.path);
+        } catch (Exception&) {
+            // the clunk itself always succeeds
+        }
+    }
+    return ClunkResponse();
+}
+
+RemoveResponse
+PassthroughFileServer::remove(const RemoveRequest& request) {
+    // the fid is clunked even when the remove fails
+    auto entry = std::move(lookup(request.getFid()));
+    _fids.erase(request.getFid());
+    entry.handle.reset();
+    removePath(entry.path);
+    return RemoveResponse();
+}
+
+StatResponse
+PassthroughFileServer::stat(const StatRequest& request) {
+    auto& entry = lookup(request.getFid());
+    auto info = statOf(entry);
+    entry.qid = _fs.makeQid(info);
+    MessageStream msg;
+    msg << _fs.makeStat(PassthroughFileSystem::split(entry.path).second, info);
+    StatResponse response;
+    response.setData(msg.str());
+    return response;
+}
+
+namespace {
+/**
+ * fchmodat can't be told not to follow a link, so go through a descriptor
+ * of the file itself instead. The name was checked not to be a link but it
+ * may have been replaced by one since, O_NOFOLLOW catches that.
+ */
+void
+chmodAt(int directory, const std::string& name, uint32_t perm) {
+    auto fd = ::openat(directory, name.c_str(), O_PATH | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) {
+        hostError();
+    }
+    struct stat info;
+    if (::fstat(fd, &info) != 0 || S_ISLNK(info.st_mode)) {
+        ::close(fd);
+        throw Exception("cannot change the mode of a symbolic link");
+    }
+    // an O_PATH descriptor can't be given to fchmod, its proc entry can be
+    // given to chmod
+    auto path = "/proc/self/fd/" + std::to_string(fd);
+    auto result = ::chmod(path.c_str(), perm);
+    auto error = errno;
+    ::close(fd);
+    if (result != 0) {
+        errno = error;
+        hostError();
+    }
+}
+} // end namespace
+
+WStatResponse
+PassthroughFileServer::wstat(const WStatRequest& request) {
+    auto& entry = lookup(request.getFid());
+    const auto& changes = request.getStat();
+    if (changes.changesNothing()) {
+        syncNow(entry);
+        return WStatResponse();
+    }
+    auto info = statOf(entry);
+    auto [parent, name] = PassthroughFileSystem::split(entry.path);
+    // check what can be checked up front so a wstat rarely applies partially
+    bool rename = !changes.getName().empty() && changes.getName() != name;
+    if (rename) {
+        struct stat existing;
+        if (entry.path.empty()) {
+            throw Exception("cannot rename root");
+        } else if (changes.getName() == "." || changes.getName() == ".." || changes.getName().find('/') != std::string::npos) {
+            throw Exception("illegal name");
+        } else if (_fs.lookup(PassthroughFileSystem::join(parent, changes.getName()), existing)) {
+            throw Exception("file already exists");
+        }
+    }
+    if (changes.getLength() != dontTouch64 && S_ISDIR(info.st_mode) && changes.getLength() != 0) {
+        throw Exception("cannot change the length of a directory");
+    }
+    if (changes.getPermissions() != dontTouch32 && hasMode(changes.getPermissions(), FileMode::Directory) != S_ISDIR(info.st_mode)) {
+        throw Exception("cannot change the directory bit");
+    }
+    if (changes.getPermissions() != dontTouch32 && S_ISLNK(info.st_mode)) {
+        // chmod always follows the link, which may well lead out of the tree
+        throw Exception("cannot change the mode of a symbolic link");
+    }
+    if (!changes.getOwner().empty() && changes.getOwner() != _fs.userName(info.st_uid)) {
+        throw Exception("cannot change the owner");
+    }
+    if (changes.getLength() != dontTouch64 && !S_ISDIR(info.st_mode)) {
+        auto writable = entry.handle && allowsWriting(entry.mode) ? entry.handle : _fs.acquire(entry.path, O_WRONLY);
+        if (::ftruncate(writable->getDescriptor(), off_t(changes.getLength())) != 0) {
+            hostError();
+        }
+    }
+    // everything else works on any descriptor, or relative to the directory
+    // when the fid has not been opened
+    auto directory = _fs.directory(parent);
+    if (changes.getPermissions() != dontTouch32) {
+        auto perm = changes.getPermissions() & uint32_t(FileMode::PermissionMask);
+        if (entry.handle) {
+            if (::fchmod(entry.handle->getDescriptor(), perm) != 0) {
+                hostError();
+            }
+        } else {
+            chmodAt(directory->getDescriptor(), entry.path.empty() ? "." : name, perm);
+        }
+    }
+    if (changes.getLastModificationTime() != dontTouch32) {
+        struct timespec times[2];
+        times[0].tv_sec = 0;
+        times[0].tv_nsec = UTIME_OMIT;
+        times[1].tv_sec = time_t(changes.getLastModificationTime());
+        times[1].tv_nsec = 0;
+        auto result = entry.handle ? ::futimens(entry.handle->getDescriptor(), times) : ::utimensat(directory->getDescriptor(), entry.path.empty() ? "." : name.c_str(), times, AT_SYMLINK_NOFOLLOW);
+        if (result != 0) {
+            hostError();
+        }
+    }
+    if (!changes.getGroup().empty() && changes.getGroup() != _fs.groupName(info.st_gid)) {
+        auto gid = _fs.groupId(changes.getGroup());
+        auto result = entry.handle ? ::fchown(entry.handle->getDescriptor(), uid_t(-1), gid) : ::fchownat(directory->getDescriptor(), entry.path.empty() ? "." : name.c_str(), uid_t(-1), gid, AT_SYMLINK_NOFOLLOW);
+        if (result != 0) {
+            hostError();
+        }
+    }
+    if (rename) {
+        if (::renameat(directory->getDescriptor(), name.c_str(), directory->getDescriptor(), changes.getName().c_str()) != 0) {
+            hostError();
+        }
+        // entry is one of the fids being updated so work from a copy
+        auto original = entry.path;
+        auto renamed = PassthroughFileSystem::join(parent, changes.getName());
+        _fs.forget(original);
+        // fids below the renamed file have to follow it
+        for (auto& [fid, other] : _fids) {
+            if (other.path == original) {
+                other.path = renamed;
+            } else if (other.path.size() > original.size() && other.path.compare(0, original.size(), original) == 0 && other.path[original.size()] == '/') {
+                other.path = renamed + other.path.substr(original.size());
+            }
+        }
+    }
+    return WStatResponse();
+}
+
+} // end namespace kzr
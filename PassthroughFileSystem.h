@@ -0,0 +1,212 @@
+/**
+ * @file
+ * Backend exporting a directory of the host
+ * @copyright
+ * libkzr
+ * Copyright (c) 2019, Joshua Scoggins 
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR 
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef KZR_PASSTHROUGH_FILE_SYSTEM_H__
+#define KZR_PASSTHROUGH_FILE_SYSTEM_H__
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "Message.h"
+#include "Backend.h"
+#include "IoPool.h"
+#include "SyncScheduler.h"
+
+namespace kzr {
+
+/**
+ * An open file descriptor of the host which is closed once nothing refers
+ * to it anymore.
+ */
+class HostDescriptor {
+    public:
+        explicit HostDescriptor(int fd) : _fd(fd) { }
+        ~HostDescriptor();
+        HostDescriptor(const HostDescriptor&) = delete;
+        HostDescriptor& operator=(const HostDescriptor&) = delete;
+        constexpr auto getDescriptor() const noexcept { return _fd; }
+    private:
+        int _fd;
+};
+
+/**
+ * A directory of the host shared by every connection exporting it. Files are
+ * named by their path relative to the exported directory and are always
+ * opened relative to the descriptor of the directory containing them, never
+ * following symbolic links, so nothing outside of the export is reachable.
+ *
+ * Open descriptors are kept in a least recently used cache keyed by path and
+ * access mode so files which are used over and over are not reopened for
+ * every fid.
+ */
+class PassthroughFileSystem {
+    public:
+        using Handle = std::shared_ptr<HostDescriptor>;
+        static constexpr size_t defaultDescriptorCapacity = 256;
+        struct Statistics {
+            uint64_t hits = 0;
+            uint64_t misses = 0;
+            uint64_t evictions = 0;
+        };
+    public:
+        explicit PassthroughFileSystem(const std::string& path, size_t descriptorCapacity = defaultDescriptorCapacity);
+        virtual ~PassthroughFileSystem() = default;
+        /**
+         * Get a descriptor for the file at the given path opened with the
+         * given access mode (O_RDONLY, O_WRONLY or O_RDWR, optionally with
+         * O_DIRECTORY).
+         */
+        Handle acquire(const std::string& path, int flags);
+        Handle directory(const std::string& path) { return acquire(path, O_RDONLY | O_DIRECTORY); }
+        /**
+         * Drop every cached descriptor of the path and anything below it,
+         * must be called when the file is removed or renamed.
+         */
+        virtual void forget(const std::string& path);
+        /**
+         * Stat the file at the given path without following symbolic links.
+         * @return false if it does not exist
+         */
+        bool lookup(const std::string& path, struct stat& info);
+        Qid makeQid(const struct stat& info) const noexcept;
+        Stat makeStat(const std::string& name, const struct stat& info);
+        std::string userName(uid_t uid);
+        std::string groupName(gid_t gid);
+        gid_t groupId(const std::string& name);
+        Statistics getStatistics();
+        static std::pair<std::string, std::string> split(const std::string& path);
+        static std::string join(const std::string& directory, const std::string& name);
+    private:
+        using Order = std::list<std::string>;
+        struct CacheEntry {
+            Handle handle;
+            Order::iterator position;
+        };
+        static std::string makeKey(const std::string& path, int flags);
+    private:
+        std::mutex _lock;
+        Handle _root;
+        dev_t _rootDevice;
+        size_t _capacity;
+        std::unordered_map<std::string, CacheEntry> _descriptors;
+        /// most recently used at the front
+        Order _order;
+        std::unordered_map<uid_t, std::string> _users;
+        std::unordered_map<gid_t, std::string> _groups;
+        Statistics _stats;
+};
+
+/**
+ * Serves a PassthroughFileSystem to a single connection. Access checks are
+ * left to the host, requests are carried out with the credentials of the
+ * server process.
+ */
+class PassthroughFileServer : public Backend {
+    public:
+        explicit PassthroughFileServer(PassthroughFileSystem& fs);
+        ~PassthroughFileServer() override = default;
+        /**
+         * Carry out reads and writes of files on the pool instead of the
+         * thread handling requests, nullptr goes back to doing them inline.
+         */
+        void setIoPool(IoPool* pool) noexcept { _pool = pool; }
+        IoPool* getIoPool() const noexcept { return _pool; }
+        /**
+         * Batch the syncs asked for by wstat (and clunk, see setSyncOnClunk)
+         * through the scheduler instead of issuing one per request. Only used
+         * together with an IoPool.
+         */
+        void setSyncScheduler(SyncScheduler* scheduler) noexcept { _scheduler = scheduler; }
+        /**
+         * Make files durable when a fid which was open for writing is
+         * clunked
+         */
+        void setSyncOnClunk(bool value) noexcept { _syncOnClunk = value; }
+        bool submit(Request&, Responder) override;
+        AttachResponse attach(const AttachRequest&) override;
+        WalkResponse walk(const WalkRequest&) override;
+        OpenResponse open(const OpenRequest&) override;
+        CreateResponse create(const CreateRequest&) override;
+        ReadResponse read(const ReadRequest&) override;
+        WriteResponse write(const WriteRequest&) override;
+        bool readRegion(const ReadRequest&, ReadRegion&) override;
+        bool identify(uint32_t fid, Qid& qid) override;
+        ClunkResponse clunk(const ClunkRequest&) override;
+        RemoveResponse remove(const RemoveRequest&) override;
+        StatResponse stat(const StatRequest&) override;
+        WStatResponse wstat(const WStatRequest&) override;
+        void reset() override;
+    protected:
+        struct DirectoryCloser {
+            void operator()(DIR* dir) const noexcept { closedir(dir); }
+        };
+        struct FidEntry {
+            std::string path;
+            Qid qid;
+            bool open = false;
+            uint8_t mode = 0;
+            PassthroughFileSystem::Handle handle;
+            /**
+             * Directory reads stream entries off of their own descriptor,
+             * the record which did not fit in the last read is kept until
+             * the next one.
+             */
+            std::unique_ptr<DIR, DirectoryCloser> directory;
+            uint64_t directoryOffset = 0;
+            std::string pending;
+        };
+        FidEntry& lookup(uint32_t fid);
+        struct stat statOf(const FidEntry& entry);
+        void removePath(const std::string& path);
+        /**
+         * Commit the file to stable storage on the calling thread
+         */
+        void syncNow(FidEntry& entry);
+        /**
+         * Hand the file to the sync scheduler and answer with the given
+         * response once it is durable
+         */
+        void scheduleSync(FidEntry& entry, Response&& response, Responder responder);
+    private:
+        void readDirectory(FidEntry& entry, const ReadRequest& request, std::vector<uint8_t>& output);
+    private:
+        PassthroughFileSystem& _fs;
+        std::unordered_map<uint32_t, FidEntry> _fids;
+        IoPool* _pool = nullptr;
+        SyncScheduler* _scheduler = nullptr;
+        bool _syncOnClunk = false;
+};
+
+} // end namespace kzr
+
+#endif // end KZR_PASSTHROUGH_FILE_SYSTEM_H__
@@ -0,0 +1,605 @@
+/**
+ * @file
+ * Multiplexes many 9p sessions over a few upstream connections implementation
+ * @copyright
+ * libkzr
+ * Copyright (c) 2019, Joshua Scoggins 
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR 
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "Proxy.h"
+#include "Exception.h"
+#include <algorithm>
+#include <limits>
+
+namespace kzr {
+
+Proxy::Proxy(const std::vector<std::reference_wrapper<Connection>>& upstreams, uint32_t msize) : _msize(msize) {
+    if (upstreams.empty()) {
+        throw Exception("A proxy needs at least one upstream connection!");
+    }
+    for (auto& connection : upstreams) {
+        _upstreams.emplace_back(std::make_unique<Upstream>(connection.get()));
+        negotiate(*_upstreams.back());
+    }
+    for (size_t i = 0; i < _upstreams.size(); ++i) {
+        _upstreams[i]->reader = std::thread([this, i]() { receive(i); });
+    }
+}
+
+Proxy::~Proxy() {
+    for (auto& upstream : _upstreams) {
+        if (upstream->reader.joinable()) {
+            upstream->reader.join();
+        }
+    }
+}
+
+void
+Proxy::negotiate(Upstream& upstream) {
+    VersionRequest request;
+    request.setMsize(_msize);
+    request.setVersion(version9p2000String);
+    MessageStream outgoing;
+    outgoing << request;
+    upstream.connection << outgoing;
+    MessageStream incoming;
+    upstream.connection >> incoming;
+    Response response;
+    incoming >> response;
+    if (auto error = std::get_if<ErrorResponse>(&response); error) {
+        throw Exception("upstream refused the session: ", error->getErrorName());
+    } else if (auto version = std::get_if<VersionResponse>(&response); !version) {
+        throw Exception("upstream did not answer the version request!");
+    } else if (version->getVersion() != version9p2000String) {
+        throw Exception("upstream does not speak ", version9p2000String);
+    } else {
+        _msize = std::min(_msize, version->getMsize());
+    }
+}
+
+Proxy::Statistics
+Proxy::getStatistics() {
+    std::lock_guard<std::mutex> guard(_statsLock);
+    return _stats;
+}
+
+void
+Proxy::serve(Connection& downstream) {
+    auto session = std::make_shared<Session>(downstream);
+    {
+        std::lock_guard<std::mutex> guard(_statsLock);
+        ++_stats.sessions;
+    }
+    while (true) {
+        FrameView frame;
+        try {
+            downstream >> frame;
+        } catch (Exception&) {
+            close(session);
+            return;
+        }
+        uint16_t tag = notag;
+        try {
+            tag = frame.getTag();
+            switch (frame.getType()) {
+                case Operation::TVersion:
+                    version(session, frame);
+                    break;
+                case Operation::TFlush:
+                    flush(session, frame);
+                    break;
+                default:
+                    forward(session, frame);
+                    break;
+            }
+        } catch (Exception& e) {
+            fail(session, tag, e.message());
+        }
+    }
+}
+
+void
+Proxy::version(SessionPtr& session, const FrameView& frame) {
+    auto request = std::get<VersionRequest>(frame.decodeRequest());
+    // a new session starts from nothing, whatever the old one left in flight
+    // is forgotten and its fids are given back
+    close(session);
+    session = std::make_shared<Session>(session->connection);
+    VersionResponse response;
+    response.setMsize(std::min(request.getMsize(), _msize));
+    if (auto ver = request.getVersion(); ver.compare(0, 6, version9p2000String) == 0) {
+        response.setVersion(version9p2000String);
+    } else {
+        response.setVersion("unknown");
+    }
+    MessageStream outgoing;
+    outgoing << response;
+    reply(session, FrameView(outgoing));
+    std::lock_guard<std::mutex> guard(_statsLock);
+    ++_stats.answered;
+}
+
+size_t
+Proxy::choose() {
+    // new attachments go to the upstream with the least in flight
+    size_t best = 0;
+    size_t fewest = std::numeric_limits<size_t>::max();
+    for (size_t i = 0; i < _upstreams.size(); ++i) {
+        auto& upstream = *_upstreams[i];
+        std::lock_guard<std::mutex> guard(upstream.lock);
+        if (upstream.alive && upstream.pending.size() < fewest) {
+            best = i;
+            fewest = upstream.pending.size();
+        }
+    }
+    if (fewest == std::numeric_limits<size_t>::max()) {
+        throw Exception("no upstream connection left");
+    }
+    return best;
+}
+
+void
+Proxy::forward(const SessionPtr& session, FrameView& frame) {
+    auto type = frame.getType();
+    Pending request;
+    request.session = session;
+    request.tag = frame.getTag();
+    request.type = type;
+    size_t target = 0;
+    // the downstream fid the request creates, if any
+    uint32_t created = nofid;
+    bool createdIsSecond = false;
+    {
+        std::lock_guard<std::mutex> guard(session->lock);
+        auto lookup = [&session](uint32_t fid) -> Session::Binding& {
+            // a fid being clunked is as good as gone already
+            if (auto it = session->fids.find(fid); it == session->fids.end() || it->second.pending || it->second.closing) {
+                throw Exception("unknown fid");
+            } else {
+                return it->second;
+            }
+        };
+        switch (type) {
+            case Operation::TAuth:
+                created = *frame.getFid();
+                target = choose();
+                break;
+            case Operation::TAttach:
+                created = *frame.getFid();
+                if (auto afid = *frame.getSecondFid(); afid != nofid) {
+                    // the attach has to go where the authentication happened
+                    auto& binding = lookup(afid);
+                    target = binding.upstream;
+                    frame.setSecondFid(binding.fid);
+                } else {
+                    target = choose();
+                }
+                break;
+            case Operation::TWalk: {
+                auto fid = *frame.getFid();
+                auto& binding = lookup(fid);
+                target = binding.upstream;
+                frame.setFid(binding.fid);
+                request.names = *frame.getWalkCount();
+                if (auto newfid = *frame.getSecondFid(); newfid == fid) {
+                    frame.setSecondFid(binding.fid);
+                } else {
+                    created = newfid;
+                    createdIsSecond = true;
+                }
+                break;
+            }
+            default:
+                if (auto fid = frame.getFid(); !fid) {
+                    throw Exception("unsupported request");
+                } else {
+                    auto& binding = lookup(*fid);
+                    target = binding.upstream;
+                    frame.setFid(binding.fid);
+                    if (type == Operation::TClunk || type == Operation::TRemove) {
+                        // the fid is gone whatever the answer
+                        binding.closing = true;
+                        request.fid = *fid;
+                        request.upstreamFid = binding.fid;
+                    }
+                }
+                break;
+        }
+        if (created != nofid) {
+            if (session->fids.count(created) != 0) {
+                throw Exception("fid already in use");
+            }
+            // hold on to it so nothing else can claim it while the request
+            // is in flight
+            session->fids.emplace(created, Session::Binding { target, nofid, true, false });
+            request.fid = created;
+        }
+    }
+    auto& upstream = *_upstreams[target];
+    uint32_t upstreamFid = nofid;
+    auto tag = enqueue(upstream, std::move(request), created != nofid, upstreamFid, true);
+    {
+        std::lock_guard<std::mutex> guard(session->lock);
+        if (tag == notag) {
+            if (created != nofid) {
+                session->fids.erase(created);
+            }
+            throw Exception("upstream unavailable");
+        }
+        if (created != nofid) {
+            session->fids[created].fid = upstreamFid;
+            if (createdIsSecond) {
+                frame.setSecondFid(upstreamFid);
+            } else {
+                frame.setFid(upstreamFid);
+            }
+        }
+        session->tags[request.tag] = std::make_pair(target, tag);
+    }
+    frame.setTag(tag);
+    // a failed write means the connection is going away, the thread reading
+    // from it answers everything in flight when it notices
+    transmit(upstream, frame);
+    std::lock_guard<std::mutex> guard(_statsLock);
+    ++_stats.forwarded;
+}
+
+uint16_t
+Proxy::enqueue(Upstream& upstream, Pending&& request, bool allocateFid, uint32_t& fid, bool wait) {
+    std::unique_lock<std::mutex> guard(upstream.lock);
+    if (wait) {
+        upstream.available.wait(guard, [&upstream]() { return !upstream.alive || upstream.pending.size() < notag; });
+    }
+    if (!upstream.alive || upstream.pending.size() >= notag) {
+        return notag;
+    }
+    while (upstream.nextTag == notag || upstream.pending.count(upstream.nextTag) != 0) {
+        ++upstream.nextTag;
+    }
+    auto tag = upstream.nextTag++;
+    if (allocateFid) {
+        if (!upstream.freeFids.empty()) {
+            fid = upstream.freeFids.back();
+            upstream.freeFids.pop_back();
+        } else if (upstream.nextFid == nofid) {
+            return notag;
+        } else {
+            fid = upstream.nextFid++;
+        }
+        request.upstreamFid = fid;
+    }
+    upstream.pending.emplace(tag, std::move(request));
+    return tag;
+}
+
+bool
+Proxy::transmit(Upstream& upstream, const FrameView& frame) {
+    try {
+        std::lock_guard<std::mutex> guard(upstream.writeLock);
+        upstream.connection << frame;
+        return true;
+    } catch (Exception&) {
+        return false;
+    }
+}
+
+void
+Proxy::flush(const SessionPtr& session, FrameView& frame) {
+    auto tag = frame.getTag();
+    auto oldTag = *frame.getOldTag();
+    std::pair<size_t, uint16_t> target;
+    {
+        std::lock_guard<std::mutex> guard(session->lock);
+        if (auto it = session->tags.find(oldTag); it == session->tags.end()) {
+            target.second = notag;
+        } else {
+            target = it->second;
+        }
+    }
+    if (target.second != notag) {
+        auto& upstream = *_upstreams[target.first];
+        uint16_t flushTag = notag;
+        {
+            std::unique_lock<std::mutex> guard(upstream.lock);
+            // only flush the request while it is still waiting on its answer,
+            // the tag stays reserved until the upstream confirms the flush so
+            // that it can't be mistaken for a later request
+            if (auto it = upstream.pending.find(target.second); it != upstream.pending.end() && !it->second.answered && it->second.session == session && it->second.tag == oldTag) {
+                ++it->second.flushes;
+                guard.unlock();
+                Pending request;
+                request.session = session;
+                request.tag = tag;
+                request.type = Operation::TFlush;
+                request.flushOf = target.second;
+                uint32_t unused = nofid;
+                flushTag = enqueue(upstream, std::move(request), false, unused, true);
+                if (flushTag == notag) {
+                    std::lock_guard<std::mutex> again(upstream.lock);
+                    if (auto it = upstream.pending.find(target.second); it != upstream.pending.end() && --it->second.flushes == 0 && it->second.answered) {
+                        upstream.pending.erase(it);
+                        upstream.available.notify_all();
+                    }
+                }
+            }
+        }
+        if (flushTag != notag) {
+            frame.setTag(flushTag);
+            frame.setOldTag(target.second);
+            transmit(upstream, frame);
+            std::lock_guard<std::mutex> guard(_statsLock);
+            ++_stats.forwarded;
+            return;
+        }
+    }
+    // the request was answered already (or never existed)
+    MessageStream outgoing;
+    outgoing << FlushResponse(tag);
+    reply(session, FrameView(outgoing));
+    std::lock_guard<std::mutex> guard(_statsLock);
+    ++_stats.answered;
+}
+
+void
+Proxy::receive(size_t index) {
+    auto& upstream = *_upstreams[index];
+    while (true) {
+        MessageStream incoming;
+        try {
+            upstream.connection >> incoming;
+        } catch (Exception&) {
+            break;
+        }
+        FrameView frame;
+        uint16_t tag = notag;
+        try {
+            frame = FrameView(incoming);
+            tag = frame.getTag();
+        } catch (Exception&) {
+            continue;
+        }
+        Pending request;
+        Pending cancelled;
+        bool wasCancelled = false;
+        {
+            std::lock_guard<std::mutex> guard(upstream.lock);
+            if (auto it = upstream.pending.find(tag); it == upstream.pending.end() || it->second.answered) {
+                // nobody asked for this
+                continue;
+            } else {
+                request = it->second;
+            }
+            if (request.type == Operation::TFlush) {
+                if (auto it = upstream.pending.find(request.flushOf); it != upstream.pending.end()) {
+                    --it->second.flushes;
+                    if (!it->second.answered) {
+                        // flushed before it was answered, it never happened
+                        cancelled = it->second;
+                        wasCancelled = true;
+                        it->second.answered = true;
+                    }
+                    if (it->second.flushes == 0) {
+                        upstream.pending.erase(it);
+                        upstream.available.notify_all();
+                    }
+                }
+            }
+        }
+        auto success = frame.getType() != Operation::RError;
+        if (success && request.type == Operation::TWalk) {
+            try {
+                success = frame.getWalkCount() == request.names;
+            } catch (Exception&) {
+                success = false;
+            }
+        }
+        settle(index, request, success);
+        if (wasCancelled) {
+            settle(index, cancelled, false, true);
+            if (auto& session = cancelled.session; session) {
+                std::lock_guard<std::mutex> guard(session->lock);
+                if (auto it = session->tags.find(cancelled.tag); it != session->tags.end() && it->second == std::make_pair(index, request.flushOf)) {
+                    session->tags.erase(it);
+                }
+            }
+            std::lock_guard<std::mutex> guard(_statsLock);
+            ++_stats.cancelled;
+        }
+        if (request.session) {
+            frame.setTag(request.tag);
+            reply(request.session, frame);
+            // the downstream tag is only free once the answer went out, a
+            // flush of it until then has to go upstream
+            std::lock_guard<std::mutex> guard(request.session->lock);
+            if (auto it = request.session->tags.find(request.tag); it != request.session->tags.end() && it->second == std::make_pair(index, tag)) {
+                request.session->tags.erase(it);
+            }
+        }
+        {
+            std::lock_guard<std::mutex> guard(upstream.lock);
+            if (auto it = upstream.pending.find(tag); it != upstream.pending.end()) {
+                if (it->second.flushes == 0) {
+                    upstream.pending.erase(it);
+                    upstream.available.notify_all();
+                } else {
+                    it->second.answered = true;
+                }
+            }
+        }
+    }
+    // the connection is gone, answer everything which was waiting on it
+    std::unordered_map<uint16_t, Pending> orphans;
+    {
+        std::lock_guard<std::mutex> guard(upstream.lock);
+        upstream.alive = false;
+        orphans.swap(upstream.pending);
+        upstream.available.notify_all();
+    }
+    for (auto& [tag, request] : orphans) {
+        if (request.answered) {
+            continue;
+        }
+        settle(index, request, false);
+        if (request.session) {
+            {
+                std::lock_guard<std::mutex> guard(request.session->lock);
+                request.session->tags.erase(request.tag);
+            }
+            fail(request.session, request.tag, "upstream connection lost");
+        }
+    }
+}
+
+void
+Proxy::settle(size_t index, const Pending& request, bool success, bool cancelled) {
+    auto& upstream = *_upstreams[index];
+    switch (request.type) {
+        case Operation::TAuth:
+        case Operation::TAttach:
+        case Operation::TWalk: {
+            if (request.fid == nofid) {
+                // a walk which replaced its own fid
+                return;
+            }
+            bool keep = false;
+            if (auto& session = request.session; session) {
+                std::lock_guard<std::mutex> guard(session->lock);
+                if (auto it = session->fids.find(request.fid); it != session->fids.end() && it->second.pending && it->second.fid == request.upstreamFid) {
+                    if (success) {
+                        it->second.pending = false;
+                        keep = true;
+                    } else {
+                        session->fids.erase(it);
+                    }
+                }
+            }
+            if (keep) {
+                return;
+            } else if (success) {
+                // the session went away while the fid was being made
+                clunk(index, request.upstreamFid, false);
+            } else {
+                release(upstream, request.upstreamFid);
+            }
+            break;
+        }
+        case Operation::TClunk:
+        case Operation::TRemove: {
+            bool kept = false;
+            if (auto& session = request.session; session) {
+                std::lock_guard<std::mutex> guard(session->lock);
+                if (auto it = session->fids.find(request.fid); it != session->fids.end() && it->second.fid == request.upstreamFid && it->second.closing) {
+                    if (cancelled) {
+                        // flushed before it happened, the fid is still open
+                        it->second.closing = false;
+                        kept = true;
+                    } else {
+                        session->fids.erase(it);
+                    }
+                }
+            }
+            if (kept) {
+                return;
+            } else if (cancelled) {
+                // the session went away meanwhile and skipped the fid
+                clunk(index, request.upstreamFid, false);
+            } else {
+                release(upstream, request.upstreamFid);
+            }
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+void
+Proxy::release(Upstream& upstream, uint32_t fid) {
+    if (fid == nofid) {
+        return;
+    }
+    std::lock_guard<std::mutex> guard(upstream.lock);
+    upstream.freeFids.emplace_back(fid);
+}
+
+void
+Proxy::clunk(size_t index, uint32_t fid, bool wait) {
+    auto& upstream = *_upstreams[index];
+    Pending request;
+    request.type = Operation::TClunk;
+    request.upstreamFid = fid;
+    uint32_t unused = nofid;
+    // when there is no tag to be had without waiting the fid stays open
+    // upstream until the connection goes away
+    if (auto tag = enqueue(upstream, std::move(request), false, unused, wait); tag != notag) {
+        transmit(upstream, FrameView::make(Operation::TClunk, tag, fid));
+    }
+}
+
+void
+Proxy::close(const SessionPtr& session) {
+    std::vector<std::pair<size_t, uint32_t>> held;
+    {
+        std::lock_guard<std::mutex> writing(session->writeLock);
+        std::lock_guard<std::mutex> guard(session->lock);
+        session->open = false;
+        for (auto& [fid, binding] : session->fids) {
+            // fids still being made are clunked once they are, the ones
+            // being clunked already are taken care of
+            if (!binding.pending && !binding.closing) {
+                held.emplace_back(binding.upstream, binding.fid);
+            }
+        }
+        session->fids.clear();
+        session->tags.clear();
+    }
+    for (auto [index, fid] : held) {
+        clunk(index, fid, true);
+    }
+}
+
+void
+Proxy::reply(const SessionPtr& session, const FrameView& frame) {
+    std::lock_guard<std::mutex> guard(session->writeLock);
+    if (!session->open) {
+        return;
+    }
+    try {
+        session->connection << frame;
+    } catch (Exception&) {
+        // the session is going away, serve notices on its next read
+    }
+}
+
+void
+Proxy::fail(const SessionPtr& session, uint16_t tag, const std::string& message) {
+    ErrorResponse err(tag);
+    err.setErrorName(message);
+    MessageStream outgoing;
+    outgoing << err;
+    reply(session, FrameView(outgoing));
+    std::lock_guard<std::mutex> guard(_statsLock);
+    ++_stats.answered;
+}
+
+} // end namespace kzr
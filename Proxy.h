@@ -0,0 +1,207 @@
+/**
+ * @file
+ * Multiplexes many 9p sessions over a few upstream connections
+ * @copyright
+ * libkzr
+ * Copyright (c) 2019, Joshua Scoggins 
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR 
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef KZR_PROXY_H__
+#define KZR_PROXY_H__
+#include <cstdint>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "Message.h"
+#include "Interaction.h"
+#include "Connection.h"
+#include "FrameView.h"
+
+namespace kzr {
+
+/**
+ * Accepts any number of downstream sessions and forwards their requests over
+ * a small, fixed set of upstream connections to a single server. Tags and
+ * fids are rewritten on the way through so that sessions can't collide with
+ * one another; a fid stays on the upstream connection it was attached on and
+ * everything walked from it follows it there.
+ *
+ * Frames are never decoded in full (see FrameView): only the type, tag and
+ * fid fields are looked at and patched in place, the rest is passed along
+ * untouched.
+ *
+ * Responses are read off of each upstream connection by a thread of its own.
+ * The upstream connections must outlive the proxy and the proxy must not be
+ * destroyed before they hang up, that is what stops those threads.
+ */
+class Proxy {
+    public:
+        static constexpr uint32_t defaultMsize = 8192;
+        struct Statistics {
+            uint64_t sessions = 0;
+            uint64_t forwarded = 0;
+            /**
+             * Requests answered by the proxy itself (version, flushes of
+             * requests which were already answered and errors)
+             */
+            uint64_t answered = 0;
+            /**
+             * Requests which were flushed before the upstream answered them
+             */
+            uint64_t cancelled = 0;
+        };
+    public:
+        /**
+         * Negotiate a session on every upstream connection and start reading
+         * responses from them
+         */
+        Proxy(const std::vector<std::reference_wrapper<Connection>>& upstreams, uint32_t msize = defaultMsize);
+        ~Proxy();
+        Proxy(const Proxy&) = delete;
+        Proxy& operator=(const Proxy&) = delete;
+        /**
+         * Forward requests from the connection until the other side goes
+         * away. Everything it still holds upstream is clunked on the way out.
+         */
+        void serve(Connection& downstream);
+        /**
+         * The largest msize shared by every upstream connection
+         */
+        constexpr auto getMsize() const noexcept { return _msize; }
+        auto getUpstreamCount() const noexcept { return _upstreams.size(); }
+        Statistics getStatistics();
+    private:
+        struct Session {
+            struct Binding {
+                size_t upstream;
+                uint32_t fid;
+                /**
+                 * The request which creates the fid has not been answered
+                 */
+                bool pending;
+                /**
+                 * A clunk or remove of the fid is in flight
+                 */
+                bool closing;
+            };
+            explicit Session(Connection& c) : connection(c) { }
+            Connection& connection;
+            std::mutex lock;
+            /**
+             * Held while writing to the connection, the responses come from
+             * the threads of the upstream connections
+             */
+            std::mutex writeLock;
+            bool open = true;
+            std::unordered_map<uint32_t, Binding> fids;
+            /**
+             * Downstream tags in flight mapped to the upstream and the tag
+             * they went out with
+             */
+            std::unordered_map<uint16_t, std::pair<size_t, uint16_t>> tags;
+        };
+        using SessionPtr = std::shared_ptr<Session>;
+        struct Pending {
+            /**
+             * Empty for requests the proxy makes on its own behalf
+             */
+            SessionPtr session;
+            uint16_t tag = notag;
+            Operation type = Operation::TBad;
+            /**
+             * The downstream fid created or released by the request
+             */
+            uint32_t fid = nofid;
+            /**
+             * The upstream fid created or released by the request
+             */
+            uint32_t upstreamFid = nofid;
+            /**
+             * Number of names in a walk, it is only complete when a qid
+             * comes back for each one
+             */
+            uint16_t names = 0;
+            /**
+             * For a flush, the upstream tag of the request being flushed
+             */
+            uint16_t flushOf = notag;
+            /**
+             * The response has been passed on but flushes of the tag are
+             * still in flight so it can't be handed out again yet
+             */
+            bool answered = false;
+            unsigned flushes = 0;
+        };
+        struct Upstream {
+            explicit Upstream(Connection& c) : connection(c) { }
+            Connection& connection;
+            std::mutex lock;
+            std::condition_variable available;
+            std::mutex writeLock;
+            bool alive = true;
+            std::unordered_map<uint16_t, Pending> pending;
+            uint16_t nextTag = 0;
+            uint32_t nextFid = 0;
+            std::vector<uint32_t> freeFids;
+            std::thread reader;
+        };
+        void negotiate(Upstream& upstream);
+        void receive(size_t index);
+        void forward(const SessionPtr& session, FrameView& frame);
+        void flush(const SessionPtr& session, FrameView& frame);
+        void version(SessionPtr& session, const FrameView& frame);
+        /**
+         * Stop sending responses to the session and clunk all of its fids
+         */
+        void close(const SessionPtr& session);
+        /**
+         * Claim a tag (waiting for one if they are all in flight and asked
+         * to) and an fid if asked for, then record the request
+         * @return the tag or notag if the upstream is gone or out of either
+         */
+        uint16_t enqueue(Upstream& upstream, Pending&& request, bool allocateFid, uint32_t& fid, bool wait);
+        bool transmit(Upstream& upstream, const FrameView& frame);
+        void clunk(size_t index, uint32_t fid, bool wait);
+        void release(Upstream& upstream, uint32_t fid);
+        /**
+         * Settle the fids of a request which got its answer (or was
+         * cancelled by a flush, which leaves a clunked fid open)
+         */
+        void settle(size_t index, const Pending& request, bool success, bool cancelled = false);
+        size_t choose();
+        void reply(const SessionPtr& session, const FrameView& frame);
+        void fail(const SessionPtr& session, uint16_t tag, const std::string& message);
+    private:
+        uint32_t _msize;
+        std::vector<std::unique_ptr<Upstream>> _upstreams;
+        std::mutex _statsLock;
+        Statistics _stats;
+};
+
+} // end namespace kzr
+
+#endif // end KZR_PROXY_H__
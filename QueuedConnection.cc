@@ -0,0 +1,216 @@
+/**
+ * @file
+ * Connection over a non blocking file handle which queues whatever the
+ * handle will not take right away
+ * @copyright
+ * libkzr
+ * Copyright (c) 2019, Joshua Scoggins 
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR 
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "QueuedConnection.h"
+#include <cerrno>
+#include <unistd.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+
+namespace kzr {
+
+namespace {
+constexpr bool
+wouldBlock(int error) noexcept {
+    return error == EAGAIN || error == EWOULDBLOCK;
+}
+} // end namespace
+
+QueuedConnection::QueuedConnection(int fd, bool destroy) : Parent(fd, destroy) { }
+
+size_t
+QueuedConnection::writeSome(const char* data, size_t count) {
+    size_t total = 0;
+    while (total < count) {
+        if (auto written = ::write(getHandle(), data + total, count - total); written > 0) {
+            total += size_t(written);
+        } else if (written < 0 && errno == EINTR) {
+            continue;
+        } else {
+            _broken = !(written < 0 && wouldBlock(errno));
+            break;
+        }
+    }
+    return total;
+}
+
+void
+QueuedConnection::queued() {
+    if (_onQueued) {
+        _onQueued();
+    }
+}
+
+bool
+QueuedConnection::flush() {
+    std::lock_guard<std::mutex> guard(_lock);
+    if (!_broken && !_queue.empty()) {
+        _queue.erase(0, writeSome(_queue.data(), _queue.size()));
+    }
+    return !_broken;
+}
+
+size_t
+QueuedConnection::pending() const {
+    std::lock_guard<std::mutex> guard(_lock);
+    return _queue.size();
+}
+
+size_t
+QueuedConnection::rawWrite(const std::string& data) {
+    if (!isValidHandle()) {
+        return 0;
+    }
+    bool first = false;
+    {
+        std::lock_guard<std::mutex> guard(_lock);
+        if (_broken) {
+            return 0;
+        }
+        // anything written ahead of the queue would arrive out of order
+        size_t written = _queue.empty() ? writeSome(data.data(), data.size()) : 0;
+        if (_broken) {
+            return written;
+        } else if (written < data.size()) {
+            first = _queue.empty();
+            _queue.append(data, written, std::string::npos);
+        }
+    }
+    if (first) {
+        queued();
+    }
+    return data.size();
+}
+
+size_t
+QueuedConnection::rawSendFile(int fd, uint64_t offset, size_t count) {
+    if (!isValidHandle()) {
+        return 0;
+    }
+    bool first = false;
+    size_t total = 0;
+    {
+        std::lock_guard<std::mutex> guard(_lock);
+        if (_broken) {
+            return 0;
+        }
+        while (_queue.empty() && total < count) {
+            off_t position = off_t(offset + total);
+            if (auto sent = ::sendfile(getHandle(), fd, &position, count - total); sent > 0) {
+                total += size_t(sent);
+            } else if (sent < 0 && errno == EINTR) {
+                continue;
+            } else if (sent < 0 && !wouldBlock(errno) && errno != EINVAL && errno != ENOSYS) {
+                _broken = true;
+                return total;
+            } else {
+                // full, or this kind of descriptor can't be spliced from
+                break;
+            }
+        }
+        // the file may change before the socket drains so the rest is
+        // copied now, a short read leaves the padding to the caller
+        std::string rest(count - total, '\0');
+        size_t got = 0;
+        while (got < rest.size()) {
+            if (auto read = ::pread(fd, rest.data() + got, rest.size() - got, off_t(offset + total + got)); read > 0) {
+                got += size_t(read);
+            } else if (read < 0 && errno == EINTR) {
+                continue;
+            } else {
+                break;
+            }
+        }
+        rest.resize(got);
+        size_t written = _queue.empty() ? writeSome(rest.data(), rest.size()) : 0;
+        if (_broken) {
+            return total + written;
+        } else if (written < rest.size()) {
+            first = _queue.empty();
+            _queue.append(rest, written, std::string::npos);
+        }
+        total += got;
+    }
+    if (first) {
+        queued();
+    }
+    return total;
+}
+
+size_t
+QueuedConnection::rawWriteVector(const std::string& header, const uint8_t* data, size_t count) {
+    if (!isValidHandle()) {
+        return 0;
+    }
+    bool first = false;
+    {
+        std::lock_guard<std::mutex> guard(_lock);
+        if (_broken) {
+            return 0;
+        }
+        size_t written = 0;
+        while (_queue.empty() && written < header.size() + count) {
+            struct iovec pieces[2];
+            int used = 0;
+            if (written < header.size()) {
+                pieces[used].iov_base = const_cast<char*>(header.data() + written);
+                pieces[used].iov_len = header.size() - written;
+                ++used;
+            }
+            auto skip = written > header.size() ? written - header.size() : 0;
+            pieces[used].iov_base = const_cast<uint8_t*>(data + skip);
+            pieces[used].iov_len = count - skip;
+            ++used;
+            if (auto put = ::writev(getHandle(), pieces, used); put > 0) {
+                written += size_t(put);
+            } else if (put < 0 && errno == EINTR) {
+                continue;
+            } else if (put < 0 && wouldBlock(errno)) {
+                break;
+            } else {
+                _broken = true;
+                return written;
+            }
+        }
+        if (written < header.size() + count) {
+            first = _queue.empty();
+            if (written < header.size()) {
+                _queue.append(header, written, std::string::npos);
+                written = header.size();
+            }
+            _queue.append(reinterpret_cast<const char*>(data) + (written - header.size()), count - (written - header.size()));
+        }
+    }
+    if (first) {
+        queued();
+    }
+    return header.size() + count;
+}
+
+} // end namespace kzr
@@ -0,0 +1,84 @@
+/**
+ * @file
+ * Connection over a non blocking file handle which queues whatever the
+ * handle will not take right away
+ * @copyright
+ * libkzr
+ * Copyright (c) 2019, Joshua Scoggins 
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR 
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef KZR_QUEUED_CONNECTION_H__
+#define KZR_QUEUED_CONNECTION_H__
+#include <functional>
+#include <mutex>
+#include <string>
+#include "FileHandleConnection.h"
+namespace kzr {
+
+/**
+ * Writes never block, the bytes a full socket refuses are queued in order and
+ * written by flush once the handle is writable again. Writes always report
+ * the full length unless the handle failed, so a message is never split by a
+ * slow reader. Safe to write to and flush from different threads.
+ */
+class QueuedConnection : public FileHandleConnection {
+    public:
+        using Parent = FileHandleConnection;
+        using QueuedHandler = std::function<void()>;
+    public:
+        QueuedConnection(int fd, bool destroy = true);
+        ~QueuedConnection() override = default;
+        /**
+         * Called, from whichever thread wrote, when bytes are queued while
+         * nothing else was
+         */
+        void setQueuedHandler(QueuedHandler handler) { _onQueued = std::move(handler); }
+        /**
+         * Write as much of the queue as the handle takes without blocking
+         * @return false once the handle has failed
+         */
+        bool flush();
+        /**
+         * Bytes queued which have not been written yet
+         */
+        size_t pending() const;
+    protected:
+        [[nodiscard]] virtual size_t rawWrite(const std::string& data) override;
+        [[nodiscard]] virtual size_t rawSendFile(int fd, uint64_t offset, size_t count) override;
+        [[nodiscard]] virtual size_t rawWriteVector(const std::string& header, const uint8_t* data, size_t count) override;
+    private:
+        /**
+         * Write what the handle takes while nothing is queued, must hold the lock
+         */
+        size_t writeSome(const char* data, size_t count);
+        void queued();
+    private:
+        mutable std::mutex _lock;
+        std::string _queue;
+        bool _broken = false;
+        QueuedHandler _onQueued;
+};
+
+} // end namespace kzr
+
+#endif // end KZR_QUEUED_CONNECTION_H__
@@ -0,0 +1,700 @@
+/**
+ * @file
+ * In memory file tree and the backend which serves it implementation
+ * @copyright
+ * libkzr
+ * Copyright (c) 2019, Joshua Scoggins 
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR 
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "RamFileSystem.h"
+#include "Exception.h"
+#include <ctime>
+#include <mutex>
+#include <sstream>
+
+namespace kzr {
+
+namespace {
+constexpr uint32_t readAccess = 4;
+constexpr uint32_t writeAccess = 2;
+constexpr uint32_t executeAccess = 1;
+constexpr uint32_t dontTouch32 = ~uint32_t(0);
+constexpr uint64_t dontTouch64 = ~uint64_t(0);
+
+uint32_t
+now() noexcept {
+    return uint32_t(std::time(nullptr));
+}
+
+uint8_t
+qidTypeOf(uint32_t mode) noexcept {
+    // the qid type is the top byte of the mode
+    return uint8_t(mode >> 24);
+}
+
+std::vector<std::string>
+splitPath(const std::string& path) {
+    std::vector<std::string> parts;
+    std::istringstream input(path);
+    std::string part;
+    while (std::getline(input, part, '/')) {
+        if (!part.empty()) {
+            parts.emplace_back(part);
+        }
+    }
+    return parts;
+}
+
+} // end namespace
+
+RamNode::RamNode(uint64_t path, const std::string& name, uint32_t mode, const std::string& owner, const std::string& group, StorageBudget* budget) :
+    _name(name), _mode(mode), _atime(now()), _mtime(_atime), _uid(owner), _gid(group), _muid(owner), _data(ExtentStorage::defaultExtentSize, budget) {
+    _qid.setType(qidTypeOf(mode));
+    _qid.setVersion(0);
+    _qid.setPath(path);
+}
+
+RamNode::Pointer
+RamNode::find(const std::string& name) const {
+    if (auto child = _children.find(name); child) {
+        return *child;
+    }
+    return nullptr;
+}
+
+void
+RamNode::modified(const std::string& user) {
+    _mtime = now();
+    _atime = _mtime;
+    _muid = user;
+    _qid.setVersion(_qid.getVersion() + 1);
+    refreshRecord();
+}
+
+size_t
+RamNode::recordSize() const noexcept {
+    // the fixed size fields plus four length prefixed strings
+    return 49 + _name.size() + _uid.size() + _gid.size() + _muid.size();
+}
+
+void
+RamNode::refreshRecord() {
+    if (auto parent = getParent(); parent) {
+        parent->_children.resize(_name, recordSize());
+    }
+}
+
+Stat
+RamNode::toStat() const {
+    Stat s;
+    s.setType(0);
+    s.setDevice(0);
+    s.setQid(_qid);
+    s.setPermissions(_mode);
+    s.setLastAccessTime(_atime);
+    s.setLastModificationTime(_mtime);
+    s.setLength(length());
+    s.setName(_name);
+    s.setOwner(_uid);
+    s.setGroup(_gid);
+    s.setUserThatLastModified(_muid);
+    return s;
+}
+
+RamFileSystem::RamFileSystem(const std::string& owner, uint32_t rootPermissions, uint64_t capacity) : _owner(owner), _budget(capacity) {
+    _root = std::make_shared<RamNode>(_nextPath++, "/", uint32_t(FileMode::Directory) | (rootPermissions & uint32_t(FileMode::PermissionMask)), owner, owner);
+}
+
+RamNode::Pointer
+RamFileSystem::add(const RamNode::Pointer& directory, const std::string& name, uint32_t mode, const std::string& owner) {
+    if (!directory->isDirectory()) {
+        throw Exception("not a directory");
+    } else if (name.empty() || name == "." || name == ".." || name.find('/') != std::string::npos) {
+        throw Exception("illegal name");
+    } else if (directory->getChildren().count(name) != 0) {
+        throw Exception("file already exists");
+    }
+    // files inherit the group of the directory they are made in
+    auto node = std::make_shared<RamNode>(_nextPath++, name, mode, owner, directory->getGroup(), &_budget);
+    node->_parent = directory;
+    directory->getChildren().insert(name, node, node->recordSize());
+    directory->modified(owner);
+    return node;
+}
+
+void
+RamFileSystem::unlink(const RamNode::Pointer& node, const std::string& user) {
+    auto parent = node->getParent();
+    if (!parent) {
+        throw Exception("cannot remove root");
+    } else if (node->isDirectory() && !node->getChildren().empty()) {
+        throw Exception("directory not empty");
+    }
+    parent->getChildren().erase(node->getName());
+    parent->modified(user);
+    node->_parent.reset();
+}
+
+RamNode::Pointer
+RamFileSystem::makePath(const std::string& path, uint32_t mode) {
+    auto parts = splitPath(path);
+    if (parts.empty()) {
+        throw Exception("cannot make the root");
+    }
+    std::unique_lock guard(_lock);
+    auto current = _root;
+    for (size_t i = 0; i + 1 < parts.size(); ++i) {
+        if (auto next = current->find(parts[i]); next) {
+            current = next;
+        } else {
+            current = add(current, parts[i], uint32_t(FileMode::Directory) | 0755, _owner);
+        }
+    }
+    return add(current, parts.back(), mode, _owner);
+}
+
+RamNode::Pointer
+RamFileSystem::makeFile(const std::string& path, const std::string& contents, uint32_t permissions) {
+    auto node = makePath(path, permissions & uint32_t(FileMode::PermissionMask));
+    std::unique_lock guard(_lock);
+    node->getData().write(0, reinterpret_cast<const uint8_t*>(contents.data()), contents.size());
+    return node;
+}
+
+RamNode::Pointer
+RamFileSystem::makeDirectory(const std::string& path, uint32_t permissions) {
+    return makePath(path, uint32_t(FileMode::Directory) | (permissions & uint32_t(FileMode::PermissionMask)));
+}
+
+std::shared_ptr<EventChannel>
+RamFileSystem::makeEventFile(const std::string& path, uint32_t permissions, size_t backlog) {
+    auto node = makePath(path, permissions & uint32_t(FileMode::PermissionMask));
+    std::unique_lock guard(_lock);
+    node->_events = std::make_shared<EventChannel>(backlog);
+    return node->_events;
+}
+
+RamFileServer::RamFileServer(RamFileSystem& fs) : _fs(fs) { }
+
+RamFileServer::~RamFileServer() {
+    // subscriptions live in channels shared with other connections
+    reset();
+}
+
+RamFileServer::FidEntry*
+RamFileServer::find(uint32_t fid) {
+    std::lock_guard<std::mutex> guard(_fidLock);
+    if (auto it = _fids.find(fid); it != _fids.end()) {
+        return &it->second;
+    }
+    return nullptr;
+}
+
+RamFileServer::FidEntry&
+RamFileServer::lookup(uint32_t fid) {
+    if (auto entry = find(fid); entry) {
+        return *entry;
+    }
+    throw Exception("unknown fid ", fid);
+}
+
+void
+RamFileServer::bind(uint32_t fid, FidEntry&& entry) {
+    if (fid == nofid) {
+        throw Exception("illegal fid");
+    }
+    std::lock_guard<std::mutex> guard(_fidLock);
+    _fids[fid] = std::move(entry);
+}
+
+bool
+RamFileServer::bound(uint32_t fid) {
+    std::lock_guard<std::mutex> guard(_fidLock);
+    return _fids.count(fid) != 0;
+}
+
+RamFileServer::FidEntry
+RamFileServer::take(uint32_t fid) {
+    std::lock_guard<std::mutex> guard(_fidLock);
+    if (auto it = _fids.find(fid); it != _fids.end()) {
+        auto entry = std::move(it->second);
+        _fids.erase(it);
+        return entry;
+    }
+    throw Exception("unknown fid ", fid);
+}
+
+bool
+RamFileServer::permits(const RamNode& node, const std::string& user, uint32_t access) noexcept {
+    auto mode = node.getMode();
+    if (user == node.getOwner() && ((mode >> 6) & access) == access) {
+        return true;
+    } else if (user == node.getGroup() && ((mode >> 3) & access) == access) {
+        return true;
+    } else {
+        return (mode & access) == access;
+    }
+}
+
+void
+RamFileServer::release(FidEntry& entry) {
+    if (entry.subscriber != 0) {
+        entry.node->getEvents()->unsubscribe(entry.subscriber);
+        entry.subscriber = 0;
+    }
+}
+
+void
+RamFileServer::reset() {
+    std::lock_guard<std::mutex> guard(_fidLock);
+    for (auto& [fid, entry] : _fids) {
+        release(entry);
+    }
+    _fids.clear();
+}
+
+bool
+RamFileServer::identify(uint32_t fid, Qid& qid) {
+    auto entry = find(fid);
+    if (!entry) {
+        return false;
+    } else if (!entry->open || !allowsReading(entry->mode) || entry->node->isDirectory() || entry->node->getEvents()) {
+        // directory reads depend on the offset of the fid and every reader
+        // of an event file gets its own events
+        return false;
+    } else {
+        std::shared_lock guard(_fs.getLock());
+        qid = entry->node->getQid();
+        return true;
+    }
+}
+
+bool
+RamFileServer::describe(uint32_t fid, Qid& qid) {
+    if (auto entry = find(fid); !entry) {
+        return false;
+    } else {
+        std::shared_lock guard(_fs.getLock());
+        qid = entry->node->getQid();
+        return true;
+    }
+}
+
+bool
+RamFileServer::submit(Request& request, Responder responder) {
+    // only reads of event files are answered later
+    if (auto read = std::get_if<ReadRequest>(&request); read) {
+        auto& entry = lookup(read->getFid());
+        if (entry.subscriber == 0) {
+            return false;
+        } else if (!allowsReading(entry.mode)) {
+            throw Exception("fid not open for reading");
+        }
+        {
+            // flush looks for the tag from the thread reading requests
+            std::lock_guard<std::mutex> guard(_fidLock);
+            entry.eventTag = read->getTag();
+        }
+        entry.node->getEvents()->read(entry.subscriber, read->getTag(), read->getCount(), std::move(responder));
+        return true;
+    }
+    return false;
+}
+
+void
+RamFileServer::flush(uint16_t tag) {
+    std::lock_guard<std::mutex> guard(_fidLock);
+    for (auto& [fid, entry] : _fids) {
+        if (entry.subscriber != 0 && entry.eventTag == tag && entry.node->getEvents()->cancel(entry.subscriber, tag)) {
+            return;
+        }
+    }
+}
+
+AttachResponse
+RamFileServer::attach(const AttachRequest& request) {
+    if (request.getAuthenticationHandle() != nofid) {
+        throw Exception("authentication not required");
+    } else if (bound(request.getFid())) {
+        throw Exception("fid in use");
+    }
+    FidEntry entry;
+    entry.node = _fs.getRoot();
+    entry.user = request.getUserName();
+    AttachResponse response;
+    response.setQid(entry.node->getQid());
+    bind(request.getFid(), std::move(entry));
+    return response;
+}
+
+WalkResponse
+RamFileServer::walk(const WalkRequest& request) {
+    auto& source = lookup(request.getFid());
+    if (source.open) {
+        throw Exception("cannot walk an open fid");
+    } else if (request.getNewFid() != request.getFid() && bound(request.getNewFid())) {
+        throw Exception("fid in use");
+    }
+    WalkResponse response;
+    auto current = source.node;
+    {
+        std::shared_lock guard(_fs.getLock());
+        for (const auto& name : request.getWname()) {
+            RamNode::Pointer next;
+            if (!current->isDirectory()) {
+                if (response.getWqid().empty()) {
+                    throw Exception("not a directory");
+                }
+                break;
+            } else if (!permits(*current, source.user, executeAccess)) {
+                if (response.getWqid().empty()) {
+                    throw Exception("permission denied");
+                }
+                break;
+            } else if (name == "..") {
+                // the parent of the root is the root
+                next = current->getParent();
+                if (!next) {
+                    next = current == _fs.getRoot() ? current : nullptr;
+                }
+            } else if (name != ".") {
+                next = current->find(name);
+            } else {
+                next = current;
+            }
+            if (!next) {
+                if (response.getWqid().empty()) {
+                    throw Exception("file does not exist");
+                }
+                break;
+            }
+            current = next;
+            response.getWqid().emplace_back(current->getQid());
+        }
+    }
+    // a partial walk leaves newfid unbound
+    if (response.getWqid().size() == request.getWname().size()) {
+        FidEntry entry;
+        entry.node = current;
+        entry.user = source.user;
+        bind(request.getNewFid(), std::move(entry));
+    }
+    return response;
+}
+
+OpenResponse
+RamFileServer::open(const OpenRequest& request) {
+    auto& entry = lookup(request.getFid());
+    if (entry.open) {
+        throw Exception("fid already open");
+    }
+    auto mode = request.getMode();
+    std::unique_lock guard(_fs.getLock());
+    auto& node = *entry.node;
+    if (node.isDirectory() && (allowsWriting(mode) || hasMode(mode, OpenMode::Truncate))) {
+        throw Exception("is a directory");
+    }
+    uint32_t access = 0;
+    if (allowsReading(mode)) {
+        access |= readAccess;
+    }
+    if (allowsWriting(mode) || hasMode(mode, OpenMode::Truncate)) {
+        access |= writeAccess;
+    }
+    if (getAccessMode(mode) == OpenMode::Execute) {
+        access |= executeAccess;
+    }
+    if (!permits(node, entry.user, access)) {
+        throw Exception("permission denied");
+    }
+    if (hasMode(mode, OpenMode::RemoveOnClose)) {
+        if (auto parent = node.getParent(); !parent || !permits(*parent, entry.user, writeAccess)) {
+            throw Exception("permission denied");
+        }
+    }
+    if (hasMode(mode, OpenMode::Truncate) && !hasMode(node.getMode(), FileMode::AppendOnly)) {
+        node.getData().truncate(0);
+        node.modified(entry.user);
+    }
+    entry.open = true;
+    entry.mode = mode;
+    if (node.getEvents() && allowsReading(mode)) {
+        auto subscriber = node.getEvents()->subscribe();
+        std::lock_guard<std::mutex> fidGuard(_fidLock);
+        entry.subscriber = subscriber;
+    }
+    OpenResponse response;
+    response.setQid(node.getQid());
+    // zero tells the client to use msize - 24
+    response.setIounit(0);
+    return response;
+}
+
+CreateResponse
+RamFileServer::create(const CreateRequest& request) {
+    auto& entry = lookup(request.getFid());
+    if (entry.open) {
+        throw Exception("fid already open");
+    }
+    auto perm = request.getPermissions();
+    auto mode = request.getMode();
+    bool directory = hasMode(perm, FileMode::Directory);
+    if (directory && (allowsWriting(mode) || hasMode(mode, OpenMode::Truncate))) {
+        throw Exception("is a directory");
+    }
+    std::unique_lock guard(_fs.getLock());
+    auto& parent = entry.node;
+    if (!parent->isDirectory()) {
+        throw Exception("not a directory");
+    } else if (!permits(*parent, entry.user, writeAccess)) {
+        throw Exception("permission denied");
+    }
+    // see open(5) for how the permissions of the directory mask the new ones
+    auto dirPerm = parent->getMode() & uint32_t(FileMode::PermissionMask);
+    if (directory) {
+        perm &= ~uint32_t(0777) | dirPerm;
+    } else {
+        perm &= ~uint32_t(0666) | dirPerm;
+    }
+    auto node = _fs.add(parent, request.getName(), perm, entry.user);
+    entry.node = node;
+    entry.open = true;
+    entry.mode = mode;
+    CreateResponse response;
+    response.setQid(node->getQid());
+    response.setIounit(0);
+    return response;
+}
+
+void
+RamFileServer::readDirectory(FidEntry& entry, const ReadRequest& request, std::vector<uint8_t>& output) {
+    std::shared_lock guard(_fs.getLock());
+    const auto& children = entry.node->getChildren();
+    auto offset = request.getOffset();
+    auto position = children.begin();
+    if (std::unique_lock fidGuard(_fidLock); offset != 0 && offset == entry.directoryOffset) {
+        // carrying on from the last read of this fid
+        position = children.resume(entry.directorySerial);
+    } else if (offset != 0) {
+        fidGuard.unlock();
+        // any other offset has to be where some read ended, the index knows
+        // where every entry starts right now
+        auto [valid, located] = children.locate(offset);
+        if (!valid) {
+            throw Exception("bad directory offset");
+        }
+        position = located;
+    }
+    // only whole entries are ever returned
+    for (; position != children.end(); ++position) {
+        MessageStream msg;
+        msg << (*position).second->toStat();
+        auto record = msg.str();
+        if (output.size() + record.size() > request.getCount()) {
+            if (output.empty()) {
+                throw Exception("read count too small for directory entry");
+            }
+            break;
+        }
+        output.insert(output.end(), record.begin(), record.end());
+    }
+    std::lock_guard<std::mutex> fidGuard(_fidLock);
+    entry.directoryOffset = offset + output.size();
+    entry.directorySerial = position.getSerial();
+}
+
+ReadResponse
+RamFileServer::read(const ReadRequest& request) {
+    auto& entry = lookup(request.getFid());
+    if (!entry.open || !allowsReading(entry.mode)) {
+        throw Exception("fid not open for reading");
+    }
+    ReadResponse response;
+    auto& output = response.getData();
+    if (entry.node->isDirectory()) {
+        readDirectory(entry, request, output);
+    } else if (entry.subscriber != 0) {
+        // only reached when the caller can't wait, hand out what is queued
+        auto events = entry.node->getEvents()->poll(entry.subscriber, request.getCount());
+        output.assign(events.begin(), events.end());
+    } else {
+        std::shared_lock guard(_fs.getLock());
+        entry.node->getData().read(request.getOffset(), request.getCount(), output);
+    }
+    return response;
+}
+
+WriteResponse
+RamFileServer::write(const WriteRequest& request) {
+    auto& entry = lookup(request.getFid());
+    if (!entry.open || !allowsWriting(entry.mode)) {
+        throw Exception("fid not open for writing");
+    } else if (entry.node->isDirectory()) {
+        throw Exception("is a directory");
+    }
+    if (auto& events = entry.node->getEvents(); events) {
+        const auto& data = request.getData();
+        events->publish(std::string(data.begin(), data.end()));
+        WriteResponse response;
+        response.setCount(data.size());
+        return response;
+    }
+    std::unique_lock guard(_fs.getLock());
+    auto& node = *entry.node;
+    auto offset = request.getOffset();
+    if (hasMode(node.getMode(), FileMode::AppendOnly)) {
+        offset = node.getData().length();
+    }
+    node.getData().write(offset, request.getData());
+    node.modified(entry.user);
+    WriteResponse response;
+    response.setCount(request.getData().size());
+    return response;
+}
+
+void
+RamFileServer::removeNode(const RamNode::Pointer& node, const std::string& user) {
+    std::unique_lock guard(_fs.getLock());
+    if (auto parent = node->getParent(); !parent) {
+        throw Exception("cannot remove root");
+    } else if (!permits(*parent, user, writeAccess)) {
+        throw Exception("permission denied");
+    }
+    _fs.unlink(node, user);
+}
+
+ClunkResponse
+RamFileServer::clunk(const ClunkRequest& request) {
+    auto entry = take(request.getFid());
+    release(entry);
+    if (entry.open && hasMode(entry.mode, OpenMode::RemoveOnClose)) {
+        try {
+            removeNode(entry.node, entry.user);
+        } catch (Exception&) {
+            // the clunk itself always succeeds
+        }
+    }
+    return ClunkResponse();
+}
+
+RemoveResponse
+RamFileServer::remove(const RemoveRequest& request) {
+    // the fid is clunked even when the remove fails
+    auto entry = take(request.getFid());
+    release(entry);
+    removeNode(entry.node, entry.user);
+    return RemoveResponse();
+}
+
+StatResponse
+RamFileServer::stat(const StatRequest& request) {
+    auto& entry = lookup(request.getFid());
+    MessageStream msg;
+    {
+        std::shared_lock guard(_fs.getLock());
+        msg << entry.node->toStat();
+    }
+    StatResponse response;
+    response.setData(msg.str());
+    return response;
+}
+
+WStatResponse
+RamFileServer::wstat(const WStatRequest& request) {
+    auto& entry = lookup(request.getFid());
+    const auto& changes = request.getStat();
+    std::unique_lock guard(_fs.getLock());
+    auto& node = *entry.node;
+    auto parent = node.getParent();
+    bool owner = entry.user == node.getOwner();
+    // check everything first, a wstat either applies completely or not at all
+    bool rename = !changes.getName().empty() && changes.getName() != node.getName();
+    if (rename) {
+        if (!parent) {
+            throw Exception("cannot rename root");
+        } else if (!permits(*parent, entry.user, writeAccess)) {
+            throw Exception("permission denied");
+        } else if (parent->find(changes.getName())) {
+            throw Exception("file already exists");
+        } else if (changes.getName() == "." || changes.getName() == ".." || changes.getName().find('/') != std::string::npos) {
+            throw Exception("illegal name");
+        }
+    }
+    if (changes.getLength() != dontTouch64) {
+        if (node.isDirectory() && changes.getLength() != 0) {
+            throw Exception("cannot change the length of a directory");
+        } else if (!permits(node, entry.user, writeAccess)) {
+            throw Exception("permission denied");
+        }
+    }
+    if (changes.getPermissions() != dontTouch32) {
+        if (!owner) {
+            throw Exception("permission denied");
+        } else if (hasMode(changes.getPermissions(), FileMode::Directory) != node.isDirectory()) {
+            throw Exception("cannot change the directory bit");
+        }
+    }
+    if (changes.getLastModificationTime() != dontTouch32 && !owner) {
+        throw Exception("permission denied");
+    }
+    if (!changes.getGroup().empty() && changes.getGroup() != node.getGroup() && !owner) {
+        throw Exception("permission denied");
+    }
+    if (!changes.getOwner().empty() && changes.getOwner() != node.getOwner()) {
+        throw Exception("cannot change the owner");
+    }
+    if (changes.getLength() != dontTouch64 && changes.getLength() > ExtentStorage::maximumLength) {
+        // checked up front so nothing is changed
+        throw Exception("file too large");
+    }
+    if (rename) {
+        auto self = parent->find(node.getName());
+        parent->getChildren().erase(node.getName());
+        node._name = changes.getName();
+        parent->getChildren().insert(node._name, self, node.recordSize());
+        parent->modified(entry.user);
+    }
+    if (changes.getLength() != dontTouch64 && !node.isDirectory()) {
+        node.getData().truncate(changes.getLength());
+        node.modified(entry.user);
+    }
+    if (changes.getPermissions() != dontTouch32) {
+        node._mode = changes.getPermissions();
+        node._qid.setType(qidTypeOf(node._mode));
+    }
+    if (changes.getLastModificationTime() != dontTouch32) {
+        node._mtime = changes.getLastModificationTime();
+    }
+    if (!changes.getGroup().empty()) {
+        node._gid = changes.getGroup();
+        node.refreshRecord();
+    }
+    if (!changes.changesNothing()) {
+        // the stat of a file only changes along with its version, caches
+        // depend on it
+        node._qid.setVersion(node._qid.getVersion() + 1);
+    }
+    return WStatResponse();
+}
+
+} // end namespace kzr
@@ -0,0 +1,231 @@
+/**
+ * @file
+ * In memory file tree and the backend which serves it
+ * @copyright
+ * libkzr
+ * Copyright (c) 2019, Joshua Scoggins 
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR 
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef KZR_RAM_FILE_SYSTEM_H__
+#define KZR_RAM_FILE_SYSTEM_H__
+#include <cstdint>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "Message.h"
+#include "Backend.h"
+#include "ExtentStorage.h"
+#include "DirectoryIndex.h"
+#include "EventChannel.h"
+#include "AccessPermissions.h"
+
+namespace kzr {
+
+/**
+ * A single file or directory of a RamFileSystem
+ */
+class RamNode {
+    public:
+        using Pointer = std::shared_ptr<RamNode>;
+        using Children = DirectoryIndex<Pointer>;
+    public:
+        /**
+         * @param budget what the contents of the file are charged to
+         */
+        RamNode(uint64_t path, const std::string& name, uint32_t mode, const std::string& owner, const std::string& group, StorageBudget* budget = nullptr);
+        bool isDirectory() const noexcept { return hasMode(_mode, FileMode::Directory); }
+        const Qid& getQid() const noexcept { return _qid; }
+        const std::string& getName() const noexcept { return _name; }
+        constexpr auto getMode() const noexcept { return _mode; }
+        const std::string& getOwner() const noexcept { return _uid; }
+        const std::string& getGroup() const noexcept { return _gid; }
+        uint64_t length() const noexcept { return isDirectory() ? 0 : _data.length(); }
+        Pointer getParent() const noexcept { return _parent.lock(); }
+        Children& getChildren() noexcept { return _children; }
+        const Children& getChildren() const noexcept { return _children; }
+        /**
+         * The channel of an event file, nullptr for ordinary files
+         */
+        const std::shared_ptr<EventChannel>& getEvents() const noexcept { return _events; }
+        ExtentStorage& getData() noexcept { return _data; }
+        const ExtentStorage& getData() const noexcept { return _data; }
+        Pointer find(const std::string& name) const;
+        /**
+         * Record a modification made by the given user, bumps the qid
+         * version.
+         */
+        void modified(const std::string& user);
+        Stat toStat() const;
+        /**
+         * The number of bytes toStat takes up once encoded
+         */
+        size_t recordSize() const noexcept;
+    private:
+        /**
+         * Tell the parent directory about a change in the encoded size
+         */
+        void refreshRecord();
+    private:
+        friend class RamFileSystem;
+        friend class RamFileServer;
+        Qid _qid;
+        std::string _name;
+        uint32_t _mode;
+        uint32_t _atime;
+        uint32_t _mtime;
+        std::string _uid;
+        std::string _gid;
+        std::string _muid;
+        std::weak_ptr<RamNode> _parent;
+        Children _children;
+        ExtentStorage _data;
+        std::shared_ptr<EventChannel> _events;
+};
+
+/**
+ * A file tree held entirely in memory. The tree is shared by every
+ * connection serving it (each one gets its own RamFileServer) and is guarded
+ * by a reader/writer lock.
+ */
+class RamFileSystem {
+    public:
+        /**
+         * The most bytes of file contents held at once by default
+         */
+        static constexpr uint64_t defaultCapacity = uint64_t(1) << 30;
+    public:
+        explicit RamFileSystem(const std::string& owner = "none", uint32_t rootPermissions = 0777, uint64_t capacity = defaultCapacity);
+        RamNode::Pointer getRoot() const noexcept { return _root; }
+        /**
+         * What the contents of every file are charged to, writes which
+         * would take it over its limit fail
+         */
+        StorageBudget& getBudget() noexcept { return _budget; }
+        std::shared_mutex& getLock() noexcept { return _lock; }
+        /**
+         * Add a new file or directory to the given directory, the caller
+         * must hold the lock exclusively.
+         */
+        RamNode::Pointer add(const RamNode::Pointer& directory, const std::string& name, uint32_t mode, const std::string& owner);
+        /**
+         * Detach a node from its parent, the caller must hold the lock
+         * exclusively.
+         */
+        void unlink(const RamNode::Pointer& node, const std::string& user);
+        /**
+         * Convenience function to populate a tree before serving it
+         */
+        RamNode::Pointer makeFile(const std::string& path, const std::string& contents = "", uint32_t permissions = 0644);
+        RamNode::Pointer makeDirectory(const std::string& path, uint32_t permissions = 0755);
+        /**
+         * Make a file every reader of which gets the events published to the
+         * returned channel, writing to the file publishes as well.
+         */
+        std::shared_ptr<EventChannel> makeEventFile(const std::string& path, uint32_t permissions = 0644, size_t backlog = EventChannel::defaultBacklog);
+    private:
+        RamNode::Pointer makePath(const std::string& path, uint32_t mode);
+    private:
+        std::string _owner;
+        StorageBudget _budget;
+        std::atomic<uint64_t> _nextPath { 0 };
+        RamNode::Pointer _root;
+        std::shared_mutex _lock;
+};
+
+/**
+ * Serves a RamFileSystem to a single connection
+ */
+class RamFileServer : public Backend {
+    public:
+        explicit RamFileServer(RamFileSystem& fs);
+        ~RamFileServer() override;
+        AttachResponse attach(const AttachRequest&) override;
+        WalkResponse walk(const WalkRequest&) override;
+        OpenResponse open(const OpenRequest&) override;
+        CreateResponse create(const CreateRequest&) override;
+        ReadResponse read(const ReadRequest&) override;
+        WriteResponse write(const WriteRequest&) override;
+        ClunkResponse clunk(const ClunkRequest&) override;
+        RemoveResponse remove(const RemoveRequest&) override;
+        StatResponse stat(const StatRequest&) override;
+        WStatResponse wstat(const WStatRequest&) override;
+        bool submit(Request&, Responder) override;
+        void flush(uint16_t tag) override;
+        void reset() override;
+        bool identify(uint32_t fid, Qid& qid) override;
+        bool describe(uint32_t fid, Qid& qid) override;
+        bool isConcurrent() const noexcept override { return true; }
+    private:
+        struct FidEntry {
+            RamNode::Pointer node;
+            std::string user;
+            bool open = false;
+            uint8_t mode = 0;
+            /**
+             * The subscription of an open event file, zero otherwise
+             */
+            uint64_t subscriber = 0;
+            /**
+             * The tag of the last read handed to the event channel
+             */
+            uint16_t eventTag = notag;
+            /**
+             * Where the last read of an open directory ended and the serial
+             * of the entry to carry on from, so a listing in progress is
+             * unaffected by entries changing before it
+             */
+            uint64_t directoryOffset = 0;
+            uint64_t directorySerial = 0;
+        };
+        void release(FidEntry& entry);
+        /**
+         * @return nullptr if the fid is not bound
+         */
+        FidEntry* find(uint32_t fid);
+        FidEntry& lookup(uint32_t fid);
+        void bind(uint32_t fid, FidEntry&& entry);
+        bool bound(uint32_t fid);
+        /**
+         * Remove the fid from the table, handing back its entry
+         */
+        FidEntry take(uint32_t fid);
+        static bool permits(const RamNode& node, const std::string& user, uint32_t access) noexcept;
+        void removeNode(const RamNode::Pointer& node, const std::string& user);
+        void readDirectory(FidEntry& entry, const ReadRequest& request, std::vector<uint8_t>& output);
+    private:
+        RamFileSystem& _fs;
+        /**
+         * Guards the table itself, an entry is only ever used by requests
+         * on its own fid (which never overlap) apart from what flush looks
+         * at
+         */
+        std::mutex _fidLock;
+        std::unordered_map<uint32_t, FidEntry> _fids;
+};
+
+} // end namespace kzr
+
+#endif // end KZR_RAM_FILE_SYSTEM_H__
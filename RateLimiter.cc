@@ -0,0 +1,120 @@
+/**
+ * @file
+ * Token bucket limits on the requests and bytes of connections and users
+ * implementation
+ * @copyright
+ * libkzr
+ * Copyright (c) 2019, Joshua Scoggins 
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR 
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "RateLimiter.h"
+#include <algorithm>
+
+namespace kzr {
+
+TokenBucket::TokenBucket(double rate, double burst) : _rate(rate), _capacity(burst > 0 ? burst : rate), _tokens(_capacity), _last(Clock::now()) { }
+
+TokenBucket::Clock::duration
+TokenBucket::take(double amount, Clock::time_point now) {
+    if (_rate <= 0) {
+        return Clock::duration::zero();
+    }
+    if (now > _last) {
+        _tokens = std::min(_capacity, _tokens + std::chrono::duration<double>(now - _last).count() * _rate);
+        _last = now;
+    }
+    _tokens -= amount;
+    if (_tokens >= 0) {
+        return Clock::duration::zero();
+    }
+    return std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(-_tokens / _rate));
+}
+
+RateLimiter::Buckets::Buckets(const Limits& limits) :
+    requests(limits.requestsPerSecond, limits.requestsPerSecond * limits.burst),
+    bytes(limits.bytesPerSecond, limits.bytesPerSecond * limits.burst) { }
+
+RateLimiter::Clock::duration
+RateLimiter::Buckets::take(uint64_t amount, Clock::time_point now) {
+    std::lock_guard<std::mutex> guard(lock);
+    return std::max(requests.take(1, now), bytes.take(double(amount), now));
+}
+
+RateLimiter::Account::Account(RateLimiter& limiter) : _limiter(limiter), _own(limiter.getConnectionLimits()) { }
+
+RateLimiter::Clock::duration
+RateLimiter::Account::charge(uint64_t bytes) {
+    auto now = Clock::now();
+    auto wait = _own.take(bytes, now);
+    if (_user) {
+        wait = std::max(wait, _user->take(bytes, now));
+    }
+    _limiter._requests.fetch_add(1, std::memory_order_relaxed);
+    if (wait > Clock::duration::zero()) {
+        _limiter._throttled.fetch_add(1, std::memory_order_relaxed);
+    }
+    return wait;
+}
+
+void
+RateLimiter::Account::attach(const std::string& uname) {
+    _user = _limiter.userBuckets(uname);
+}
+
+RateLimiter::RateLimiter(const Limits& perConnection) : RateLimiter(perConnection, Limits { }) { }
+
+RateLimiter::RateLimiter(const Limits& perConnection, const Limits& perUser) : _perConnection(perConnection), _perUser(perUser) { }
+
+std::unique_ptr<RateLimiter::Account>
+RateLimiter::open() {
+    return std::make_unique<Account>(*this);
+}
+
+std::shared_ptr<RateLimiter::Buckets>
+RateLimiter::userBuckets(const std::string& uname) {
+    std::lock_guard<std::mutex> guard(_lock);
+    auto& buckets = _users[uname];
+    if (!buckets) {
+        auto limits = _overrides.find(uname);
+        buckets = std::make_shared<Buckets>(limits == _overrides.end() ? _perUser : limits->second);
+    }
+    return buckets;
+}
+
+void
+RateLimiter::setUserLimits(const std::string& uname, const Limits& limits) {
+    std::lock_guard<std::mutex> guard(_lock);
+    _overrides[uname] = limits;
+    // connections attached already hold on to the old buckets
+    _users.erase(uname);
+}
+
+RateLimiter::Statistics
+RateLimiter::getStatistics() const {
+    Statistics stats;
+    stats.requests = _requests.load(std::memory_order_relaxed);
+    stats.throttled = _throttled.load(std::memory_order_relaxed);
+    return stats;
+}
+
+} // end namespace kzr
@@ -0,0 +1,152 @@
+/**
+ * @file
+ * Token bucket limits on the requests and bytes of connections and users
+ * @copyright
+ * libkzr
+ * Copyright (c) 2019, Joshua Scoggins 
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR 
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef KZR_RATE_LIMITER_H__
+#define KZR_RATE_LIMITER_H__
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+namespace kzr {
+
+/**
+ * Tokens trickle in at a fixed rate up to a burst. Taking more than there
+ * are puts the bucket into debt which has to be paid off before the next
+ * take is allowed, so a large take is never refused, only the one after it
+ * is held back.
+ */
+class TokenBucket {
+    public:
+        using Clock = std::chrono::steady_clock;
+    public:
+        /**
+         * @param rate tokens added per second, zero means no limit
+         * @param burst the most tokens held, a second's worth if zero
+         */
+        explicit TokenBucket(double rate = 0, double burst = 0);
+        /**
+         * @return how long until the bucket is out of debt again
+         */
+        Clock::duration take(double amount, Clock::time_point now);
+        constexpr auto getRate() const noexcept { return _rate; }
+    private:
+        double _rate;
+        double _capacity;
+        double _tokens;
+        Clock::time_point _last;
+};
+
+/**
+ * Hands out an account to every connection which charges the requests and
+ * bytes it moves against buckets of its own and, once it has attached,
+ * against buckets shared by every connection of the same user. It can be
+ * shared by the servers of any number of connections.
+ */
+class RateLimiter {
+    public:
+        using Clock = TokenBucket::Clock;
+        struct Limits {
+            /**
+             * Zero means no limit
+             */
+            double requestsPerSecond = 0;
+            double bytesPerSecond = 0;
+            /**
+             * How many seconds worth of requests and bytes can go through
+             * at once
+             */
+            double burst = 1.0;
+        };
+        struct Statistics {
+            uint64_t requests = 0;
+            /**
+             * Requests after which the connection had to wait
+             */
+            uint64_t throttled = 0;
+        };
+    private:
+        struct Buckets {
+            Buckets(const Limits& limits);
+            Clock::duration take(uint64_t bytes, Clock::time_point now);
+            std::mutex lock;
+            TokenBucket requests;
+            TokenBucket bytes;
+        };
+    public:
+        /**
+         * Only touched by the thread reading the connection
+         */
+        class Account {
+            public:
+                Account(RateLimiter& limiter);
+                /**
+                 * Charge a request moving the given number of bytes
+                 * @return how long to wait before reading the next one
+                 */
+                Clock::duration charge(uint64_t bytes);
+                /**
+                 * Charge the user as well from now on
+                 */
+                void attach(const std::string& uname);
+            private:
+                RateLimiter& _limiter;
+                Buckets _own;
+                std::shared_ptr<Buckets> _user;
+        };
+    public:
+        /**
+         * Users get no limits of their own
+         */
+        explicit RateLimiter(const Limits& perConnection);
+        RateLimiter(const Limits& perConnection, const Limits& perUser);
+        std::unique_ptr<Account> open();
+        /**
+         * Give a user limits of their own, connections which attached as
+         * the user already keep their buckets
+         */
+        void setUserLimits(const std::string& uname, const Limits& limits);
+        const Limits& getConnectionLimits() const noexcept { return _perConnection; }
+        Statistics getStatistics() const;
+    private:
+        std::shared_ptr<Buckets> userBuckets(const std::string& uname);
+    private:
+        Limits _perConnection;
+        Limits _perUser;
+        std::mutex _lock;
+        std::unordered_map<std::string, std::shared_ptr<Buckets>> _users;
+        std::unordered_map<std::string, Limits> _overrides;
+        std::atomic<uint64_t> _requests { 0 };
+        std::atomic<uint64_t> _throttled { 0 };
+};
+
+} // end namespace kzr
+
+#endif // end KZR_RATE_LIMITER_H__
@@ -0,0 +1,79 @@
+/**
+ * @file
+ * Shares the result of a read between identical concurrent reads
+ * implementation
+ * @copyright
+ * libkzr
+ * Copyright (c) 2019, Joshua Scoggins 
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR 
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "ReadCoalescer.h"
+
+namespace kzr {
+
+bool
+ReadCoalescer::join(const Key& key, Backend::Responder responder) {
+    std::lock_guard<std::mutex> guard(_lock);
+    auto [it, created] = _flights.try_emplace(key);
+    it->second.emplace_back(std::move(responder));
+    if (created) {
+        ++_stats.leaders;
+    } else {
+        ++_stats.followers;
+    }
+    return created;
+}
+
+void
+ReadCoalescer::finish(const Key& key, const Response& response) {
+    finish(key, EncodedResponse::encode(response));
+}
+
+void
+ReadCoalescer::finish(const Key& key, const EncodedResponse& response) {
+    std::vector<Backend::Responder> waiting;
+    {
+        std::lock_guard<std::mutex> guard(_lock);
+        if (auto it = _flights.find(key); it != _flights.end()) {
+            waiting = std::move(it->second);
+            _flights.erase(it);
+        }
+    }
+    for (auto& responder : waiting) {
+        responder(response);
+    }
+}
+
+size_t
+ReadCoalescer::inFlight() {
+    std::lock_guard<std::mutex> guard(_lock);
+    return _flights.size();
+}
+
+ReadCoalescer::Statistics
+ReadCoalescer::getStatistics() {
+    std::lock_guard<std::mutex> guard(_lock);
+    return _stats;
+}
+
+} // end namespace kzr
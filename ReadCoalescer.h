@@ -0,0 +1,100 @@
+/**
+ * @file
+ * Shares the result of a read between identical concurrent reads
+ * @copyright
+ * libkzr
+ * Copyright (c) 2019, Joshua Scoggins 
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR 
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef KZR_READ_COALESCER_H__
+#define KZR_READ_COALESCER_H__
+#include <cstdint>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include "Message.h"
+#include "Backend.h"
+
+namespace kzr {
+
+/**
+ * Keeps track of the reads which are being carried out right now, keyed by
+ * the qid (path and version) of the file along with the offset and count. A
+ * read which matches one in flight waits for it instead of going to the
+ * backend again; once the first one is done its response is encoded a single
+ * time and handed to every reader which waited on it.
+ *
+ * Nothing is kept once a read is done, this is not a cache. It can be shared
+ * by the servers of any number of connections as long as their backends
+ * agree on what a qid means.
+ */
+class ReadCoalescer {
+    public:
+        struct Key {
+            uint64_t path;
+            uint32_t version;
+            uint64_t offset;
+            uint32_t count;
+            bool operator==(const Key& other) const noexcept {
+                return path == other.path && version == other.version && offset == other.offset && count == other.count;
+            }
+        };
+        struct Statistics {
+            /**
+             * Reads which went to the backend
+             */
+            uint64_t leaders = 0;
+            /**
+             * Reads which were answered with the result of another
+             */
+            uint64_t followers = 0;
+        };
+    public:
+        /**
+         * Wait on the read described by the key, the responder is called
+         * once it is done.
+         * @return true if no such read was in flight, the caller has to carry
+         * it out and call finish with the result
+         */
+        bool join(const Key& key, Backend::Responder responder);
+        /**
+         * Answer every reader waiting on the read
+         */
+        void finish(const Key& key, const Response& response);
+        void finish(const Key& key, const EncodedResponse& response);
+        size_t inFlight();
+        Statistics getStatistics();
+    private:
+        struct KeyHash {
+            size_t operator()(const Key& k) const noexcept {
+                return std::hash<uint64_t>()((k.path * 0x9E3779B97F4A7C15ull) ^ (uint64_t(k.version) << 32) ^ k.offset ^ (uint64_t(k.count) * 0xC2B2AE3D27D4EB4Full));
+            }
+        };
+    private:
+        std::mutex _lock;
+        std::unordered_map<Key, std::vector<Backend::Responder>, KeyHash> _flights;
+        Statistics _stats;
+};
+
+} // end namespace kzr
+
+#endif // end KZR_READ_COALESCER_H__
@@ -0,0 +1,203 @@
+/**
+ * @file
+ * A backend which forwards to another 9p server through a client
+ * implementation
+ * @copyright
+ * libkzr
+ * Copyright (c) 2019, Joshua Scoggins 
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR 
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "RemoteBackend.h"
+#include <algorithm>
+
+namespace kzr {
+
+RemoteBackend::~RemoteBackend() {
+    try {
+        reset();
+    } catch (...) {
+        // the connection is most likely gone already
+    }
+}
+
+uint32_t
+RemoteBackend::lookup(uint32_t fid) const {
+    if (auto it = _fids.find(fid); it != _fids.end()) {
+        return it->second;
+    } else {
+        throw Exception("unknown fid");
+    }
+}
+
+uint32_t
+RemoteBackend::bind(uint32_t fid) {
+    if (_fids.count(fid) != 0) {
+        throw Exception("fid already in use");
+    }
+    auto remote = _client.allocateFid();
+    _fids.emplace(fid, remote);
+    return remote;
+}
+
+void
+RemoteBackend::release(uint32_t fid) {
+    if (auto it = _fids.find(fid); it != _fids.end()) {
+        _client.releaseFid(it->second);
+        _fids.erase(it);
+    }
+}
+
+uint32_t
+RemoteBackend::largestPayload() const noexcept {
+    return _client.getMsize() - Client::ioHeaderSize;
+}
+
+AuthenticationResponse
+RemoteBackend::auth(const AuthenticationRequest& request) {
+    auto req = request;
+    req.setAuthenticationHandle(bind(request.getAuthenticationHandle()));
+    try {
+        return _client.call<ConceptualOperation::Auth>(req);
+    } catch (...) {
+        release(request.getAuthenticationHandle());
+        throw;
+    }
+}
+
+AttachResponse
+RemoteBackend::attach(const AttachRequest& request) {
+    auto req = request;
+    if (request.getAuthenticationHandle() != Client::nofid) {
+        req.setAuthenticationHandle(lookup(request.getAuthenticationHandle()));
+    }
+    req.setFid(bind(request.getFid()));
+    try {
+        return _client.call<ConceptualOperation::Attach>(req);
+    } catch (...) {
+        release(request.getFid());
+        throw;
+    }
+}
+
+WalkResponse
+RemoteBackend::walk(const WalkRequest& request) {
+    auto req = request;
+    req.setFid(lookup(request.getFid()));
+    if (request.getNewFid() == request.getFid()) {
+        // the remote fid only moves if the whole walk succeeds, just like ours
+        req.setNewFid(req.getFid());
+        return _client.call<ConceptualOperation::Walk>(req);
+    }
+    req.setNewFid(bind(request.getNewFid()));
+    try {
+        auto response = _client.call<ConceptualOperation::Walk>(req);
+        if (response.getWqid().size() != request.getWname().size()) {
+            release(request.getNewFid());
+        }
+        return response;
+    } catch (...) {
+        release(request.getNewFid());
+        throw;
+    }
+}
+
+OpenResponse
+RemoteBackend::open(const OpenRequest& request) {
+    auto req = request;
+    req.setFid(lookup(request.getFid()));
+    return _client.call<ConceptualOperation::Open>(req);
+}
+
+CreateResponse
+RemoteBackend::create(const CreateRequest& request) {
+    auto req = request;
+    req.setFid(lookup(request.getFid()));
+    return _client.call<ConceptualOperation::Create>(req);
+}
+
+ReadResponse
+RemoteBackend::read(const ReadRequest& request) {
+    auto req = request;
+    req.setFid(lookup(request.getFid()));
+    req.setCount(std::min(request.getCount(), largestPayload()));
+    return _client.call<ConceptualOperation::Read>(req);
+}
+
+WriteResponse
+RemoteBackend::write(const WriteRequest& request) {
+    auto req = request;
+    req.setFid(lookup(request.getFid()));
+    if (auto& data = req.getData(); data.size() > largestPayload()) {
+        data.resize(largestPayload());
+    }
+    return _client.call<ConceptualOperation::Write>(req);
+}
+
+ClunkResponse
+RemoteBackend::clunk(const ClunkRequest& request) {
+    auto req = request;
+    req.setFid(lookup(request.getFid()));
+    // the fid is gone whether or not the clunk succeeds
+    release(request.getFid());
+    return _client.call<ConceptualOperation::Clunk>(req);
+}
+
+RemoveResponse
+RemoteBackend::remove(const RemoveRequest& request) {
+    auto req = request;
+    req.setFid(lookup(request.getFid()));
+    release(request.getFid());
+    return _client.call<ConceptualOperation::Remove>(req);
+}
+
+StatResponse
+RemoteBackend::stat(const StatRequest& request) {
+    auto req = request;
+    req.setFid(lookup(request.getFid()));
+    return _client.call<ConceptualOperation::Stat>(req);
+}
+
+WStatResponse
+RemoteBackend::wstat(const WStatRequest& request) {
+    auto req = request;
+    req.setFid(lookup(request.getFid()));
+    return _client.call<ConceptualOperation::WStat>(req);
+}
+
+void
+RemoteBackend::reset() {
+    auto fids = std::move(_fids);
+    _fids.clear();
+    for (const auto& [fid, remote] : fids) {
+        ClunkRequest req;
+        req.setFid(remote);
+        _client.releaseFid(remote);
+        try {
+            _client.call<ConceptualOperation::Clunk>(req);
+        } catch (Exception&) {
+            // forgotten either way
+        }
+    }
+}
+
+} // end namespace kzr
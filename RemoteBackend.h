@@ -0,0 +1,79 @@
+/**
+ * @file
+ * A backend which forwards to another 9p server through a client
+ * @copyright
+ * libkzr
+ * Copyright (c) 2019, Joshua Scoggins 
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR 
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef KZR_REMOTE_BACKEND_H__
+#define KZR_REMOTE_BACKEND_H__
+#include <cstdint>
+#include <unordered_map>
+#include "Backend.h"
+#include "Client.h"
+
+namespace kzr {
+
+/**
+ * Carries out every operation on a remote server via a client which has
+ * already negotiated the version. The fids of the caller are mapped onto
+ * fids allocated from the client, so the client can still be used for
+ * other things from the same thread. Reads and writes larger than the msize
+ * of the client allows are cut short, which the protocol permits.
+ */
+class RemoteBackend : public Backend {
+    public:
+        explicit RemoteBackend(Client& client) : _client(client) { }
+        ~RemoteBackend() override;
+        AuthenticationResponse auth(const AuthenticationRequest&) override;
+        AttachResponse attach(const AttachRequest&) override;
+        WalkResponse walk(const WalkRequest&) override;
+        OpenResponse open(const OpenRequest&) override;
+        CreateResponse create(const CreateRequest&) override;
+        ReadResponse read(const ReadRequest&) override;
+        WriteResponse write(const WriteRequest&) override;
+        ClunkResponse clunk(const ClunkRequest&) override;
+        RemoveResponse remove(const RemoveRequest&) override;
+        StatResponse stat(const StatRequest&) override;
+        WStatResponse wstat(const WStatRequest&) override;
+        /**
+         * Clunks every fid still held on the remote server
+         */
+        void reset() override;
+        Client& getClient() noexcept { return _client; }
+    private:
+        uint32_t lookup(uint32_t fid) const;
+        /**
+         * Map a fid of the caller onto a new fid of the client
+         */
+        uint32_t bind(uint32_t fid);
+        void release(uint32_t fid);
+        uint32_t largestPayload() const noexcept;
+    private:
+        Client& _client;
+        std::unordered_map<uint32_t, uint32_t> _fids;
+};
+
+} // end namespace kzr
+
+#endif // end KZR_REMOTE_BACKEND_H__
@@ -0,0 +1,255 @@
+/**
+ * @file
+ * Runs requests on a pool of workers while keeping them in order per fid
+ * implementation
+ * @copyright
+ * libkzr
+ * Copyright (c) 2019, Joshua Scoggins 
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR 
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "RequestScheduler.h"
+#include <exception>
+
+namespace kzr {
+
+namespace {
+// lets jobs which schedule more work keep it on their own worker
+thread_local const RequestScheduler* currentScheduler = nullptr;
+thread_local size_t currentWorker = 0;
+} // end namespace
+
+RequestScheduler::RequestScheduler(size_t workers, size_t batch) : _batch(batch == 0 ? 1 : batch) {
+    if (workers == 0) {
+        workers = 1;
+    }
+    for (size_t i = 0; i < workers; ++i) {
+        _workers.emplace_back(std::make_unique<Worker>());
+    }
+    for (size_t i = 0; i < workers; ++i) {
+        _workers[i]->thread = std::thread([this, i]() { run(i); });
+    }
+}
+
+RequestScheduler::~RequestScheduler() {
+    {
+        std::lock_guard<std::mutex> guard(_idleLock);
+        _stopping = true;
+    }
+    _idle.notify_all();
+    for (auto& worker : _workers) {
+        worker->thread.join();
+    }
+}
+
+size_t
+RequestScheduler::target() noexcept {
+    if (currentScheduler == this) {
+        return currentWorker;
+    }
+    return _next++ % _workers.size();
+}
+
+void
+RequestScheduler::schedule(uint64_t key, Job job, Priority priority) {
+    QueuePtr ready;
+    {
+        auto& stripe = stripeOf(key);
+        std::lock_guard<std::mutex> guard(stripe.lock);
+        auto& queue = stripe.queues[key];
+        if (!queue) {
+            queue = std::make_shared<SerialQueue>();
+            queue->key = key;
+        }
+        queue->jobs.emplace_back(Pending { std::move(job), priority });
+        // a queue which is queued already picks the job up in order
+        if (!queue->queued) {
+            queue->queued = true;
+            queue->priority = priority;
+            ready = queue;
+        }
+    }
+    ++_scheduled;
+    if (ready) {
+        push(target(), std::move(ready));
+    }
+}
+
+void
+RequestScheduler::push(size_t index, QueuePtr queue) {
+    {
+        auto& worker = *_workers[index];
+        if (queue->priority == Priority::Bulk) {
+            queue->since = Clock::now();
+        }
+        std::lock_guard<std::mutex> guard(worker.lock);
+        worker.line(queue->priority).emplace_back(std::move(queue));
+    }
+    {
+        std::lock_guard<std::mutex> guard(_idleLock);
+        ++_ready;
+    }
+    _idle.notify_one();
+}
+
+RequestScheduler::QueuePtr
+RequestScheduler::pop(size_t index, size_t from, Priority priority) {
+    auto& victim = *_workers[from];
+    std::lock_guard<std::mutex> guard(victim.lock);
+    auto& line = victim.line(priority);
+    if (line.empty()) {
+        return nullptr;
+    }
+    QueuePtr queue;
+    if (from == index) {
+        queue = std::move(line.front());
+        line.pop_front();
+    } else {
+        // the back is what the victim would get to last
+        queue = std::move(line.back());
+        line.pop_back();
+        ++_workers[index]->steals;
+    }
+    return queue;
+}
+
+RequestScheduler::QueuePtr
+RequestScheduler::take(size_t index) {
+    auto& own = *_workers[index];
+    bool aged = false;
+    bool due = false;
+    {
+        std::lock_guard<std::mutex> guard(own.lock);
+        aged = !own.bulk.empty() && Clock::now() - own.bulk.front()->since >= _maximumBulkWait.load();
+        due = aged || own.urgentRun >= _urgentWeight;
+    }
+    // urgent work goes first, even if it has to be stolen, unless bulk work
+    // is due
+    auto first = due ? Priority::Bulk : Priority::Urgent;
+    auto second = due ? Priority::Urgent : Priority::Bulk;
+    QueuePtr queue;
+    for (auto priority : { first, second }) {
+        for (size_t i = 0; !queue && i < _workers.size(); ++i) {
+            queue = pop(index, (index + i) % _workers.size(), priority);
+        }
+        if (queue) {
+            if (priority == Priority::Bulk) {
+                own.urgentRun = 0;
+                if (aged) {
+                    ++own.aged;
+                }
+            } else if (due) {
+                // there was no bulk work anywhere
+                own.urgentRun = 0;
+            } else {
+                ++own.urgentRun;
+            }
+            break;
+        }
+    }
+    if (queue) {
+        std::lock_guard<std::mutex> guard(_idleLock);
+        --_ready;
+    }
+    return queue;
+}
+
+bool
+RequestScheduler::retire(Stripe& stripe, const QueuePtr& queue) {
+    if (!queue->jobs.empty()) {
+        return false;
+    }
+    queue->queued = false;
+    stripe.queues.erase(queue->key);
+    return true;
+}
+
+bool
+RequestScheduler::runBatch(Worker& worker, const QueuePtr& queue) {
+    auto& stripe = stripeOf(queue->key);
+    for (size_t i = 0; i < _batch; ++i) {
+        Pending pending;
+        {
+            std::lock_guard<std::mutex> guard(stripe.lock);
+            if (retire(stripe, queue)) {
+                return false;
+            }
+            // a bulk queue gets one job per turn, and a queue whose next job
+            // is of another priority goes back in the other line
+            if (i != 0 && (queue->priority == Priority::Bulk || queue->jobs.front().priority != queue->priority)) {
+                break;
+            }
+            pending = std::move(queue->jobs.front());
+            queue->jobs.pop_front();
+        }
+        try {
+            pending.job();
+        } catch (std::exception&) {
+            // the job is responsible for reporting its own failures
+        }
+        ++worker.executed;
+        if (pending.priority == Priority::Bulk) {
+            ++worker.bulkExecuted;
+        }
+    }
+    std::lock_guard<std::mutex> guard(stripe.lock);
+    if (retire(stripe, queue)) {
+        return false;
+    }
+    queue->priority = queue->jobs.front().priority;
+    return true;
+}
+
+void
+RequestScheduler::run(size_t index) {
+    currentScheduler = this;
+    currentWorker = index;
+    auto& worker = *_workers[index];
+    while (true) {
+        if (auto queue = take(index); queue) {
+            if (runBatch(worker, queue)) {
+                push(index, std::move(queue));
+            }
+            continue;
+        }
+        std::unique_lock<std::mutex> guard(_idleLock);
+        _idle.wait(guard, [this]() { return _ready != 0 || _stopping; });
+        if (_ready == 0 && _stopping) {
+            return;
+        }
+    }
+}
+
+RequestScheduler::Statistics
+RequestScheduler::getStatistics() const {
+    Statistics stats;
+    stats.scheduled = _scheduled;
+    for (const auto& worker : _workers) {
+        stats.executed += worker->executed;
+        stats.steals += worker->steals;
+        stats.bulk += worker->bulkExecuted;
+        stats.aged += worker->aged;
+    }
+    return stats;
+}
+
+} // end namespace kzr
@@ -0,0 +1,211 @@
+/**
+ * @file
+ * Runs requests on a pool of workers while keeping them in order per fid
+ * @copyright
+ * libkzr
+ * Copyright (c) 2019, Joshua Scoggins 
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR 
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef KZR_REQUEST_SCHEDULER_H__
+#define KZR_REQUEST_SCHEDULER_H__
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace kzr {
+
+/**
+ * Runs jobs on a fixed set of workers. Jobs are scheduled under a key (the
+ * server uses one per fid); jobs with the same key run one at a time in the
+ * order they were scheduled, jobs with different keys run in parallel.
+ *
+ * The jobs of a key make up a serial queue. Each worker keeps a deque of
+ * the serial queues which have work and runs them from the front, a worker
+ * with nothing left to do steals a whole serial queue from the back of
+ * another one. A serial queue goes to the back of the line after running a
+ * batch of jobs so a busy key can't hold on to a worker forever.
+ *
+ * Jobs are either urgent or bulk and a serial queue waits in the line of
+ * the job at its front. Workers prefer urgent queues, stealing them from
+ * each other before turning to bulk work, but run a bulk queue after every
+ * few urgent ones and run any bulk queue which has waited too long ahead of
+ * everything else so bulk work is never starved. A bulk queue runs a single
+ * job per turn.
+ */
+class RequestScheduler {
+    public:
+        using Job = std::function<void()>;
+        using Clock = std::chrono::steady_clock;
+        enum class Priority : uint8_t {
+            Urgent,
+            Bulk,
+        };
+        static constexpr size_t defaultWorkerCount = 4;
+        static constexpr size_t defaultBatch = 16;
+        static constexpr size_t defaultUrgentWeight = 8;
+        static constexpr std::chrono::milliseconds defaultMaximumBulkWait { 20 };
+        struct Statistics {
+            uint64_t scheduled = 0;
+            uint64_t executed = 0;
+            /**
+             * Serial queues taken from the deque of another worker
+             */
+            uint64_t steals = 0;
+            uint64_t bulk = 0;
+            /**
+             * Bulk queues run ahead of urgent ones because they had waited
+             * too long
+             */
+            uint64_t aged = 0;
+        };
+    public:
+        /**
+         * @param batch the most jobs run from a serial queue at a time
+         */
+        explicit RequestScheduler(size_t workers = defaultWorkerCount, size_t batch = defaultBatch);
+        /**
+         * Runs every job which has been scheduled before returning
+         */
+        ~RequestScheduler();
+        RequestScheduler(const RequestScheduler&) = delete;
+        RequestScheduler& operator=(const RequestScheduler&) = delete;
+        /**
+         * Run the job once every job scheduled before it under the same key
+         * is done. Exceptions thrown by jobs are swallowed.
+         */
+        void schedule(uint64_t key, Job job, Priority priority = Priority::Urgent);
+        auto getWorkerCount() const noexcept { return _workers.size(); }
+        /**
+         * The number of urgent queues a worker runs for every bulk one when
+         * both are waiting
+         */
+        void setUrgentWeight(size_t weight) noexcept { _urgentWeight = weight == 0 ? 1 : weight; }
+        size_t getUrgentWeight() const noexcept { return _urgentWeight; }
+        /**
+         * How long a bulk queue waits behind urgent ones at most
+         */
+        void setMaximumBulkWait(Clock::duration wait) noexcept { _maximumBulkWait = wait; }
+        Clock::duration getMaximumBulkWait() const noexcept { return _maximumBulkWait; }
+        Statistics getStatistics() const;
+    private:
+        struct Pending {
+            Job job;
+            Priority priority = Priority::Urgent;
+        };
+        struct SerialQueue {
+            uint64_t key = 0;
+            std::deque<Pending> jobs;
+            /**
+             * Sitting in the deque of a worker or being run by one
+             */
+            bool queued = false;
+            /**
+             * The line it waits in, only touched by whoever queued it
+             */
+            Priority priority = Priority::Urgent;
+            Clock::time_point since;
+        };
+        using QueuePtr = std::shared_ptr<SerialQueue>;
+        /**
+         * The serial queues are spread over several maps so that scheduling
+         * under different keys rarely contends
+         */
+        struct Stripe {
+            std::mutex lock;
+            std::unordered_map<uint64_t, QueuePtr> queues;
+        };
+        static constexpr size_t stripeCount = 64;
+        struct alignas(64) Worker {
+            std::mutex lock;
+            std::deque<QueuePtr> urgent;
+            std::deque<QueuePtr> bulk;
+            /**
+             * Urgent queues run since the last bulk one
+             */
+            size_t urgentRun = 0;
+            std::thread thread;
+            std::atomic<uint64_t> executed { 0 };
+            std::atomic<uint64_t> steals { 0 };
+            std::atomic<uint64_t> bulkExecuted { 0 };
+            std::atomic<uint64_t> aged { 0 };
+            std::deque<QueuePtr>& line(Priority priority) noexcept { return priority == Priority::Bulk ? bulk : urgent; }
+        };
+    private:
+        void run(size_t index);
+        /**
+         * Hand a serial queue with work to a worker
+         */
+        void push(size_t worker, QueuePtr queue);
+        /**
+         * The next serial queue for the worker, stolen if it has none
+         * @return nullptr if there is nothing to do anywhere
+         */
+        QueuePtr take(size_t index);
+        /**
+         * Pop a serial queue of the given priority from the worker, stolen
+         * ones come from the back
+         */
+        QueuePtr pop(size_t index, size_t from, Priority priority);
+        /**
+         * Run a batch of jobs from the serial queue
+         * @return true if jobs are left, the queue stays owned by the caller
+         */
+        bool runBatch(Worker& worker, const QueuePtr& queue);
+        /**
+         * Forget the serial queue if it has run dry
+         * @return true if it had
+         */
+        bool retire(Stripe& stripe, const QueuePtr& queue);
+        Stripe& stripeOf(uint64_t key) noexcept { return _stripes[key % stripeCount]; }
+        /**
+         * The worker calling, or the next one in turn for anyone else
+         */
+        size_t target() noexcept;
+    private:
+        size_t _batch;
+        std::atomic<size_t> _urgentWeight { defaultUrgentWeight };
+        std::atomic<Clock::duration> _maximumBulkWait { defaultMaximumBulkWait };
+        std::array<Stripe, stripeCount> _stripes;
+        std::vector<std::unique_ptr<Worker>> _workers;
+        std::mutex _idleLock;
+        std::condition_variable _idle;
+        /**
+         * The number of serial queues sitting in the deques of workers
+         */
+        size_t _ready = 0;
+        bool _stopping = false;
+        std::atomic<size_t> _next { 0 };
+        std::atomic<uint64_t> _scheduled { 0 };
+};
+
+} // end namespace kzr
+
+#endif // end KZR_REQUEST_SCHEDULER_H__
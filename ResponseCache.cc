@@ -0,0 +1,167 @@
+/**
+ * @file
+ * Server side cache of encoded responses implementation
+ * @copyright
+ * libkzr
+ * Copyright (c) 2019, Joshua Scoggins 
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR 
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "ResponseCache.h"
+#include <vector>
+
+namespace kzr {
+
+namespace {
+// what an entry costs beyond its bytes, the key, the list node and the
+// bookkeeping of the maps
+constexpr size_t entryOverhead = 128;
+} // end namespace
+
+ResponseCache::ResponseCache(size_t capacity, size_t maximumEntrySize) : _capacity(capacity), _maximumEntrySize(maximumEntrySize) { }
+
+std::optional<EncodedResponse>
+ResponseCache::findRead(const Qid& qid, uint64_t offset, uint32_t count) {
+    return find(qid, Key { qid.getPath(), offset, count, false });
+}
+
+void
+ResponseCache::insertRead(const Qid& qid, uint64_t offset, uint32_t count, const EncodedResponse& response) {
+    insert(qid, Key { qid.getPath(), offset, count, false }, response);
+}
+
+std::optional<EncodedResponse>
+ResponseCache::findStat(const Qid& qid) {
+    return find(qid, Key { qid.getPath(), 0, 0, true });
+}
+
+void
+ResponseCache::insertStat(const Qid& qid, const EncodedResponse& response) {
+    insert(qid, Key { qid.getPath(), 0, 0, true }, response);
+}
+
+std::optional<EncodedResponse>
+ResponseCache::find(const Qid& qid, const Key& key) {
+    std::lock_guard<std::mutex> guard(_lock);
+    observe(qid);
+    if (auto it = _entries.find(key); it == _entries.end()) {
+        ++_stats.misses;
+        return std::nullopt;
+    } else {
+        ++_stats.hits;
+        _order.splice(_order.begin(), _order, it->second.position);
+        return it->second.response;
+    }
+}
+
+void
+ResponseCache::insert(const Qid& qid, const Key& key, const EncodedResponse& response) {
+    if (!response.body) {
+        return;
+    }
+    auto charge = response.body->length() + entryOverhead;
+    if (response.body->length() > _maximumEntrySize || charge > _capacity) {
+        return;
+    }
+    std::lock_guard<std::mutex> guard(_lock);
+    observe(qid);
+    erase(key);
+    while (_size + charge > _capacity && !_order.empty()) {
+        ++_stats.evictions;
+        // erase frees the node holding the key so work from a copy
+        auto oldest = _order.back();
+        erase(oldest);
+    }
+    _order.emplace_front(key);
+    _entries.emplace(key, Entry { response, charge, _order.begin() });
+    _size += charge;
+    auto& file = _files[key.path];
+    file.version = qid.getVersion();
+    file.keys.emplace(key);
+}
+
+void
+ResponseCache::observe(const Qid& qid) {
+    if (auto file = _files.find(qid.getPath()); file != _files.end() && file->second.version != qid.getVersion()) {
+        ++_stats.invalidations;
+        dropPath(qid.getPath());
+    }
+}
+
+void
+ResponseCache::erase(const Key& key) {
+    if (auto it = _entries.find(key); it != _entries.end()) {
+        _size -= it->second.charge;
+        _order.erase(it->second.position);
+        _entries.erase(it);
+        if (auto file = _files.find(key.path); file != _files.end()) {
+            file->second.keys.erase(key);
+            if (file->second.keys.empty()) {
+                _files.erase(file);
+            }
+        }
+    }
+}
+
+void
+ResponseCache::dropPath(uint64_t path) {
+    if (auto file = _files.find(path); file != _files.end()) {
+        // erase modifies the set so work from a copy
+        std::vector<Key> keys(file->second.keys.begin(), file->second.keys.end());
+        for (const auto& key : keys) {
+            erase(key);
+        }
+        _files.erase(path);
+    }
+}
+
+void
+ResponseCache::invalidate(uint64_t path) {
+    std::lock_guard<std::mutex> guard(_lock);
+    if (_files.count(path) != 0) {
+        ++_stats.invalidations;
+        dropPath(path);
+    }
+}
+
+void
+ResponseCache::clear() {
+    std::lock_guard<std::mutex> guard(_lock);
+    _entries.clear();
+    _files.clear();
+    _order.clear();
+    _size = 0;
+}
+
+size_t
+ResponseCache::size() {
+    std::lock_guard<std::mutex> guard(_lock);
+    return _size;
+}
+
+ResponseCache::Statistics
+ResponseCache::getStatistics() {
+    std::lock_guard<std::mutex> guard(_lock);
+    return _stats;
+}
+
+} // end namespace kzr
@@ -0,0 +1,126 @@
+/**
+ * @file
+ * Server side cache of encoded responses
+ * @copyright
+ * libkzr
+ * Copyright (c) 2019, Joshua Scoggins 
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR 
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef KZR_RESPONSE_CACHE_H__
+#define KZR_RESPONSE_CACHE_H__
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <optional>
+#include <unordered_map>
+#include <unordered_set>
+#include "Message.h"
+#include "Interaction.h"
+
+namespace kzr {
+
+/**
+ * Keeps the encoded bodies of Rread and Rstat responses so that answering the
+ * same request again only takes framing the cached body with a new tag.
+ * Reads are keyed by the qid path and version of the file along with the
+ * offset and count, stats by the qid path and version alone. Seeing another
+ * version for a path drops everything held for it.
+ *
+ * The bytes held are capped, least recently used entries go first. It can be
+ * shared by the servers of any number of connections.
+ */
+class ResponseCache {
+    public:
+        static constexpr size_t defaultCapacity = 64 * 1024 * 1024;
+        static constexpr size_t defaultMaximumEntrySize = 1024 * 1024;
+        struct Statistics {
+            uint64_t hits = 0;
+            uint64_t misses = 0;
+            uint64_t evictions = 0;
+            uint64_t invalidations = 0;
+        };
+    public:
+        /**
+         * @param capacity the number of bytes of responses held at most
+         * @param maximumEntrySize responses larger than this are not kept
+         */
+        explicit ResponseCache(size_t capacity = defaultCapacity, size_t maximumEntrySize = defaultMaximumEntrySize);
+        std::optional<EncodedResponse> findRead(const Qid& qid, uint64_t offset, uint32_t count);
+        void insertRead(const Qid& qid, uint64_t offset, uint32_t count, const EncodedResponse& response);
+        std::optional<EncodedResponse> findStat(const Qid& qid);
+        void insertStat(const Qid& qid, const EncodedResponse& response);
+        void invalidate(uint64_t path);
+        void clear();
+        constexpr auto getCapacity() const noexcept { return _capacity; }
+        constexpr auto getMaximumEntrySize() const noexcept { return _maximumEntrySize; }
+        /**
+         * The number of bytes held right now
+         */
+        size_t size();
+        Statistics getStatistics();
+    private:
+        struct Key {
+            uint64_t path;
+            uint64_t offset;
+            uint32_t count;
+            bool stat;
+            bool operator==(const Key& other) const noexcept {
+                return path == other.path && offset == other.offset && count == other.count && stat == other.stat;
+            }
+        };
+        struct KeyHash {
+            size_t operator()(const Key& k) const noexcept {
+                return std::hash<uint64_t>()((k.path * 0x9E3779B97F4A7C15ull) ^ k.offset ^ (uint64_t(k.count) << 1) ^ uint64_t(k.stat));
+            }
+        };
+        struct Entry {
+            EncodedResponse response;
+            size_t charge;
+            std::list<Key>::iterator position;
+        };
+        struct FileEntry {
+            uint32_t version;
+            std::unordered_set<Key, KeyHash> keys;
+        };
+        std::optional<EncodedResponse> find(const Qid& qid, const Key& key);
+        void insert(const Qid& qid, const Key& key, const EncodedResponse& response);
+        /**
+         * Drop whatever is held for the path under another version
+         */
+        void observe(const Qid& qid);
+        void erase(const Key& key);
+        void dropPath(uint64_t path);
+    private:
+        std::mutex _lock;
+        size_t _capacity;
+        size_t _maximumEntrySize;
+        size_t _size = 0;
+        std::unordered_map<Key, Entry, KeyHash> _entries;
+        std::unordered_map<uint64_t, FileEntry> _files;
+        /// most recently used at the front
+        std::list<Key> _order;
+        Statistics _stats;
+};
+
+} // end namespace kzr
+
+#endif // end KZR_RESPONSE_CACHE_H__
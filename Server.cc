@@ -0,0 +1,620 @@
+/**
+ * @file
+ * Hosts a Backend on a Connection implementation
+ * @copyright
+ * libkzr
+ * Copyright (c) 2019, Joshua Scoggins 
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR 
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "Server.h"
+#include "Exception.h"
+#include <algorithm>
+#include <thread>
+#include <type_traits>
+
+namespace kzr {
+
+Server::Server(Backend& backend, uint32_t msize) : _backend(backend), _maximumMsize(msize), _msize(msize) { }
+
+ErrorResponse
+Server::makeError(uint16_t tag, const std::string& message) {
+    ErrorResponse err(tag);
+    err.setErrorName(message);
+    return err;
+}
+
+VersionResponse
+Server::negotiate(const VersionRequest& request) {
+    VersionResponse response;
+    _msize = std::min(request.getMsize(), _maximumMsize);
+    response.setMsize(_msize);
+    // anything starting with 9P2000 is 9P2000 as far as we are concerned
+    if (auto ver = request.getVersion(); ver.compare(0, 6, version9p2000String) == 0) {
+        response.setVersion(version9p2000String);
+    } else {
+        response.setVersion("unknown");
+    }
+    _backend.reset();
+    return response;
+}
+
+ReadRequest
+Server::clamp(const ReadRequest& request) const {
+    // never hand back more than fits in a message
+    ReadRequest clamped(request);
+    if (clamped.getCount() > _msize - ioHeaderSize) {
+        clamped.setCount(_msize - ioHeaderSize);
+    }
+    return clamped;
+}
+
+bool
+Server::sendRegion(Connection& connection, const ReadRequest& request) {
+    ReadRegion region;
+    try {
+        if (!_backend.readRegion(clamp(request), region)) {
+            return false;
+        }
+    } catch (Exception& e) {
+        send(connection, makeError(request.getTag(), e.message()));
+        return true;
+    }
+    // the header of an Rread is the common one plus the count, the payload
+    // follows it directly
+    ReadResponse response(request.getTag());
+    MessageStream header;
+    response.MessageHeader::encode(header);
+    header << uint32_t(region.count);
+    std::lock_guard<std::mutex> guard(_writeLock);
+    if (region.view) {
+        connection.writeView(header, region.view, region.count);
+    } else {
+        connection.writeFileRegion(header, region.descriptor, region.offset, region.count);
+    }
+    return true;
+}
+
+Response
+Server::dispatch(const Request& request) {
+    auto tag = std::visit([](auto&& value) { return value.getTag(); }, request);
+    try {
+        Response response = std::visit([this](auto&& value) -> Response {
+            using T = std::decay_t<decltype(value)>;
+            if constexpr (std::is_same_v<T, VersionRequest>) {
+                return negotiate(value);
+            } else if constexpr (std::is_same_v<T, AuthenticationRequest>) {
+                return _backend.auth(value);
+            } else if constexpr (std::is_same_v<T, FlushRequest>) {
+                // requests are handled one at a time so there is never
+                // anything left to flush
+                return FlushResponse();
+            } else if constexpr (std::is_same_v<T, AttachRequest>) {
+                return _backend.attach(value);
+            } else if constexpr (std::is_same_v<T, WalkRequest>) {
+                return _backend.walk(value);
+            } else if constexpr (std::is_same_v<T, OpenRequest>) {
+                return _backend.open(value);
+            } else if constexpr (std::is_same_v<T, CreateRequest>) {
+                return _backend.create(value);
+            } else if constexpr (std::is_same_v<T, ReadRequest>) {
+                return _backend.read(clamp(value));
+            } else if constexpr (std::is_same_v<T, WriteRequest>) {
+                return _backend.write(value);
+            } else if constexpr (std::is_same_v<T, ClunkRequest>) {
+                return _backend.clunk(value);
+            } else if constexpr (std::is_same_v<T, RemoveRequest>) {
+                return _backend.remove(value);
+            } else if constexpr (std::is_same_v<T, StatRequest>) {
+                return _backend.stat(value);
+            } else if constexpr (std::is_same_v<T, WStatRequest>) {
+                return _backend.wstat(value);
+            } else {
+                throw Exception("Illegal request kind!");
+            }
+        }, request);
+        std::visit([tag](auto&& value) { value.setTag(tag); }, response);
+        return response;
+    } catch (Exception& e) {
+        return makeError(tag, e.message());
+    } catch (std::exception& e) {
+        // running out of memory and the like fail the request, not the
+        // server
+        return makeError(tag, e.what());
+    }
+}
+
+void
+Server::send(Connection& connection, const Response& response) {
+    MessageStream outgoing;
+    outgoing << response;
+    std::lock_guard<std::mutex> guard(_writeLock);
+    connection << outgoing;
+}
+
+bool
+Server::track(uint16_t tag, Deferral* deferral) {
+    if (deferral) {
+        deferral->deferred = true;
+        return true;
+    }
+    std::lock_guard<std::mutex> guard(_outstandingLock);
+    // the client may reuse a tag that is still in flight, don't let it be
+    // mistaken for the first one
+    return _outstanding.emplace(tag, std::vector<uint16_t>()).second;
+}
+
+Backend::Responder
+Server::responderFor(Connection& connection, uint16_t tag) {
+    return Backend::Responder([this, &connection, tag](Response response) {
+                                  deliver([this, &connection, tag, response = std::move(response)]() mutable { complete(connection, tag, std::move(response)); });
+                              },
+                              [this, &connection, tag](const EncodedResponse& response) {
+                                  deliver([this, &connection, tag, response]() { complete(connection, tag, response); });
+                              });
+}
+
+void
+Server::setCompletionHandler(std::function<void()> handler) {
+    _completionHandler = std::move(handler);
+    _loopThread = std::this_thread::get_id();
+}
+
+void
+Server::deliver(std::function<void()> completion) {
+    if (!_completionHandler || std::this_thread::get_id() == _loopThread) {
+        completion();
+        return;
+    }
+    bool first = false;
+    {
+        std::lock_guard<std::mutex> guard(_outstandingLock);
+        first = _completions.empty();
+        _completions.emplace_back(std::move(completion));
+    }
+    // drain may be waiting on the loop thread for this one
+    _drained.notify_all();
+    if (first) {
+        _completionHandler();
+    }
+}
+
+void
+Server::runCompletions() {
+    std::deque<std::function<void()>> completions;
+    {
+        std::lock_guard<std::mutex> guard(_outstandingLock);
+        completions.swap(_completions);
+    }
+    for (auto& completion : completions) {
+        completion();
+    }
+}
+
+bool
+Server::share(Connection& connection, Request& request, const ReadRequest& read, uint16_t tag, Deferral* deferral) {
+    Qid qid;
+    if ((!_coalescer && !_responseCache) || !_backend.identify(read.getFid(), qid)) {
+        return false;
+    } else if (_responseCache) {
+        if (auto hit = _responseCache->findRead(qid, read.getOffset(), read.getCount()); hit) {
+            sendEncoded(connection, tag, *hit);
+            return true;
+        } else if (!_coalescer) {
+            auto response = dispatch(request);
+            if (std::holds_alternative<ReadResponse>(response)) {
+                auto encoded = EncodedResponse::encode(response);
+                _responseCache->insertRead(qid, read.getOffset(), read.getCount(), encoded);
+                sendEncoded(connection, tag, encoded);
+            } else {
+                send(connection, response);
+            }
+            return true;
+        }
+    }
+    return coalesce(connection, request, read, qid, tag, deferral);
+}
+
+bool
+Server::coalesce(Connection& connection, Request& request, const ReadRequest& read, const Qid& qid, uint16_t tag, Deferral* deferral) {
+    if (!track(tag, deferral)) {
+        return false;
+    }
+    ReadCoalescer::Key key { qid.getPath(), qid.getVersion(), read.getOffset(), read.getCount() };
+    if (!_coalescer->join(key, responderFor(connection, tag))) {
+        // someone else is reading the same thing already
+        return true;
+    }
+    auto coalescer = _coalescer;
+    auto cache = _responseCache;
+    Backend::Responder done([coalescer, cache, key, qid](Response response) {
+                auto encoded = EncodedResponse::encode(response);
+                if (cache && std::holds_alternative<ReadResponse>(response)) {
+                    cache->insertRead(qid, key.offset, key.count, encoded);
+                }
+                coalescer->finish(key, encoded);
+            });
+    try {
+        if (_backend.submit(request, done)) {
+            return true;
+        }
+        done(dispatch(request));
+    } catch (std::exception& e) {
+        // everyone waiting on the read has to hear about it
+        done(makeError(tag, e.what()));
+    }
+    return true;
+}
+
+bool
+Server::submit(Connection& connection, Request& request, uint16_t tag, Deferral* deferral) {
+    if (!track(tag, deferral)) {
+        return false;
+    }
+    auto forget = [this, tag, deferral]() {
+        if (deferral) {
+            // the scheduled job finishes the request itself
+            deferral->deferred = false;
+            return;
+        }
+        std::lock_guard<std::mutex> guard(_outstandingLock);
+        _outstanding.erase(tag);
+    };
+    try {
+        if (_backend.submit(request, responderFor(connection, tag))) {
+            return true;
+        }
+    } catch (std::exception& e) {
+        forget();
+        send(connection, makeError(tag, e.what()));
+        return true;
+    }
+    forget();
+    return false;
+}
+
+void
+Server::complete(Connection& connection, uint16_t tag, Response&& response) {
+    std::visit([tag](auto&& value) { value.setTag(tag); }, response);
+    try {
+        send(connection, response);
+    } catch (Exception&) {
+        // the connection is gone, there is nobody left to tell
+    }
+    finished(connection, tag);
+}
+
+bool
+Server::cachedStat(Connection& connection, const Request& request, const StatRequest& stat, uint16_t tag) {
+    Qid qid;
+    if (!_responseCache || !_backend.describe(stat.getFid(), qid)) {
+        return false;
+    } else if (auto hit = _responseCache->findStat(qid); hit) {
+        sendEncoded(connection, tag, *hit);
+    } else if (auto response = dispatch(request); std::holds_alternative<StatResponse>(response)) {
+        auto encoded = EncodedResponse::encode(response);
+        _responseCache->insertStat(qid, encoded);
+        sendEncoded(connection, tag, encoded);
+    } else {
+        send(connection, response);
+    }
+    return true;
+}
+
+void
+Server::complete(Connection& connection, uint16_t tag, const EncodedResponse& response) {
+    try {
+        sendEncoded(connection, tag, response);
+    } catch (Exception&) {
+        // the connection is gone, there is nobody left to tell
+    }
+    finished(connection, tag);
+}
+
+void
+Server::sendEncoded(Connection& connection, uint16_t tag, const EncodedResponse& response) {
+    MessageStream header;
+    header << uint8_t(response.type) << tag;
+    std::lock_guard<std::mutex> guard(_writeLock);
+    if (response.body) {
+        connection.writeView(header, reinterpret_cast<const uint8_t*>(response.body->data()), response.body->length());
+    } else {
+        connection << header;
+    }
+}
+
+void
+Server::finished(Connection& connection, uint16_t tag) {
+    std::vector<uint16_t> flushes;
+    bool resume = false;
+    {
+        std::lock_guard<std::mutex> guard(_outstandingLock);
+        if (auto it = _outstanding.find(tag); it != _outstanding.end()) {
+            flushes = std::move(it->second);
+            _outstanding.erase(it);
+        }
+        if (_waitingForRoom && _outstanding.size() < _maximumOutstanding) {
+            _waitingForRoom = false;
+            resume = true;
+        }
+    }
+    // a flush is only answered once the request it names has been
+    for (auto flushTag : flushes) {
+        try {
+            send(connection, FlushResponse(flushTag));
+        } catch (Exception&) { }
+    }
+    _drained.notify_all();
+    if (resume && _resume) {
+        _resume();
+    }
+}
+
+void
+Server::drain() {
+    std::unique_lock<std::mutex> guard(_outstandingLock);
+    while (true) {
+        _drained.wait(guard, [this]() { return _outstanding.empty() || !_completions.empty(); });
+        if (_completions.empty()) {
+            return;
+        }
+        // called from the loop thread, which is the one to send these
+        guard.unlock();
+        runCompletions();
+        guard.lock();
+    }
+}
+
+void
+Server::serve(Connection& connection) {
+    while (true) {
+        admit();
+        MessageStream incoming;
+        try {
+            connection >> incoming;
+        } catch (Exception&) {
+            disconnect();
+            return;
+        }
+        handle(connection, incoming);
+    }
+}
+
+void
+Server::disconnect() {
+    {
+        // scheduled requests still use the backend
+        std::unique_lock<std::mutex> guard(_outstandingLock);
+        _drained.wait(guard, [this]() { return _scheduled == 0; });
+    }
+    // the other side hung up which clunks every fid, that answers anything
+    // parked and the responders of submitted requests still refer to the
+    // connection
+    _backend.reset();
+    drain();
+}
+
+void
+Server::handle(Connection& connection, MessageStream& incoming) {
+    Request request;
+    incoming >> request;
+    auto tag = std::visit([](auto&& value) { return value.getTag(); }, request);
+    if (_account) {
+        charge(request);
+    }
+    if (auto flush = std::get_if<FlushRequest>(&request); flush) {
+        std::unique_lock<std::mutex> guard(_outstandingLock);
+        if (auto it = _outstanding.find(flush->getOldTag()); it != _outstanding.end()) {
+            it->second.emplace_back(tag);
+            guard.unlock();
+            try {
+                _backend.flush(flush->getOldTag());
+            } catch (Exception&) {
+                // the flush is answered once the request is, whenever that
+                // may be
+            }
+            return;
+        }
+        guard.unlock();
+        send(connection, FlushResponse(tag));
+        return;
+    } else if (std::holds_alternative<VersionRequest>(request)) {
+        // a new session starts without anything in flight, the backend is
+        // reset before waiting since that is what answers parked reads
+        disconnect();
+    } else if (_scheduler) {
+        schedule(connection, request, tag);
+        return;
+    }
+    process(connection, request, tag, nullptr);
+}
+
+void
+Server::process(Connection& connection, Request& request, uint16_t tag, Deferral* deferral) {
+    auto read = std::get_if<ReadRequest>(&request);
+    if (read) {
+        *read = clamp(*read);
+    }
+    if (read && share(connection, request, *read, tag, deferral)) {
+        return;
+    } else if (auto stat = std::get_if<StatRequest>(&request); stat && cachedStat(connection, request, *stat, tag)) {
+        return;
+    } else if (submit(connection, request, tag, deferral)) {
+        return;
+    } else if (read && sendRegion(connection, *read)) {
+        return;
+    }
+    send(connection, dispatch(request));
+}
+
+bool
+Server::flushed(uint16_t tag) {
+    std::lock_guard<std::mutex> guard(_outstandingLock);
+    auto it = _outstanding.find(tag);
+    return it != _outstanding.end() && !it->second.empty();
+}
+
+uint64_t
+Server::keyOf(const Request& request) const {
+    uint64_t key = uint64_t(reinterpret_cast<uintptr_t>(this)) * 0x9E3779B97F4A7C15ull;
+    if (!_backend.isConcurrent()) {
+        return key;
+    }
+    // keys of different fids may collide, which only costs parallelism
+    return key ^ std::visit([](auto&& value) -> uint64_t {
+                using T = std::decay_t<decltype(value)>;
+                if constexpr (std::is_base_of_v<HasFid, T>) {
+                    return uint64_t(value.getFid()) + 1;
+                } else if constexpr (std::is_same_v<T, AuthenticationRequest>) {
+                    return uint64_t(value.getAuthenticationHandle()) + 1;
+                } else {
+                    return 0;
+                }
+            }, request);
+}
+
+RequestScheduler::Priority
+Server::priorityOf(const Request& request) const {
+    auto kind = std::visit([](auto&& value) { return convert(value.getOperation()); }, request);
+    if (isSessionClass(kind) || isMetadataClass(kind) || !isFileClass(kind)) {
+        // attaches, stats and removes are cheap and someone is waiting on
+        // them
+        return RequestScheduler::Priority::Urgent;
+    }
+    uint32_t size = 0;
+    if (auto read = std::get_if<ReadRequest>(&request); read) {
+        size = read->getCount();
+    } else if (auto write = std::get_if<WriteRequest>(&request); write) {
+        size = uint32_t(write->getData().size());
+    }
+    // walks, opens, creates, clunks and small transfers stay urgent
+    return size > _bulkThreshold ? RequestScheduler::Priority::Bulk : RequestScheduler::Priority::Urgent;
+}
+
+uint64_t
+Server::costOf(const Request& request) const {
+    uint64_t cost = ioHeaderSize;
+    if (auto read = std::get_if<ReadRequest>(&request); read) {
+        cost += read->getCount();
+    } else if (auto write = std::get_if<WriteRequest>(&request); write) {
+        cost += write->getData().size();
+    }
+    return cost;
+}
+
+void
+Server::setRateLimiter(RateLimiter* limiter) {
+    if (limiter) {
+        _account = limiter->open();
+    } else {
+        _account.reset();
+    }
+}
+
+void
+Server::charge(const Request& request) {
+    if (auto attach = std::get_if<AttachRequest>(&request); attach) {
+        _account->attach(attach->getUserName());
+    }
+    if (auto wait = _account->charge(costOf(request)); wait > RateLimiter::Clock::duration::zero()) {
+        _resumeAt = RateLimiter::Clock::now() + wait;
+    }
+}
+
+bool
+Server::ready() {
+    if (_account && RateLimiter::Clock::now() < _resumeAt) {
+        return false;
+    } else if (_maximumOutstanding == 0) {
+        return true;
+    }
+    std::lock_guard<std::mutex> guard(_outstandingLock);
+    if (_outstanding.size() < _maximumOutstanding) {
+        return true;
+    }
+    _waitingForRoom = true;
+    return false;
+}
+
+void
+Server::admit() {
+    if (_account) {
+        // the other side can't send more than fits in the socket buffers
+        // while it waits
+        std::this_thread::sleep_until(_resumeAt);
+    }
+    if (_maximumOutstanding != 0) {
+        std::unique_lock<std::mutex> guard(_outstandingLock);
+        _drained.wait(guard, [this]() { return _outstanding.size() < _maximumOutstanding; });
+    }
+}
+
+void
+Server::schedule(Connection& connection, Request& request, uint16_t tag) {
+    // tracked right away so that flushes and drain wait for it
+    if (!track(tag)) {
+        send(connection, makeError(tag, "tag in use"));
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> guard(_outstandingLock);
+        ++_scheduled;
+    }
+    auto priority = priorityOf(request);
+    auto key = keyOf(request);
+    auto cost = costOf(request);
+    auto job = [this, &connection, request = std::move(request), tag]() mutable {
+                Deferral deferral;
+                try {
+                    process(connection, request, tag, &deferral);
+                    if (deferral.deferred && flushed(tag)) {
+                        // a flush which came in before the request reached
+                        // the backend found nothing there to cancel
+                        _backend.flush(tag);
+                    }
+                } catch (Exception&) {
+                    // the connection is gone, there is nobody left to tell
+                } catch (std::exception& e) {
+                    // the request still has to be answered and forgotten or
+                    // it would hold up drain and disconnect forever
+                    try {
+                        send(connection, makeError(tag, e.what()));
+                    } catch (std::exception&) { }
+                }
+                if (!deferral.deferred) {
+                    finished(connection, tag);
+                }
+                // notified under the lock, once disconnect sees nothing
+                // scheduled the server may go away
+                std::lock_guard<std::mutex> guard(_outstandingLock);
+                --_scheduled;
+                _drained.notify_all();
+            };
+    if (_fairQueue) {
+        // one flow per connection
+        _fairQueue->schedule(uint64_t(reinterpret_cast<uintptr_t>(this)), cost, key, std::move(job), priority);
+    } else {
+        _scheduler->schedule(key, std::move(job), priority);
+    }
+}
+
+} // end namespace kzr
@@ -0,0 +1,315 @@
+/**
+ * @file
+ * Hosts a Backend on a Connection
+ * @copyright
+ * libkzr
+ * Copyright (c) 2019, Joshua Scoggins 
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR 
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef KZR_SERVER_H__
+#define KZR_SERVER_H__
+#include <cstdint>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "Message.h"
+#include "Interaction.h"
+#include "Connection.h"
+#include "Backend.h"
+#include "ReadCoalescer.h"
+#include "ResponseCache.h"
+#include "RequestScheduler.h"
+#include "FairQueue.h"
+#include "RateLimiter.h"
+
+namespace kzr {
+
+/**
+ * Decodes requests coming off of a connection, hands them to a backend and
+ * sends the responses back. Version negotiation is handled here; everything
+ * else goes to the backend and any Exception it throws becomes an Rerror.
+ *
+ * Requests the backend takes through Backend::submit are answered whenever
+ * it gets around to it, meanwhile the server keeps reading requests. A Tflush
+ * of such a request is answered right after it completes.
+ */
+class Server {
+    public:
+        static constexpr uint32_t defaultMsize = 8192;
+        /**
+         * The number of bytes of a Rread or Twrite which are not payload
+         */
+        static constexpr uint32_t ioHeaderSize = 24;
+        /**
+         * Reads and writes moving more bytes than this are scheduled as bulk
+         * work by default
+         */
+        static constexpr uint32_t defaultBulkThreshold = 16 * 1024;
+    public:
+        explicit Server(Backend& backend, uint32_t msize = defaultMsize);
+        virtual ~Server() = default;
+        /**
+         * Handle a single request and produce the response for it
+         */
+        Response dispatch(const Request& request);
+        /**
+         * Service requests from the connection until the other side goes
+         * away, returns once every outstanding request has been answered.
+         */
+        void serve(Connection& connection);
+        /**
+         * Handle a single message which was read off of the connection by
+         * someone else, such as an event loop which owns many connections
+         */
+        void handle(Connection& connection, MessageStream& incoming);
+        /**
+         * The other side of the connection went away, forget every fid and
+         * wait for whatever is still outstanding to be answered
+         */
+        void disconnect();
+        constexpr auto getMsize() const noexcept { return _msize; }
+        Backend& getBackend() noexcept { return _backend; }
+        /**
+         * Share reads of files the backend can identify with identical reads
+         * in flight on this or any other server using the same coalescer
+         */
+        void setReadCoalescer(ReadCoalescer* coalescer) noexcept { _coalescer = coalescer; }
+        ReadCoalescer* getReadCoalescer() const noexcept { return _coalescer; }
+        /**
+         * Answer reads of files the backend can identify, and stats of files
+         * it can describe, from encoded responses kept in the cache
+         */
+        void setResponseCache(ResponseCache* cache) noexcept { _responseCache = cache; }
+        ResponseCache* getResponseCache() const noexcept { return _responseCache; }
+        /**
+         * Carry out requests on the workers of the scheduler instead of the
+         * thread reading them. Requests stay in order per fid when the
+         * backend is concurrent and per connection otherwise; version and
+         * flush requests are still handled right away.
+         */
+        void setScheduler(RequestScheduler* scheduler) noexcept { _scheduler = scheduler; }
+        RequestScheduler* getScheduler() const noexcept { return _scheduler; }
+        /**
+         * Reads and writes moving more than this many bytes are scheduled
+         * behind session, metadata and small file requests
+         */
+        void setBulkThreshold(uint32_t threshold) noexcept { _bulkThreshold = threshold; }
+        constexpr auto getBulkThreshold() const noexcept { return _bulkThreshold; }
+        /**
+         * Let scheduled requests into the scheduler through the queue, which
+         * takes turns between the servers sharing it. The queue has to feed
+         * the scheduler given to setScheduler.
+         */
+        void setFairQueue(FairQueue* queue) noexcept { _fairQueue = queue; }
+        FairQueue* getFairQueue() const noexcept { return _fairQueue; }
+        /**
+         * Charge every request to an account of the limiter, and to the
+         * user it attaches as. Once either goes over its limits the next
+         * request is not read until they are back under.
+         */
+        void setRateLimiter(RateLimiter* limiter);
+        /**
+         * Stop reading requests while this many are waiting to be answered,
+         * zero means no limit
+         */
+        void setMaximumOutstanding(size_t count) noexcept { _maximumOutstanding = count; }
+        constexpr auto getMaximumOutstanding() const noexcept { return _maximumOutstanding; }
+        /**
+         * Whether the next request may be read right now, for event loops
+         * which call handle themselves. serve waits on its own.
+         */
+        bool ready();
+        /**
+         * When the rate limits let the next request through
+         */
+        RateLimiter::Clock::time_point getResumeTime() const noexcept { return _resumeAt; }
+        /**
+         * Called from the thread answering the request which brings the
+         * server back under its maximum outstanding after ready said no
+         */
+        void setResumeHandler(std::function<void()> handler) { _resume = std::move(handler); }
+        /**
+         * Queue the answers other threads have ready for submitted requests
+         * instead of having those threads write to the connection, for
+         * event loops which own their connections. The handler is called
+         * from such a thread once something is queued and the loop should
+         * then call runCompletions. Has to be called from the thread of the
+         * loop, answers ready on it are still sent right away.
+         */
+        void setCompletionHandler(std::function<void()> handler);
+        /**
+         * Send the answers queued so far, from the thread of the loop
+         */
+        void runCompletions();
+    protected:
+        /**
+         * Set when a request run by the scheduler has been handed to a
+         * responder, which answers it later
+         */
+        struct Deferral {
+            bool deferred = false;
+        };
+        /**
+         * Answer anything but a flush or version request
+         * @param deferral set for requests run by the scheduler, their tag
+         * is tracked already
+         */
+        void process(Connection& connection, Request& request, uint16_t tag, Deferral* deferral);
+        /**
+         * Hand the request to the scheduler
+         */
+        void schedule(Connection& connection, Request& request, uint16_t tag);
+        /**
+         * The serial queue a request goes in
+         */
+        uint64_t keyOf(const Request& request) const;
+        /**
+         * The line the request waits in at the scheduler
+         */
+        RequestScheduler::Priority priorityOf(const Request& request) const;
+        /**
+         * The bytes a request moves over the connection, near enough
+         */
+        uint64_t costOf(const Request& request) const;
+        /**
+         * Charge the request to the rate limits
+         */
+        void charge(const Request& request);
+        /**
+         * Wait until the next request may be read
+         */
+        void admit();
+        /**
+         * Whether a flush naming the tracked request has come in
+         */
+        bool flushed(uint16_t tag);
+        /**
+         * Try to answer a read with the payload going straight from the
+         * backing file to the connection.
+         * @return false if the backend could not provide a region
+         */
+        bool sendRegion(Connection& connection, const ReadRequest& request);
+        ReadRequest clamp(const ReadRequest& request) const;
+        /**
+         * Offer the request to the backend to answer later
+         * @return true if the request has been taken care of
+         */
+        bool submit(Connection& connection, Request& request, uint16_t tag, Deferral* deferral);
+        /**
+         * Answer a read from the response cache or through the coalescer
+         * when the backend can identify the file
+         * @return true if the request has been taken care of
+         */
+        bool share(Connection& connection, Request& request, const ReadRequest& read, uint16_t tag, Deferral* deferral);
+        /**
+         * Wait on an identical read which is in flight already, or carry it
+         * out and share the result with anyone who shows up meanwhile
+         * @return true if the request has been taken care of
+         */
+        bool coalesce(Connection& connection, Request& request, const ReadRequest& read, const Qid& qid, uint16_t tag, Deferral* deferral);
+        /**
+         * Answer a stat from the response cache, filling it on a miss
+         * @return false if the backend can't describe the file
+         */
+        bool cachedStat(Connection& connection, const Request& request, const StatRequest& stat, uint16_t tag);
+        /**
+         * Start keeping track of a request answered through a responder, a
+         * scheduled request only notes that it has been deferred
+         * @return false if the tag is in flight already
+         */
+        bool track(uint16_t tag, Deferral* deferral = nullptr);
+        Backend::Responder responderFor(Connection& connection, uint16_t tag);
+        /**
+         * Run the completion of a submitted request now or queue it for the
+         * loop which owns the connection
+         */
+        void deliver(std::function<void()> completion);
+        void complete(Connection& connection, uint16_t tag, Response&& response);
+        /**
+         * Send a response which was encoded ahead of time, only the tag is
+         * added here
+         */
+        void complete(Connection& connection, uint16_t tag, const EncodedResponse& response);
+        /**
+         * Forget a submitted request once it has been answered and answer
+         * the flushes waiting on it
+         */
+        void finished(Connection& connection, uint16_t tag);
+        /**
+         * Wait until every submitted request has been answered
+         */
+        void drain();
+        void send(Connection& connection, const Response& response);
+        void sendEncoded(Connection& connection, uint16_t tag, const EncodedResponse& response);
+        VersionResponse negotiate(const VersionRequest& request);
+        static ErrorResponse makeError(uint16_t tag, const std::string& message);
+    private:
+        Backend& _backend;
+        uint32_t _maximumMsize;
+        uint32_t _msize;
+        /**
+         * Responses of submitted requests are sent from other threads
+         */
+        std::mutex _writeLock;
+        std::mutex _outstandingLock;
+        std::condition_variable _drained;
+        /**
+         * The tags of submitted requests which have not been answered yet
+         * mapped to the tags of the flushes waiting on them
+         */
+        std::unordered_map<uint16_t, std::vector<uint16_t>> _outstanding;
+        /**
+         * Requests handed to the scheduler which have not run yet
+         */
+        size_t _scheduled = 0;
+        ReadCoalescer* _coalescer = nullptr;
+        ResponseCache* _responseCache = nullptr;
+        RequestScheduler* _scheduler = nullptr;
+        uint32_t _bulkThreshold = defaultBulkThreshold;
+        FairQueue* _fairQueue = nullptr;
+        std::unique_ptr<RateLimiter::Account> _account;
+        /**
+         * Only touched by the thread reading requests
+         */
+        RateLimiter::Clock::time_point _resumeAt;
+        size_t _maximumOutstanding = 0;
+        /**
+         * ready said no because of the maximum outstanding
+         */
+        bool _waitingForRoom = false;
+        std::function<void()> _resume;
+        std::function<void()> _completionHandler;
+        std::thread::id _loopThread;
+        /**
+         * Completions waiting for the loop, guarded by _outstandingLock
+         */
+        std::deque<std::function<void()>> _completions;
+};
+
+} // end namespace kzr
+
+#endif // end KZR_SERVER_H__
@@ -0,0 +1,497 @@
+/**
+ * @file
+ * A server runtime with an event loop per core implementation
+ * @copyright
+ * libkzr
+ * Copyright (c) 2019, Joshua Scoggins 
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR 
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "ShardedServer.h"
+#include "MessageStream.h"
+#include <array>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <utility>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace kzr {
+
+namespace {
+constexpr size_t eventsPerWait = 64;
+constexpr size_t receiveChunk = 64 * 1024;
+// the size, type and tag of a message
+constexpr uint32_t smallestMessage = 7;
+
+/**
+ * Pin the calling thread to the nth cpu it is allowed to run on
+ */
+void
+pinTo(size_t n) {
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0 || CPU_COUNT(&allowed) == 0) {
+        return;
+    }
+    n %= CPU_COUNT(&allowed);
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if (CPU_ISSET(cpu, &allowed) && n-- == 0) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(cpu, &set);
+            pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+            return;
+        }
+    }
+}
+} // end namespace
+
+ShardedServer::Shard::~Shard() {
+    if (epoll >= 0) {
+        ::close(epoll);
+    }
+    if (wake >= 0) {
+        ::close(wake);
+    }
+}
+
+ShardedServer::ShardedServer(BackendFactory factory) : ShardedServer(std::move(factory), Policy()) { }
+
+ShardedServer::ShardedServer(BackendFactory factory, const Policy& policy) : _factory(std::move(factory)), _policy(policy) {
+    auto count = policy.shards;
+    if (count == 0) {
+        count = std::max(1u, std::thread::hardware_concurrency());
+    }
+    for (size_t i = 0; i < count; ++i) {
+        auto shard = std::make_unique<Shard>();
+        shard->index = i;
+        if (shard->epoll = epoll_create1(EPOLL_CLOEXEC); shard->epoll < 0) {
+            throw Exception("could not create an epoll instance: ", std::strerror(errno));
+        } else if (shard->wake = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK); shard->wake < 0) {
+            throw Exception("could not create an eventfd: ", std::strerror(errno));
+        }
+        epoll_event event {};
+        event.events = EPOLLIN;
+        event.data.fd = shard->wake;
+        if (epoll_ctl(shard->epoll, EPOLL_CTL_ADD, shard->wake, &event) != 0) {
+            throw Exception("could not watch the eventfd: ", std::strerror(errno));
+        }
+        _shards.emplace_back(std::move(shard));
+    }
+    for (auto& shard : _shards) {
+        shard->thread = std::thread([this, target = shard.get()]() { run(*target); });
+    }
+}
+
+ShardedServer::~ShardedServer() {
+    stop();
+}
+
+void
+ShardedServer::stop() {
+    if (_stopped) {
+        return;
+    }
+    _stopped = true;
+    for (auto& shard : _shards) {
+        post(shard->index, [target = shard.get()]() { target->running = false; });
+    }
+    for (auto& shard : _shards) {
+        if (shard->thread.joinable()) {
+            shard->thread.join();
+        }
+    }
+}
+
+void
+ShardedServer::post(size_t index, Task task) {
+    auto& shard = *_shards.at(index);
+    {
+        std::lock_guard<std::mutex> guard(shard.taskLock);
+        shard.tasks.emplace_back(std::move(task));
+    }
+    uint64_t one = 1;
+    // can only fail if the counter would overflow, it is woken up regardless
+    [[maybe_unused]] auto written = ::write(shard.wake, &one, sizeof(one));
+}
+
+void
+ShardedServer::broadcast(const Task& task) {
+    for (size_t i = 0; i < _shards.size(); ++i) {
+        post(i, task);
+    }
+}
+
+void
+ShardedServer::listen(int fd) {
+    if (auto flags = fcntl(fd, F_GETFL); flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        throw Exception("could not make the listening socket non blocking: ", std::strerror(errno));
+    }
+    for (auto& shard : _shards) {
+        post(shard->index, [target = shard.get(), fd]() {
+                    epoll_event event {};
+                    // only one of the shards waiting is woken up per connection
+                    event.events = EPOLLIN | EPOLLEXCLUSIVE;
+                    event.data.fd = fd;
+                    if (epoll_ctl(target->epoll, EPOLL_CTL_ADD, fd, &event) == 0) {
+                        target->listeners.emplace_back(fd);
+                    }
+                });
+    }
+}
+
+void
+ShardedServer::adopt(int fd) {
+    auto target = leastLoaded();
+    ++_shards[target]->active;
+    handOff(target, fd);
+}
+
+size_t
+ShardedServer::leastLoaded() const noexcept {
+    size_t best = 0;
+    for (size_t i = 1; i < _shards.size(); ++i) {
+        if (_shards[i]->active.load(std::memory_order_relaxed) < _shards[best]->active.load(std::memory_order_relaxed)) {
+            best = i;
+        }
+    }
+    return best;
+}
+
+void
+ShardedServer::handOff(size_t index, int fd) {
+    // the socket is closed if the shard goes away before getting to it
+    std::shared_ptr<int> handle(new int(fd), [](int* value) {
+                if (*value >= 0) {
+                    ::close(*value);
+                }
+                delete value;
+            });
+    post(index, [this, index, handle]() { open(*_shards[index], std::exchange(*handle, -1)); });
+}
+
+void
+ShardedServer::run(Shard& shard) {
+    if (_policy.pinThreads) {
+        pinTo(shard.index);
+    }
+    std::array<epoll_event, eventsPerWait> events;
+    while (shard.running) {
+        auto count = epoll_wait(shard.epoll, events.data(), events.size(), runTimers(shard));
+        if (count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        for (int i = 0; i < count; ++i) {
+            auto fd = events[i].data.fd;
+            if (fd == shard.wake) {
+                runTasks(shard);
+            } else if (std::find(shard.listeners.begin(), shard.listeners.end(), fd) != shard.listeners.end()) {
+                accept(shard, fd);
+            } else if (auto it = shard.sessions.find(fd); it == shard.sessions.end()) {
+                continue;
+            } else if (!react(shard, *it->second, events[i].events)) {
+                close(shard, fd);
+            }
+        }
+    }
+    while (!shard.sessions.empty()) {
+        close(shard, shard.sessions.begin()->first);
+    }
+}
+
+void
+ShardedServer::runTasks(Shard& shard) {
+    uint64_t count = 0;
+    [[maybe_unused]] auto got = ::read(shard.wake, &count, sizeof(count));
+    std::deque<Task> tasks;
+    {
+        std::lock_guard<std::mutex> guard(shard.taskLock);
+        tasks.swap(shard.tasks);
+    }
+    for (auto& task : tasks) {
+        shard.handled.fetch_add(1, std::memory_order_relaxed);
+        try {
+            task();
+        } catch (std::exception&) {
+            // a task which fails only affects what it was doing
+        }
+    }
+}
+
+void
+ShardedServer::accept(Shard& shard, int listener) {
+    while (true) {
+        auto fd = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            // drained, or another shard got there first
+            return;
+        }
+        shard.accepted.fetch_add(1, std::memory_order_relaxed);
+        auto target = _policy.balanceAccepts ? leastLoaded() : shard.index;
+        // counted right away so a burst of accepts spreads out
+        ++_shards[target]->active;
+        if (target == shard.index) {
+            open(shard, fd);
+        } else {
+            handOff(target, fd);
+        }
+    }
+}
+
+void
+ShardedServer::open(Shard& shard, int fd) {
+    try {
+        auto session = std::make_unique<Session>(fd);
+        if (auto flags = fcntl(fd, F_GETFL); flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+            throw Exception("could not make the connection non blocking: ", std::strerror(errno));
+        }
+        // the shard's own writes are followed by a watch anyway, this is
+        // for the ones from other threads
+        session->connection.setQueuedHandler([this, index = shard.index, fd]() {
+                    post(index, [this, index, fd]() { queued(*_shards[index], fd); });
+                });
+        session->backend = _factory();
+        session->server = std::make_unique<Server>(*session->backend, _policy.msize);
+        if (_policy.configure) {
+            _policy.configure(*session->server);
+        }
+        session->server->setResumeHandler([this, index = shard.index, fd]() {
+                    post(index, [this, index, fd]() { resume(*_shards[index], fd); });
+                });
+        session->server->setCompletionHandler([this, index = shard.index, fd]() {
+                    post(index, [this, index, fd]() { complete(*_shards[index], fd); });
+                });
+        epoll_event event {};
+        event.events = EPOLLIN | EPOLLRDHUP;
+        event.data.fd = fd;
+        session->events = event.events;
+        if (epoll_ctl(shard.epoll, EPOLL_CTL_ADD, fd, &event) != 0) {
+            throw Exception("could not watch the connection: ", std::strerror(errno));
+        }
+        shard.sessions.emplace(fd, std::move(session));
+    } catch (std::exception&) {
+        // the session closes the socket on the way out
+        --shard.active;
+    }
+}
+
+bool
+ShardedServer::service(Shard& shard, Session& session) {
+    auto fd = session.connection.getHandle();
+    bool open = true;
+    std::array<char, receiveChunk> chunk;
+    while (true) {
+        auto got = ::recv(fd, chunk.data(), chunk.size(), MSG_DONTWAIT);
+        if (got > 0) {
+            session.buffer.append(chunk.data(), size_t(got));
+            if (size_t(got) < chunk.size()) {
+                break;
+            }
+        } else if (got < 0 && errno == EINTR) {
+            continue;
+        } else {
+            open = got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+            break;
+        }
+    }
+    // whole messages which arrived before a hang up are still answered
+    size_t at = 0;
+    auto& buffer = session.buffer;
+    while (buffer.size() - at >= 4) {
+        // the rate limits are checked here rather than left to ready so
+        // that the time they said no at is the time a timer is set for
+        if (auto resumeAt = session.server->getResumeTime(); resumeAt > std::chrono::steady_clock::now()) {
+            buffer.erase(0, at);
+            pause(shard, session);
+            shard.timers.emplace(resumeAt, fd);
+            return open;
+        } else if (!session.server->ready()) {
+            // the server says when there is room again
+            buffer.erase(0, at);
+            pause(shard, session);
+            return open;
+        } else if (session.connection.pending() > _policy.maxQueued) {
+            // picked back up once the client has read enough
+            buffer.erase(0, at);
+            session.backlogged = true;
+            pause(shard, session);
+            return open;
+        }
+        auto size = build(uint8_t(buffer[at]), uint8_t(buffer[at + 1]), uint8_t(buffer[at + 2]), uint8_t(buffer[at + 3]));
+        if (size < smallestMessage || size > _policy.msize) {
+            return false;
+        } else if (buffer.size() - at < size) {
+            break;
+        }
+        MessageStream incoming;
+        incoming.str(buffer.substr(at + 4, size - 4));
+        at += size;
+        shard.requests.fetch_add(1, std::memory_order_relaxed);
+        try {
+            session.server->handle(session.connection, incoming);
+        } catch (std::exception&) {
+            // garbage on the wire or the other side went away mid write
+            return false;
+        }
+    }
+    buffer.erase(0, at);
+    return open && watch(shard, session);
+}
+
+bool
+ShardedServer::react(Shard& shard, Session& session, uint32_t events) {
+    if (events & EPOLLOUT) {
+        if (!session.connection.flush()) {
+            return false;
+        } else if (session.backlogged && session.connection.pending() <= _policy.maxQueued) {
+            session.backlogged = false;
+            session.paused = false;
+            // whatever is left in the buffer is handled right away
+            return service(shard, session);
+        } else if ((events & ~uint32_t(EPOLLOUT)) == 0) {
+            return watch(shard, session);
+        }
+    }
+    // nothing but hang ups and errors are reported while paused
+    return !session.paused && service(shard, session);
+}
+
+bool
+ShardedServer::watch(Shard& shard, Session& session) {
+    uint32_t wanted = EPOLLRDHUP;
+    if (!session.paused) {
+        wanted |= EPOLLIN;
+    }
+    if (session.connection.pending() > 0) {
+        wanted |= EPOLLOUT;
+    }
+    if (wanted == session.events) {
+        return true;
+    }
+    epoll_event event {};
+    event.events = wanted;
+    event.data.fd = session.connection.getHandle();
+    session.events = wanted;
+    return epoll_ctl(shard.epoll, EPOLL_CTL_MOD, event.data.fd, &event) == 0;
+}
+
+void
+ShardedServer::close(Shard& shard, int fd) {
+    if (auto it = shard.sessions.find(fd); it != shard.sessions.end()) {
+        epoll_ctl(shard.epoll, EPOLL_CTL_DEL, fd, nullptr);
+        it->second->server->disconnect();
+        shard.sessions.erase(it);
+        --shard.active;
+    }
+}
+
+void
+ShardedServer::pause(Shard& shard, Session& session) {
+    session.paused = true;
+    watch(shard, session);
+}
+
+void
+ShardedServer::resume(Shard& shard, int fd) {
+    auto it = shard.sessions.find(fd);
+    if (it == shard.sessions.end() || !it->second->paused || it->second->backlogged) {
+        return;
+    }
+    auto& session = *it->second;
+    session.paused = false;
+    // whatever is left in the buffer is handled right away
+    if (!service(shard, session)) {
+        close(shard, fd);
+    }
+}
+
+void
+ShardedServer::complete(Shard& shard, int fd) {
+    // the connection may have been closed (and its completions sent) since
+    if (auto it = shard.sessions.find(fd); it != shard.sessions.end()) {
+        it->second->server->runCompletions();
+        if (!watch(shard, *it->second)) {
+            close(shard, fd);
+        }
+    }
+}
+
+void
+ShardedServer::queued(Shard& shard, int fd) {
+    if (auto it = shard.sessions.find(fd); it != shard.sessions.end() && !watch(shard, *it->second)) {
+        close(shard, fd);
+    }
+}
+
+int
+ShardedServer::runTimers(Shard& shard) {
+    auto now = std::chrono::steady_clock::now();
+    while (!shard.timers.empty() && shard.timers.begin()->first <= now) {
+        auto fd = shard.timers.begin()->second;
+        shard.timers.erase(shard.timers.begin());
+        resume(shard, fd);
+    }
+    if (shard.timers.empty()) {
+        return -1;
+    }
+    auto wait = std::chrono::ceil<std::chrono::milliseconds>(shard.timers.begin()->first - now).count();
+    return int(std::max<decltype(wait)>(wait, 1));
+}
+
+ShardedServer::Statistics
+ShardedServer::getStatistics(size_t index) const {
+    const auto& shard = *_shards.at(index);
+    Statistics stats;
+    stats.accepted = shard.accepted.load(std::memory_order_relaxed);
+    stats.active = shard.active.load(std::memory_order_relaxed);
+    stats.requests = shard.requests.load(std::memory_order_relaxed);
+    stats.tasks = shard.handled.load(std::memory_order_relaxed);
+    return stats;
+}
+
+ShardedServer::Statistics
+ShardedServer::getStatistics() const {
+    Statistics total;
+    for (size_t i = 0; i < _shards.size(); ++i) {
+        auto stats = getStatistics(i);
+        total.accepted += stats.accepted;
+        total.active += stats.active;
+        total.requests += stats.requests;
+        total.tasks += stats.tasks;
+    }
+    return total;
+}
+
+} // end namespace kzr
@@ -0,0 +1,256 @@
+/**
+ * @file
+ * A server runtime with an event loop per core
+ * @copyright
+ * libkzr
+ * Copyright (c) 2019, Joshua Scoggins 
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR 
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef KZR_SHARDED_SERVER_H__
+#define KZR_SHARDED_SERVER_H__
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "Backend.h"
+#include "Server.h"
+#include "QueuedConnection.h"
+
+namespace kzr {
+
+/**
+ * Runs a number of shards, each a thread with an epoll loop of its own which
+ * owns a subset of the connections from accept to hang up. Every connection
+ * gets its own backend (and with it its own fid table) and Server, and all
+ * of the bookkeeping of a shard is only ever touched by its thread, so
+ * nothing is shared between cores while serving requests.
+ *
+ * Shards accept from the listening sockets they are given on their own,
+ * optionally handing each new connection to the shard with the fewest. The
+ * rare operation which does need another shard goes through its task queue.
+ *
+ * Sockets never block, the part of a response a client is not reading yet
+ * is queued on its connection and written out once the socket is writable,
+ * so a client which stops reading only holds up itself. Responses other
+ * threads have ready (parked event reads answered by a publish, for
+ * instance) are written the same way.
+ * Once the server of a connection is not ready for more requests, because of
+ * its rate limits or its maximum outstanding, or too much of its output is
+ * queued, the shard stops reading from the socket until it is.
+ */
+class ShardedServer {
+    public:
+        using BackendFactory = std::function<std::unique_ptr<Backend>()>;
+        using Task = std::function<void()>;
+        struct Policy {
+            /**
+             * Zero means one per core
+             */
+            size_t shards = 0;
+            /**
+             * Pin the thread of shard n to cpu n (modulo the number of cpus)
+             */
+            bool pinThreads = false;
+            /**
+             * Move every accepted connection to the shard with the fewest
+             * connections instead of keeping it on the shard which happened
+             * to accept it
+             */
+            bool balanceAccepts = true;
+            uint32_t msize = Server::defaultMsize;
+            /**
+             * Called with the server of every new connection, to set up read
+             * coalescing or response caching for instance
+             */
+            std::function<void(Server&)> configure;
+            /**
+             * Stop reading requests from a connection once this many bytes
+             * of its responses are waiting on the client
+             */
+            size_t maxQueued = 4 * 1024 * 1024;
+        };
+        struct Statistics {
+            uint64_t accepted = 0;
+            uint64_t active = 0;
+            uint64_t requests = 0;
+            /**
+             * Tasks run on behalf of other threads, handoffs included
+             */
+            uint64_t tasks = 0;
+        };
+    public:
+        explicit ShardedServer(BackendFactory factory);
+        ShardedServer(BackendFactory factory, const Policy& policy);
+        /**
+         * Stops every shard, hanging up on their connections
+         */
+        ~ShardedServer();
+        ShardedServer(const ShardedServer&) = delete;
+        ShardedServer& operator=(const ShardedServer&) = delete;
+        /**
+         * Accept connections from the listening socket on every shard, the
+         * socket is made non blocking and must stay open until the server
+         * is stopped
+         */
+        void listen(int fd);
+        /**
+         * Hand a connected socket to the shard with the fewest connections,
+         * the shard closes it once the other side hangs up. The socket is
+         * made non blocking.
+         */
+        void adopt(int fd);
+        /**
+         * Run the task on the thread of a shard
+         */
+        void post(size_t shard, Task task);
+        /**
+         * Run the task on the thread of every shard
+         */
+        void broadcast(const Task& task);
+        /**
+         * Hang up on every connection and wait for the shards to finish,
+         * called by the destructor
+         */
+        void stop();
+        auto getShardCount() const noexcept { return _shards.size(); }
+        Statistics getStatistics(size_t shard) const;
+        /**
+         * Summed over every shard
+         */
+        Statistics getStatistics() const;
+    private:
+        struct Session {
+            explicit Session(int fd) : connection(fd) { }
+            QueuedConnection connection;
+            std::unique_ptr<Backend> backend;
+            std::unique_ptr<Server> server;
+            /**
+             * Bytes received which have not been handled yet
+             */
+            std::string buffer;
+            /**
+             * Not being read from until the server is ready again
+             */
+            bool paused = false;
+            /**
+             * Paused until the client reads enough of the queued responses
+             */
+            bool backlogged = false;
+            /**
+             * What the socket is being watched for
+             */
+            uint32_t events = 0;
+        };
+        /**
+         * Kept on cache lines of their own, each shard only ever writes to
+         * its own
+         */
+        struct alignas(64) Shard {
+            ~Shard();
+            size_t index = 0;
+            int epoll = -1;
+            /**
+             * An eventfd which wakes the loop up when tasks are queued
+             */
+            int wake = -1;
+            bool running = true;
+            std::thread thread;
+            std::mutex taskLock;
+            std::deque<Task> tasks;
+            std::vector<int> listeners;
+            std::unordered_map<int, std::unique_ptr<Session>> sessions;
+            /**
+             * Sessions paused by their rate limits by when to resume them
+             */
+            std::multimap<std::chrono::steady_clock::time_point, int> timers;
+            std::atomic<uint64_t> accepted { 0 };
+            std::atomic<uint64_t> active { 0 };
+            std::atomic<uint64_t> requests { 0 };
+            std::atomic<uint64_t> handled { 0 };
+        };
+    private:
+        void run(Shard& shard);
+        void runTasks(Shard& shard);
+        void accept(Shard& shard, int listener);
+        /**
+         * Start serving a connected socket on the shard, from its thread
+         */
+        void open(Shard& shard, int fd);
+        /**
+         * Read whatever is available and handle every whole message
+         * @return false once the connection is done with
+         */
+        bool service(Shard& shard, Session& session);
+        /**
+         * Handle the readiness epoll reported for the socket
+         * @return false once the connection is done with
+         */
+        bool react(Shard& shard, Session& session, uint32_t events);
+        /**
+         * Watch the socket for input unless paused and for output while
+         * responses are queued
+         * @return false if the socket can't be watched
+         */
+        bool watch(Shard& shard, Session& session);
+        void close(Shard& shard, int fd);
+        /**
+         * Stop reading from the socket until the server is ready again
+         */
+        void pause(Shard& shard, Session& session);
+        void resume(Shard& shard, int fd);
+        /**
+         * Send the responses other threads queued for the connection
+         */
+        void complete(Shard& shard, int fd);
+        /**
+         * Start watching for output once another thread queued some
+         */
+        void queued(Shard& shard, int fd);
+        /**
+         * Resume the sessions whose timers are up
+         * @return the epoll timeout until the next one is
+         */
+        int runTimers(Shard& shard);
+        /**
+         * Queue a connected socket for a shard which has already been
+         * counted against it
+         */
+        void handOff(size_t shard, int fd);
+        size_t leastLoaded() const noexcept;
+    private:
+        BackendFactory _factory;
+        Policy _policy;
+        std::vector<std::unique_ptr<Shard>> _shards;
+        bool _stopped = false;
+};
+
+} // end namespace kzr
+
+#endif // end KZR_SHARDED_SERVER_H__
@@ -0,0 +1,107 @@
+/**
+ * @file
+ * Client side cache of file metadata implementation
+ * @copyright
+ * libkzr
+ * Copyright (c) 2019, Joshua Scoggins 
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR 
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "StatCache.h"
+
+namespace kzr {
+
+StatCache::StatCache(size_t capacity, Clock::duration lifetime) : _capacity(capacity), _lifetime(lifetime) { }
+
+const Stat*
+StatCache::find(uint64_t path) {
+    if (auto it = _entries.find(path); it == _entries.end()) {
+        ++_stats.misses;
+        return nullptr;
+    } else if (it->second.expires <= Clock::now()) {
+        invalidate(path);
+        ++_stats.misses;
+        return nullptr;
+    } else {
+        ++_stats.hits;
+        _order.splice(_order.begin(), _order, it->second.position);
+        return &it->second.stat;
+    }
+}
+
+void
+StatCache::insert(const Stat& stat) {
+    if (_capacity == 0) {
+        return;
+    }
+    auto path = stat.getQid().getPath();
+    if (auto it = _entries.find(path); it != _entries.end()) {
+        it->second.stat = stat;
+        it->second.expires = Clock::now() + _lifetime;
+        _order.splice(_order.begin(), _order, it->second.position);
+        return;
+    }
+    while (_entries.size() >= _capacity) {
+        invalidate(_order.back());
+    }
+    _order.emplace_front(path);
+    _entries.emplace(path, Entry { stat, Clock::now() + _lifetime, _order.begin() });
+}
+
+size_t
+StatCache::prefill(const std::vector<uint8_t>& directoryData) {
+    size_t count = 0;
+    size_t position = 0;
+    // every record starts with its own two byte length, a directory read
+    // only ever returns whole records but be careful about the tail anyway
+    while (position + 2 <= directoryData.size()) {
+        auto length = build(directoryData[position], directoryData[position + 1]);
+        if (position + 2 + length > directoryData.size()) {
+            break;
+        }
+        MessageStream msg;
+        msg.str(std::string(directoryData.begin() + position, directoryData.begin() + position + 2 + length));
+        Stat stat;
+        msg >> stat;
+        insert(stat);
+        ++count;
+        position += 2 + length;
+    }
+    _stats.prefilled += count;
+    return count;
+}
+
+void
+StatCache::invalidate(uint64_t path) {
+    if (auto it = _entries.find(path); it != _entries.end()) {
+        _order.erase(it->second.position);
+        _entries.erase(it);
+    }
+}
+
+void
+StatCache::clear() {
+    _entries.clear();
+    _order.clear();
+}
+
+} // end namespace kzr
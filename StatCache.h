@@ -0,0 +1,90 @@
+/**
+ * @file
+ * Client side cache of file metadata
+ * @copyright
+ * libkzr
+ * Copyright (c) 2019, Joshua Scoggins 
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR 
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef KZR_STAT_CACHE_H__
+#define KZR_STAT_CACHE_H__
+#include <cstdint>
+#include <chrono>
+#include <list>
+#include <vector>
+#include <unordered_map>
+#include "Message.h"
+
+namespace kzr {
+
+/**
+ * Holds on to Stat records keyed by the qid path of the file they describe.
+ * Besides the results of Tstat, the cache can be filled from the contents of
+ * a directory read since those are a run of complete Stat records. Entries
+ * live for a fixed amount of time and the least recently used ones are
+ * dropped once the cache is full.
+ */
+class StatCache {
+    public:
+        using Clock = std::chrono::steady_clock;
+        struct Statistics {
+            uint64_t hits = 0;
+            uint64_t misses = 0;
+            uint64_t prefilled = 0;
+        };
+    public:
+        explicit StatCache(size_t capacity = 4096, Clock::duration lifetime = std::chrono::seconds(2));
+        /**
+         * @return the cached record or nullptr if it is missing or expired
+         */
+        const Stat* find(uint64_t path);
+        void insert(const Stat& stat);
+        /**
+         * Decode every complete Stat record in the payload of a directory
+         * read and add them to the cache.
+         * @return the number of records added
+         */
+        size_t prefill(const std::vector<uint8_t>& directoryData);
+        void invalidate(uint64_t path);
+        void clear();
+        auto size() const noexcept { return _entries.size(); }
+        constexpr auto getCapacity() const noexcept { return _capacity; }
+        void setLifetime(Clock::duration value) noexcept { _lifetime = value; }
+        const Statistics& getStatistics() const noexcept { return _stats; }
+    private:
+        struct Entry {
+            Stat stat;
+            Clock::time_point expires;
+            std::list<uint64_t>::iterator position;
+        };
+    private:
+        size_t _capacity;
+        Clock::duration _lifetime;
+        std::unordered_map<uint64_t, Entry> _entries;
+        /// most recently used at the front
+        std::list<uint64_t> _order;
+        Statistics _stats;
+};
+
+} // end namespace kzr
+
+#endif // end KZR_STAT_CACHE_H__
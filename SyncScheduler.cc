@@ -0,0 +1,187 @@
+/**
+ * @file
+ * Group commit of durability requests implementation
+ * @copyright
+ * libkzr
+ * Copyright (c) 2019, Joshua Scoggins 
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR 
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "SyncScheduler.h"
+#include <algorithm>
+#include <cerrno>
+#include <iterator>
+#include <unistd.h>
+
+namespace kzr {
+
+SyncScheduler::SyncScheduler(IoPool& pool) : SyncScheduler(pool, Policy()) { }
+
+SyncScheduler::SyncScheduler(IoPool& pool, const Policy& policy) : _pool(pool), _policy(policy) {
+    _timer = std::thread([this]() { run(); });
+}
+
+SyncScheduler::~SyncScheduler() {
+    {
+        std::lock_guard<std::mutex> guard(_lock);
+        _stopping = true;
+    }
+    _wake.notify_all();
+    _timer.join();
+    // the pool calls back into us so wait for it to be done
+    std::unique_lock<std::mutex> guard(_lock);
+    _idle.wait(guard, [this]() { return _inFlight == 0; });
+}
+
+void
+SyncScheduler::request(uint64_t file, int fd, std::shared_ptr<const void> owner, Callback callback) {
+    bool wake = false;
+    {
+        std::lock_guard<std::mutex> guard(_lock);
+        auto now = Clock::now();
+        if (_pending.empty()) {
+            // the first request opens the window
+            _deadline = now + _policy.window;
+            wake = true;
+        }
+        auto& pending = _pending[file];
+        if (!pending.owner) {
+            pending.fd = fd;
+            pending.owner = std::move(owner);
+        }
+        pending.waiters.push_back(Waiter { std::move(callback), now });
+        ++_pendingRequests;
+        ++_stats.requests;
+        if (_pendingRequests >= _policy.maximumBatch) {
+            _kicked = true;
+            wake = true;
+        }
+    }
+    if (wake) {
+        _wake.notify_all();
+    }
+}
+
+void
+SyncScheduler::kick() {
+    {
+        std::lock_guard<std::mutex> guard(_lock);
+        _kicked = true;
+    }
+    _wake.notify_all();
+}
+
+void
+SyncScheduler::run() {
+    std::unique_lock<std::mutex> guard(_lock);
+    while (true) {
+        if (_pending.empty()) {
+            if (_stopping) {
+                return;
+            }
+            _kicked = false;
+            _wake.wait(guard);
+            continue;
+        }
+        if (!_kicked && !_stopping && Clock::now() < _deadline) {
+            _wake.wait_until(guard, _deadline);
+            continue;
+        }
+        Batch batch;
+        batch.swap(_pending);
+        _stats.largestBatch = std::max<uint64_t>(_stats.largestBatch, _pendingRequests);
+        ++_stats.batches;
+        _pendingRequests = 0;
+        _kicked = false;
+        guard.unlock();
+        issue(std::move(batch));
+        guard.lock();
+    }
+}
+
+void
+SyncScheduler::issue(Batch&& batch) {
+    std::unique_lock<std::mutex> guard(_lock);
+    auto policy = _policy;
+    if (policy.syncfsThreshold != 0 && batch.size() >= policy.syncfsThreshold) {
+        // one call covers every file of the filesystem, the batch is assumed
+        // to live on a single one
+        ++_stats.filesystemSyncs;
+        ++_inFlight;
+        guard.unlock();
+        auto waiters = std::make_shared<std::vector<Waiter>>();
+        std::vector<std::shared_ptr<const void>> owners;
+        auto fd = batch.begin()->second.fd;
+        for (auto& [file, pending] : batch) {
+            std::move(pending.waiters.begin(), pending.waiters.end(), std::back_inserter(*waiters));
+            owners.emplace_back(std::move(pending.owner));
+        }
+        _pool.post([this, waiters, owners = std::move(owners), fd]() {
+            finish(*waiters, ::syncfs(fd) == 0 ? 0 : errno);
+        });
+        return;
+    }
+    _stats.fileSyncs += batch.size();
+    _inFlight += batch.size();
+    guard.unlock();
+    for (auto& [file, pending] : batch) {
+        auto waiters = std::make_shared<std::vector<Waiter>>(std::move(pending.waiters));
+        auto owner = std::move(pending.owner);
+        _pool.sync(pending.fd, policy.dataOnly, [this, waiters, owner](IoPool::Result&& result) {
+            finish(*waiters, result.count < 0 ? result.error : 0);
+        });
+    }
+}
+
+void
+SyncScheduler::finish(std::vector<Waiter>& waiters, int error) {
+    auto now = Clock::now();
+    for (auto& waiter : waiters) {
+        waiter.callback(error);
+    }
+    std::lock_guard<std::mutex> guard(_lock);
+    for (auto& waiter : waiters) {
+        _stats.totalLatency += now - waiter.since;
+    }
+    --_inFlight;
+    _idle.notify_all();
+}
+
+void
+SyncScheduler::setPolicy(const Policy& policy) {
+    std::lock_guard<std::mutex> guard(_lock);
+    _policy = policy;
+}
+
+SyncScheduler::Policy
+SyncScheduler::getPolicy() {
+    std::lock_guard<std::mutex> guard(_lock);
+    return _policy;
+}
+
+SyncScheduler::Statistics
+SyncScheduler::getStatistics() {
+    std::lock_guard<std::mutex> guard(_lock);
+    return _stats;
+}
+
+} // end namespace kzr
@@ -0,0 +1,148 @@
+/**
+ * @file
+ * Group commit of durability requests
+ * @copyright
+ * libkzr
+ * Copyright (c) 2019, Joshua Scoggins 
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR 
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef KZR_SYNC_SCHEDULER_H__
+#define KZR_SYNC_SCHEDULER_H__
+#include <cstdint>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "IoPool.h"
+
+namespace kzr {
+
+/**
+ * Collects requests to make files durable over a short window and issues a
+ * single fsync (or fdatasync) per file for all of them, or a single syncfs
+ * when enough files are involved, completing every waiting request together.
+ *
+ * A request which arrives while a sync of its file is already running waits
+ * for the next batch since the writes it wants covered may have missed the
+ * running one.
+ */
+class SyncScheduler {
+    public:
+        using Clock = std::chrono::steady_clock;
+        /**
+         * Called with zero on success and errno otherwise
+         */
+        using Callback = std::function<void(int)>;
+        struct Policy {
+            /**
+             * How long the first request of a batch waits for others to join
+             * it, longer windows mean fewer syncs but slower responses
+             */
+            Clock::duration window = std::chrono::milliseconds(2);
+            /**
+             * A batch is started early once this many requests are waiting
+             */
+            size_t maximumBatch = 128;
+            /**
+             * Use fdatasync instead of fsync
+             */
+            bool dataOnly = true;
+            /**
+             * Use one syncfs instead of per file syncs once a batch spans
+             * this many files, zero never does
+             */
+            size_t syncfsThreshold = 0;
+        };
+        struct Statistics {
+            uint64_t requests = 0;
+            uint64_t batches = 0;
+            uint64_t fileSyncs = 0;
+            uint64_t filesystemSyncs = 0;
+            uint64_t largestBatch = 0;
+            /**
+             * Time from request to completion summed over all requests
+             */
+            Clock::duration totalLatency = Clock::duration::zero();
+        };
+    public:
+        explicit SyncScheduler(IoPool& pool);
+        SyncScheduler(IoPool& pool, const Policy& policy);
+        /**
+         * Issues whatever is still waiting and returns once it is done
+         */
+        ~SyncScheduler();
+        SyncScheduler(const SyncScheduler&) = delete;
+        SyncScheduler& operator=(const SyncScheduler&) = delete;
+        /**
+         * Ask for the file to be made durable
+         * @param file identifies the file, requests for the same file share a
+         * sync no matter which descriptor they come with
+         * @param owner keeps the descriptor open until the sync is done
+         */
+        void request(uint64_t file, int fd, std::shared_ptr<const void> owner, Callback callback);
+        /**
+         * Issue the waiting requests now instead of at the end of the window
+         */
+        void kick();
+        void setPolicy(const Policy& policy);
+        Policy getPolicy();
+        Statistics getStatistics();
+    private:
+        struct Waiter {
+            Callback callback;
+            Clock::time_point since;
+        };
+        struct PendingFile {
+            int fd;
+            std::shared_ptr<const void> owner;
+            std::vector<Waiter> waiters;
+        };
+        using Batch = std::unordered_map<uint64_t, PendingFile>;
+        void run();
+        void issue(Batch&& batch);
+        void finish(std::vector<Waiter>& waiters, int error);
+    private:
+        IoPool& _pool;
+        std::mutex _lock;
+        std::condition_variable _wake;
+        std::condition_variable _idle;
+        Policy _policy;
+        Statistics _stats;
+        Batch _pending;
+        size_t _pendingRequests = 0;
+        Clock::time_point _deadline;
+        bool _kicked = false;
+        bool _stopping = false;
+        /**
+         * Syncs handed to the pool which have not completed yet
+         */
+        size_t _inFlight = 0;
+        std::thread _timer;
+};
+
+} // end namespace kzr
+
+#endif // end KZR_SYNC_SCHEDULER_H__
@@ -0,0 +1,516 @@
+/**
+ * @file
+ * A backend which layers the namespaces of several backends implementation
+ * @copyright
+ * libkzr
+ * Copyright (c) 2019, Joshua Scoggins 
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR 
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "UnionFileServer.h"
+#include "AccessPermissions.h"
+#include "MessageStream.h"
+#include <condition_variable>
+#include <mutex>
+
+namespace kzr {
+
+namespace {
+// where the fields needed to merge directories sit in an encoded stat, the
+// offsets count the size field at the front
+constexpr size_t statQidPathOffset = 2 + 2 + 4 + 1 + 4;
+constexpr size_t statNameOffset = statQidPathOffset + 8 + 4 + 4 + 4 + 8;
+
+constexpr uint64_t
+memberSalt(size_t member) noexcept {
+    return uint64_t(member) * 0x9E3779B97F4A7C15ull;
+}
+
+/**
+ * Translate the qid path of the encoded stat at the given position
+ */
+void
+saltPath(std::string& data, size_t at, size_t member) {
+    auto salt = memberSalt(member);
+    for (size_t i = 0; i < 8; ++i) {
+        data[at + statQidPathOffset + i] ^= char(uint8_t(salt >> (8 * i)));
+    }
+}
+} // end namespace
+
+UnionFileServer::UnionFileServer(const std::vector<std::reference_wrapper<Backend>>& members) {
+    for (auto& member : members) {
+        bind(member.get());
+    }
+}
+
+void
+UnionFileServer::bind(Backend& member, const std::string& aname) {
+    _members.emplace_back(Member { &member, aname });
+}
+
+UnionFileServer::FidEntry&
+UnionFileServer::lookup(uint32_t fid) {
+    if (auto it = _fids.find(fid); it != _fids.end()) {
+        return it->second;
+    } else {
+        throw Exception("unknown fid");
+    }
+}
+
+void
+UnionFileServer::parallel(size_t count, const std::function<void(size_t)>& job) {
+    if (!_pool || count < 2) {
+        for (size_t i = 0; i < count; ++i) {
+            job(i);
+        }
+        return;
+    }
+    std::mutex lock;
+    std::condition_variable done;
+    size_t remaining = count - 1;
+    for (size_t i = 1; i < count; ++i) {
+        _pool->post([&, i]() {
+                    job(i);
+                    std::lock_guard<std::mutex> guard(lock);
+                    if (--remaining == 0) {
+                        done.notify_one();
+                    }
+                });
+    }
+    // the calling thread takes the first member instead of sitting idle
+    job(0);
+    std::unique_lock<std::mutex> guard(lock);
+    done.wait(guard, [&remaining]() { return remaining == 0; });
+}
+
+uint32_t
+UnionFileServer::allocate() {
+    if (_freeFids.empty()) {
+        return _nextFid++;
+    }
+    auto fid = _freeFids.back();
+    _freeFids.pop_back();
+    return fid;
+}
+
+void
+UnionFileServer::clunkLayers(const std::vector<Layer>& layers) {
+    parallel(layers.size(), [this, &layers](size_t i) {
+                ClunkRequest req;
+                req.setFid(layers[i].fid);
+                try {
+                    memberOf(layers[i]).clunk(req);
+                } catch (std::exception&) {
+                    // the member forgets the fid either way
+                }
+            });
+    for (const auto& layer : layers) {
+        _freeFids.emplace_back(layer.fid);
+    }
+}
+
+Qid
+UnionFileServer::translate(const Layer& layer) const noexcept {
+    auto qid = layer.qid;
+    qid.setPath(qid.getPath() ^ memberSalt(layer.member));
+    return qid;
+}
+
+std::vector<std::optional<UnionFileServer::Layer>>
+UnionFileServer::step(const std::vector<Layer>& from, const std::vector<std::string>& names, std::string& error) {
+    std::vector<std::optional<Layer>> results(from.size());
+    std::vector<std::string> errors(from.size());
+    std::vector<uint32_t> fids;
+    for (size_t i = 0; i < from.size(); ++i) {
+        fids.emplace_back(allocate());
+    }
+    parallel(from.size(), [&](size_t i) {
+                WalkRequest req;
+                req.setFid(from[i].fid);
+                req.setNewFid(fids[i]);
+                req.getWname() = names;
+                try {
+                    auto response = memberOf(from[i]).walk(req);
+                    if (const auto& qids = response.getWqid(); qids.size() == names.size()) {
+                        results[i] = Layer { from[i].member, fids[i], qids.empty() ? from[i].qid : qids.back() };
+                    }
+                } catch (std::exception& e) {
+                    errors[i] = e.what();
+                }
+            });
+    for (size_t i = 0; i < from.size(); ++i) {
+        if (!results[i]) {
+            _freeFids.emplace_back(fids[i]);
+        }
+        if (error.empty() && !errors[i].empty()) {
+            error = errors[i];
+        }
+    }
+    return results;
+}
+
+AttachResponse
+UnionFileServer::attach(const AttachRequest& request) {
+    if (_members.empty()) {
+        throw Exception("nothing bound to the union");
+    } else if (_fids.count(request.getFid()) != 0) {
+        throw Exception("fid already in use");
+    }
+    std::vector<std::optional<Layer>> roots(_members.size());
+    std::vector<std::string> errors(_members.size());
+    std::vector<uint32_t> fids;
+    for (size_t i = 0; i < _members.size(); ++i) {
+        fids.emplace_back(allocate());
+    }
+    parallel(_members.size(), [&](size_t i) {
+                AttachRequest req;
+                req.setFid(fids[i]);
+                req.setAuthenticationHandle(nofid);
+                req.setUserName(request.getUserName());
+                req.setAttachName(_members[i].aname);
+                try {
+                    roots[i] = Layer { i, fids[i], _members[i].backend->attach(req).getQid() };
+                } catch (std::exception& e) {
+                    errors[i] = e.what();
+                }
+            });
+    FidEntry entry;
+    std::string error;
+    for (size_t i = 0; i < roots.size(); ++i) {
+        if (roots[i]) {
+            entry.layers.emplace_back(*roots[i]);
+        } else {
+            _freeFids.emplace_back(fids[i]);
+            if (error.empty()) {
+                error = errors[i];
+            }
+        }
+    }
+    // every member has to be there, otherwise the tree would silently
+    // change shape
+    if (!error.empty()) {
+        clunkLayers(entry.layers);
+        throw Exception(error);
+    }
+    AttachResponse response;
+    response.setQid(translate(entry.layers.front()));
+    _fids.emplace(request.getFid(), std::move(entry));
+    return response;
+}
+
+WalkResponse
+UnionFileServer::walk(const WalkRequest& request) {
+    auto& source = lookup(request.getFid());
+    if (source.open) {
+        throw Exception("fid already open");
+    } else if (request.getNewFid() != request.getFid() && _fids.count(request.getNewFid()) != 0) {
+        throw Exception("fid already in use");
+    }
+    WalkResponse response;
+    const auto& names = request.getWname();
+    std::string error;
+    auto current = source.layers;
+    // whether current holds fids made by this walk rather than those of the
+    // source fid
+    bool owned = false;
+    if (names.empty()) {
+        auto results = step(current, names, error);
+        current.clear();
+        for (auto& result : results) {
+            if (result) {
+                current.emplace_back(*result);
+            }
+        }
+        if (current.size() != results.size()) {
+            clunkLayers(current);
+            throw Exception(error);
+        }
+        owned = true;
+    }
+    for (size_t i = 0; i < names.size(); ++i) {
+        auto results = step(current, { names[i] }, error);
+        std::vector<Layer> next;
+        std::vector<Layer> unused;
+        for (auto& result : results) {
+            if (!result) {
+                continue;
+            }
+            // the first member with the name decides what it is, lower
+            // directories are merged into a directory and a file hides
+            // everything below it
+            if (next.empty() || (next.front().qid.isDirectory() && result->qid.isDirectory())) {
+                next.emplace_back(*result);
+            } else {
+                unused.emplace_back(*result);
+            }
+        }
+        clunkLayers(unused);
+        if (owned) {
+            clunkLayers(current);
+        }
+        if (next.empty()) {
+            if (i == 0) {
+                throw Exception(error.empty() ? "file does not exist" : error);
+            }
+            return response;
+        }
+        current = std::move(next);
+        owned = true;
+        response.getWqid().emplace_back(translate(current.front()));
+    }
+    if (request.getNewFid() == request.getFid()) {
+        clunkLayers(source.layers);
+        source.layers = std::move(current);
+    } else {
+        FidEntry entry;
+        entry.layers = std::move(current);
+        _fids.emplace(request.getNewFid(), std::move(entry));
+    }
+    return response;
+}
+
+OpenResponse
+UnionFileServer::open(const OpenRequest& request) {
+    auto& entry = lookup(request.getFid());
+    if (entry.open) {
+        throw Exception("fid already open");
+    }
+    auto mode = request.getMode();
+    auto& top = entry.layers.front();
+    OpenResponse response;
+    if (!top.qid.isDirectory()) {
+        auto req = request;
+        req.setFid(top.fid);
+        response = memberOf(top).open(req);
+        top.qid = response.getQid();
+    } else {
+        if (allowsWriting(mode) || hasMode(mode, OpenMode::Truncate)) {
+            throw Exception("is a directory");
+        }
+        std::vector<std::string> errors(entry.layers.size());
+        parallel(entry.layers.size(), [&](size_t i) {
+                    OpenRequest req;
+                    req.setFid(entry.layers[i].fid);
+                    // only the directory the union answers for goes away
+                    // on clunk
+                    req.setMode(i == 0 ? mode : uint8_t(mode & ~uint8_t(OpenMode::RemoveOnClose)));
+                    try {
+                        memberOf(entry.layers[i]).open(req);
+                    } catch (std::exception& e) {
+                        errors[i] = e.what();
+                    }
+                });
+        if (!errors.front().empty()) {
+            throw Exception(errors.front());
+        }
+        // a lower directory which can't be read is left out of the listing
+        std::vector<Layer> kept;
+        std::vector<Layer> dropped;
+        for (size_t i = 0; i < entry.layers.size(); ++i) {
+            (errors[i].empty() ? kept : dropped).emplace_back(entry.layers[i]);
+        }
+        clunkLayers(dropped);
+        entry.layers = std::move(kept);
+        entry.directory = DirectoryState();
+        // zero tells the client to use msize - 24
+        response.setIounit(0);
+    }
+    entry.open = true;
+    response.setQid(translate(entry.layers.front()));
+    return response;
+}
+
+CreateResponse
+UnionFileServer::create(const CreateRequest& request) {
+    auto& entry = lookup(request.getFid());
+    if (entry.open) {
+        throw Exception("fid already open");
+    }
+    auto& top = entry.layers.front();
+    auto req = request;
+    req.setFid(top.fid);
+    auto response = memberOf(top).create(req);
+    top.qid = response.getQid();
+    // the fid now stands for the new file, which only the top member has
+    std::vector<Layer> rest(entry.layers.begin() + 1, entry.layers.end());
+    entry.layers.resize(1);
+    clunkLayers(rest);
+    entry.open = true;
+    entry.directory = DirectoryState();
+    response.setQid(translate(entry.layers.front()));
+    return response;
+}
+
+void
+UnionFileServer::readDirectory(FidEntry& entry, const ReadRequest& request, std::vector<uint8_t>& output) {
+    auto& state = entry.directory;
+    if (request.getOffset() == 0) {
+        state = DirectoryState();
+    } else if (request.getOffset() != state.offset) {
+        // members can only be resumed where the last read stopped
+        throw Exception("bad directory offset");
+    }
+    auto count = request.getCount();
+    while (true) {
+        // only whole entries are ever returned
+        while (state.consumed < state.pending.size()) {
+            auto at = state.consumed;
+            size_t length = 2 + build(uint8_t(state.pending[at]), uint8_t(state.pending[at + 1]));
+            if (output.size() + length > count) {
+                if (output.empty()) {
+                    throw Exception("read count too small for directory entry");
+                }
+                state.offset += output.size();
+                return;
+            }
+            output.insert(output.end(), state.pending.begin() + at, state.pending.begin() + at + length);
+            state.consumed += length;
+        }
+        state.pending.clear();
+        state.consumed = 0;
+        if (state.layer >= entry.layers.size() || output.size() >= count) {
+            break;
+        }
+        const auto& layer = entry.layers[state.layer];
+        ReadRequest req;
+        req.setFid(layer.fid);
+        req.setOffset(state.layerOffset);
+        req.setCount(count);
+        auto data = memberOf(layer).read(req).getData();
+        if (data.empty()) {
+            ++state.layer;
+            state.layerOffset = 0;
+            continue;
+        }
+        state.layerOffset += data.size();
+        bool below = state.layer + 1 < entry.layers.size();
+        for (size_t at = 0; at < data.size();) {
+            if (at + statNameOffset + 2 > data.size()) {
+                throw Exception("malformed directory entry");
+            }
+            size_t length = 2 + build(data[at], data[at + 1]);
+            size_t nameLength = build(data[at + statNameOffset], data[at + statNameOffset + 1]);
+            if (at + length > data.size() || statNameOffset + 2 + nameLength > length) {
+                throw Exception("malformed directory entry");
+            }
+            std::string name(data.begin() + at + statNameOffset + 2, data.begin() + at + statNameOffset + 2 + nameLength);
+            // a name seen in a higher member hides this one
+            if (state.seen.count(name) == 0) {
+                if (below) {
+                    state.seen.emplace(std::move(name));
+                }
+                auto start = state.pending.size();
+                state.pending.append(data.begin() + at, data.begin() + at + length);
+                saltPath(state.pending, start, layer.member);
+            }
+            at += length;
+        }
+    }
+    state.offset += output.size();
+}
+
+ReadResponse
+UnionFileServer::read(const ReadRequest& request) {
+    auto& entry = lookup(request.getFid());
+    if (!entry.open) {
+        throw Exception("fid not open for reading");
+    }
+    auto& top = entry.layers.front();
+    if (top.qid.isDirectory()) {
+        ReadResponse response;
+        readDirectory(entry, request, response.getData());
+        return response;
+    }
+    auto req = request;
+    req.setFid(top.fid);
+    return memberOf(top).read(req);
+}
+
+WriteResponse
+UnionFileServer::write(const WriteRequest& request) {
+    auto& top = lookup(request.getFid()).layers.front();
+    auto req = request;
+    req.setFid(top.fid);
+    return memberOf(top).write(req);
+}
+
+ClunkResponse
+UnionFileServer::clunk(const ClunkRequest& request) {
+    auto layers = std::move(lookup(request.getFid()).layers);
+    _fids.erase(request.getFid());
+    clunkLayers(layers);
+    return ClunkResponse();
+}
+
+RemoveResponse
+UnionFileServer::remove(const RemoveRequest& request) {
+    auto layers = std::move(lookup(request.getFid()).layers);
+    _fids.erase(request.getFid());
+    auto top = layers.front();
+    layers.erase(layers.begin());
+    clunkLayers(layers);
+    auto req = request;
+    req.setFid(top.fid);
+    // the fid is clunked even if the remove fails
+    try {
+        auto response = memberOf(top).remove(req);
+        _freeFids.emplace_back(top.fid);
+        return response;
+    } catch (...) {
+        _freeFids.emplace_back(top.fid);
+        throw;
+    }
+}
+
+StatResponse
+UnionFileServer::stat(const StatRequest& request) {
+    auto& top = lookup(request.getFid()).layers.front();
+    auto req = request;
+    req.setFid(top.fid);
+    auto response = memberOf(top).stat(req);
+    if (response.getData().size() < statNameOffset) {
+        throw Exception("malformed stat");
+    }
+    saltPath(response.getData(), 0, top.member);
+    return response;
+}
+
+WStatResponse
+UnionFileServer::wstat(const WStatRequest& request) {
+    auto& top = lookup(request.getFid()).layers.front();
+    auto req = request;
+    req.setFid(top.fid);
+    return memberOf(top).wstat(req);
+}
+
+void
+UnionFileServer::reset() {
+    _fids.clear();
+    _freeFids.clear();
+    _nextFid = 0;
+    for (auto& member : _members) {
+        member.backend->reset();
+    }
+}
+
+} // end namespace kzr
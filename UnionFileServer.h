@@ -0,0 +1,149 @@
+/**
+ * @file
+ * A backend which layers the namespaces of several backends
+ * @copyright
+ * libkzr
+ * Copyright (c) 2019, Joshua Scoggins 
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR 
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef KZR_UNION_FILE_SERVER_H__
+#define KZR_UNION_FILE_SERVER_H__
+#include <cstdint>
+#include <functional>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include "Backend.h"
+#include "IoPool.h"
+
+namespace kzr {
+
+/**
+ * Presents several backends (ram, passthrough or remote) as a single tree,
+ * in the manner of a plan9 union directory. Members are bound in priority
+ * order: a name is resolved in the first member which has it, directories of
+ * the same name in lower members are merged into it and reading a directory
+ * streams the entries of every member, dropping names already returned by a
+ * higher one. New files are created in (and writes, wstats and removes go
+ * to) the highest member the directory is found in.
+ *
+ * Each walk step is looked up in every member holding the directory at once
+ * when an IoPool is given, otherwise one after the other. Like the backends
+ * it is made of, an instance serves a single connection; the members must
+ * not be used by anything else while it is.
+ */
+class UnionFileServer : public Backend {
+    public:
+        UnionFileServer() = default;
+        explicit UnionFileServer(const std::vector<std::reference_wrapper<Backend>>& members);
+        /**
+         * Add a member below every member bound before it
+         * @param aname the attach name passed on to the member
+         */
+        void bind(Backend& member, const std::string& aname = "");
+        /**
+         * Carry out lookups in every member in parallel, the pool must
+         * outlive the server. Pass nullptr to go back to serial lookups.
+         */
+        void setIoPool(IoPool* pool) noexcept { _pool = pool; }
+        auto getMemberCount() const noexcept { return _members.size(); }
+        AttachResponse attach(const AttachRequest&) override;
+        WalkResponse walk(const WalkRequest&) override;
+        OpenResponse open(const OpenRequest&) override;
+        CreateResponse create(const CreateRequest&) override;
+        ReadResponse read(const ReadRequest&) override;
+        WriteResponse write(const WriteRequest&) override;
+        ClunkResponse clunk(const ClunkRequest&) override;
+        RemoveResponse remove(const RemoveRequest&) override;
+        StatResponse stat(const StatRequest&) override;
+        WStatResponse wstat(const WStatRequest&) override;
+        void reset() override;
+    private:
+        struct Member {
+            Backend* backend;
+            std::string aname;
+        };
+        /**
+         * Where a union fid lives in one of the members
+         */
+        struct Layer {
+            size_t member;
+            uint32_t fid;
+            Qid qid;
+        };
+        /**
+         * How far a read of a union directory has gotten
+         */
+        struct DirectoryState {
+            size_t layer = 0;
+            uint64_t layerOffset = 0;
+            uint64_t offset = 0;
+            /**
+             * Whole records read from a member but not handed out yet
+             */
+            std::string pending;
+            size_t consumed = 0;
+            std::unordered_set<std::string> seen;
+        };
+        struct FidEntry {
+            /**
+             * Highest priority first, only directories have more than one
+             */
+            std::vector<Layer> layers;
+            bool open = false;
+            DirectoryState directory;
+        };
+    private:
+        FidEntry& lookup(uint32_t fid);
+        Backend& memberOf(const Layer& layer) const { return *_members[layer.member].backend; }
+        /**
+         * Run job(0) ... job(count - 1), spread across the pool when there
+         * is one. The jobs must not throw.
+         */
+        void parallel(size_t count, const std::function<void(size_t)>& job);
+        /**
+         * Walk every layer along the names at once, a layer is only kept
+         * when the whole walk succeeds in it
+         * @param error set to the first error reported by any member
+         */
+        std::vector<std::optional<Layer>> step(const std::vector<Layer>& from, const std::vector<std::string>& names, std::string& error);
+        uint32_t allocate();
+        void clunkLayers(const std::vector<Layer>& layers);
+        /**
+         * Keep the qids of different members apart, the first member keeps
+         * its own
+         */
+        Qid translate(const Layer& layer) const noexcept;
+        void readDirectory(FidEntry& entry, const ReadRequest& request, std::vector<uint8_t>& output);
+    private:
+        std::vector<Member> _members;
+        IoPool* _pool = nullptr;
+        std::unordered_map<uint32_t, FidEntry> _fids;
+        uint32_t _nextFid = 0;
+        std::vector<uint32_t> _freeFids;
+};
+
+} // end namespace kzr
+
+#endif // end KZR_UNION_FILE_SERVER_H__
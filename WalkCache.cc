@@ -0,0 +1,219 @@
+/**
+ * @file
+ * Client side cache of walk results implementation
+ * @copyright
+ * libkzr
+ * Copyright (c) 2019, Joshua Scoggins 
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR 
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "WalkCache.h"
+#include <algorithm>
+
+namespace kzr {
+
+WalkCache::WalkCache(size_t positiveCapacity, size_t negativeCapacity, Clock::duration positiveLifetime, Clock::duration negativeLifetime) :
+    _positiveCapacity(positiveCapacity),
+    _negativeCapacity(negativeCapacity),
+    _positiveLifetime(positiveLifetime),
+    _negativeLifetime(negativeLifetime) { }
+
+std::string
+WalkCache::makeKey(uint32_t root, const Path& path) {
+    // 9p names cannot contain a NUL so it makes a safe separator
+    std::string key;
+    key.push_back(char(root));
+    key.push_back(char(root >> 8));
+    key.push_back(char(root >> 16));
+    key.push_back(char(root >> 24));
+    for (const auto& name : path) {
+        key.push_back('\0');
+        key += name;
+    }
+    return key;
+}
+
+uint32_t
+WalkCache::rootOf(const std::string& key) noexcept {
+    return build(uint8_t(key[0]), uint8_t(key[1]), uint8_t(key[2]), uint8_t(key[3]));
+}
+
+const WalkCache::Entry*
+WalkCache::find(uint32_t root, const Path& path) {
+    auto key = makeKey(root, path);
+    if (auto it = _entries.find(key); it == _entries.end()) {
+        return nullptr;
+    } else if (it->second.expires <= Clock::now()) {
+        erase(key);
+        return nullptr;
+    } else {
+        auto& order = lruFor(it->second.negative);
+        order.splice(order.begin(), order, it->second.position);
+        return &it->second;
+    }
+}
+
+void
+WalkCache::put(const std::string& key, Entry&& entry) {
+    erase(key);
+    auto& order = lruFor(entry.negative);
+    auto capacity = entry.negative ? _negativeCapacity : _positiveCapacity;
+    if (capacity == 0) {
+        if (!entry.negative) {
+            _released.emplace_back(entry.fid);
+        }
+        return;
+    }
+    while (order.size() >= capacity) {
+        // erase frees the node holding the key so work from a copy
+        auto oldest = order.back();
+        erase(oldest);
+    }
+    order.emplace_front(key);
+    entry.position = order.begin();
+    if (!entry.negative) {
+        _heldFids.emplace(entry.fid);
+    }
+    _byRoot[rootOf(key)].emplace(key);
+    _entries.emplace(key, std::move(entry));
+}
+
+void
+WalkCache::insert(uint32_t root, const Path& path, const std::vector<Qid>& qids, uint32_t fid) {
+    Entry entry;
+    entry.qids = qids;
+    entry.fid = fid;
+    entry.negative = false;
+    entry.expires = Clock::now() + _positiveLifetime;
+    put(makeKey(root, path), std::move(entry));
+}
+
+void
+WalkCache::insertNegative(uint32_t root, const Path& path, const std::vector<Qid>& qids, const std::string& error, std::optional<uint64_t> start) {
+    Entry entry;
+    entry.qids = qids;
+    entry.error = error;
+    if (qids.size() < path.size()) {
+        // the walk stopped in the last directory it got to
+        entry.missing = path[qids.size()];
+        entry.directory = qids.empty() ? start : std::optional<uint64_t>(qids.back().getPath());
+    }
+    entry.negative = true;
+    entry.expires = Clock::now() + _negativeLifetime;
+    put(makeKey(root, path), std::move(entry));
+}
+
+void
+WalkCache::erase(const std::string& key) {
+    if (auto it = _entries.find(key); it != _entries.end()) {
+        auto& entry = it->second;
+        lruFor(entry.negative).erase(entry.position);
+        if (!entry.negative) {
+            _heldFids.erase(entry.fid);
+            _released.emplace_back(entry.fid);
+        }
+        if (auto r = _byRoot.find(rootOf(key)); r != _byRoot.end()) {
+            r->second.erase(key);
+            if (r->second.empty()) {
+                _byRoot.erase(r);
+            }
+        }
+        _entries.erase(it);
+    }
+}
+
+bool
+WalkCache::validate(uint32_t root, const Path& path, const Qid& observed) {
+    auto key = makeKey(root, path);
+    if (auto it = _entries.find(key); it == _entries.end()) {
+        return false;
+    } else if (auto& entry = it->second; entry.negative || entry.qids.empty()) {
+        return false;
+    } else if (const auto& cached = entry.qids.back(); cached.getType() != observed.getType() ||
+                                                      cached.getPath() != observed.getPath() ||
+                                                      cached.getVersion() != observed.getVersion()) {
+        erase(key);
+        return false;
+    } else {
+        return true;
+    }
+}
+
+void
+WalkCache::invalidate(uint32_t root, const Path& path) {
+    erase(makeKey(root, path));
+}
+
+void
+WalkCache::invalidateRoot(uint32_t root) {
+    if (auto it = _byRoot.find(root); it != _byRoot.end()) {
+        // erase modifies the set we are walking so make a copy first
+        std::vector<std::string> keys(it->second.begin(), it->second.end());
+        for (const auto& key : keys) {
+            erase(key);
+        }
+    }
+}
+
+void
+WalkCache::invalidateQid(uint64_t path) {
+    std::vector<std::string> keys;
+    for (const auto& [key, entry] : _entries) {
+        if (std::any_of(entry.qids.begin(), entry.qids.end(), [path](const Qid& q) { return q.getPath() == path; })) {
+            keys.emplace_back(key);
+        }
+    }
+    for (const auto& key : keys) {
+        erase(key);
+    }
+}
+
+void
+WalkCache::invalidateName(const std::string& name, std::optional<uint64_t> directory) {
+    std::vector<std::string> keys;
+    for (const auto& [key, entry] : _entries) {
+        if (entry.negative && entry.missing == name && (!directory || !entry.directory || *entry.directory == *directory)) {
+            keys.emplace_back(key);
+        }
+    }
+    for (const auto& key : keys) {
+        erase(key);
+    }
+}
+
+void
+WalkCache::clear() {
+    while (!_entries.empty()) {
+        // copy the key since erase destroys it
+        auto key = _entries.begin()->first;
+        erase(key);
+    }
+}
+
+std::vector<uint32_t>
+WalkCache::takeReleasedFids() {
+    std::vector<uint32_t> result;
+    result.swap(_released);
+    return result;
+}
+
+} // end namespace kzr
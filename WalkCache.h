@@ -0,0 +1,157 @@
+/**
+ * @file
+ * Client side cache of walk results
+ * @copyright
+ * libkzr
+ * Copyright (c) 2019, Joshua Scoggins 
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR 
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef KZR_WALK_CACHE_H__
+#define KZR_WALK_CACHE_H__
+#include <cstdint>
+#include <chrono>
+#include <list>
+#include <optional>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+#include "Message.h"
+
+namespace kzr {
+
+/**
+ * Remembers the outcome of walks keyed by the fid the walk started from and
+ * the names walked. Successful walks keep a fid open on the server at the end
+ * of the path so that a later walk along the same path can be satisfied by
+ * cloning that fid. Failed walks are remembered as well so that repeated
+ * lookups of missing files do not go over the wire.
+ *
+ * Fids belonging to entries which are dropped are collected and must be
+ * clunked by the owner of the cache (see takeReleasedFids).
+ */
+class WalkCache {
+    public:
+        using Clock = std::chrono::steady_clock;
+        using Path = std::vector<std::string>;
+        struct Entry {
+            /**
+             * The qids returned by the walk, a negative entry holds the
+             * qids of the elements which were walked before the failure
+             */
+            std::vector<Qid> qids;
+            /**
+             * The fid the cache holds at the end of the path, unused for
+             * negative entries
+             */
+            uint32_t fid = 0;
+            /**
+             * The error the server reported, empty when the walk was only
+             * partially successful
+             */
+            std::string error;
+            /**
+             * For a negative entry, the name which was not found and the
+             * qid path of the directory it was looked for in (if known)
+             */
+            std::string missing;
+            std::optional<uint64_t> directory;
+            bool negative = false;
+            Clock::time_point expires;
+            std::list<std::string>::iterator position;
+        };
+    public:
+        explicit WalkCache(size_t positiveCapacity = 1024,
+                size_t negativeCapacity = 256,
+                Clock::duration positiveLifetime = std::chrono::seconds(5),
+                Clock::duration negativeLifetime = std::chrono::seconds(1));
+        /**
+         * Lookup a walk, expired entries are dropped.
+         * @return the entry or nullptr if nothing usable is cached
+         */
+        const Entry* find(uint32_t root, const Path& path);
+        void insert(uint32_t root, const Path& path, const std::vector<Qid>& qids, uint32_t fid);
+        /**
+         * @param start the qid path of the root fid, tells which directory
+         * the walk failed in when it failed at the first name
+         */
+        void insertNegative(uint32_t root, const Path& path, const std::vector<Qid>& qids, const std::string& error = "", std::optional<uint64_t> start = std::nullopt);
+        /**
+         * Compare a qid observed for the file at the end of a cached path
+         * (from an open or stat) against the cached one. The entry is dropped
+         * if the type, path or version differ.
+         * @return true if the entry is still valid
+         */
+        bool validate(uint32_t root, const Path& path, const Qid& observed);
+        void invalidate(uint32_t root, const Path& path);
+        /**
+         * Drop every entry which starts at the given fid, must be called when
+         * the fid is clunked since fid numbers get reused.
+         */
+        void invalidateRoot(uint32_t root);
+        /**
+         * Drop every entry which walks through the file with the given qid
+         * path (it was removed or renamed).
+         */
+        void invalidateQid(uint64_t path);
+        /**
+         * Drop every negative entry which did not find the name in the
+         * directory, whichever root it was walked from, since the name has
+         * just been created or renamed to. Entries of any directory go if it
+         * is not given, as do the entries which don't know their directory.
+         */
+        void invalidateName(const std::string& name, std::optional<uint64_t> directory = std::nullopt);
+        void clear();
+        /**
+         * Hand over the fids of dropped positive entries so they can be
+         * clunked.
+         */
+        std::vector<uint32_t> takeReleasedFids();
+        bool holdsFid(uint32_t fid) const noexcept { return _heldFids.count(fid) != 0; }
+        auto size() const noexcept { return _entries.size(); }
+        constexpr auto getPositiveCapacity() const noexcept { return _positiveCapacity; }
+        constexpr auto getNegativeCapacity() const noexcept { return _negativeCapacity; }
+        void setPositiveLifetime(Clock::duration value) noexcept { _positiveLifetime = value; }
+        void setNegativeLifetime(Clock::duration value) noexcept { _negativeLifetime = value; }
+    private:
+        static std::string makeKey(uint32_t root, const Path& path);
+        static uint32_t rootOf(const std::string& key) noexcept;
+        void put(const std::string& key, Entry&& entry);
+        void erase(const std::string& key);
+        std::list<std::string>& lruFor(bool negative) noexcept { return negative ? _negativeOrder : _positiveOrder; }
+    private:
+        size_t _positiveCapacity;
+        size_t _negativeCapacity;
+        Clock::duration _positiveLifetime;
+        Clock::duration _negativeLifetime;
+        std::unordered_map<std::string, Entry> _entries;
+        std::unordered_map<uint32_t, std::unordered_set<std::string>> _byRoot;
+        std::unordered_set<uint32_t> _heldFids;
+        /// most recently used at the front
+        std::list<std::string> _positiveOrder;
+        std::list<std::string> _negativeOrder;
+        std::vector<uint32_t> _released;
+};
+
+} // end namespace kzr
+
+#endif // end KZR_WALK_CACHE_H__